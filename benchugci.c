@@ -0,0 +1,475 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Microbenchmarks for the direct calls into the devices. Each test runs
+ * the plain call and its faster alternative back to back. With --usbfs,
+ * they run against the boards driven through usbfs instead of hiddev.
+ *
+ * --latency takes the command line of a board emulator that reads ugciemu
+ * commands from its stdin, such as "./ugciemu --gadget", and times play
+ * presses from being written to it until they are delivered, first with
+ * the board on hiddev, then on usbfs.
+ *
+ * --decode takes the same, and moves player 1's stick and buttons on
+ * every report, first decoding per usage, then in report mode. For each,
+ * it shows the time from a report being written until the buttons it
+ * carries are delivered, and the stick events and CPU time spent in
+ * ugci_poll() per report. With --usbfs, the board is on usbfs. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "ugci.h"
+
+static int loops = 10000;
+static unsigned long long played_ns;
+static unsigned long long matched_ns;
+static int want_buttons;
+static int stick_events;
+
+static void report(const char *what, unsigned long long start)
+{
+	unsigned long long ns = ugci_now_ns() - start;
+
+	printf("  %-28s %8llu ns/call\n", what, ns / loops);
+}
+
+static void bench_requests(int id)
+{
+	struct ugci_request *req;
+	unsigned short count;
+	unsigned long long start;
+	int i, value;
+
+	printf("Coin count, player %d:\n", id + 1);
+
+	start = ugci_now_ns();
+	for (i = 0; i < loops; i++)
+		ugci_get_coin_count(id, &count);
+	report("ugci_get_coin_count()", start);
+
+	if (!(req = ugci_prepare(id, UGCI_OP_COIN_COUNT))) {
+		fprintf(stderr, "ugci_prepare failed\n");
+		return;
+	}
+
+	start = ugci_now_ns();
+	for (i = 0; i < loops; i++)
+		ugci_exec(req, &value);
+	report("ugci_exec()", start);
+
+	ugci_free_request(req);
+}
+
+static void bench_coins(int players)
+{
+	unsigned short counts[UGCI_MAX_PLAYERS];
+	unsigned long long start;
+	int i, p;
+
+	printf("Coin counts, %d players:\n", players);
+
+	start = ugci_now_ns();
+	for (i = 0; i < loops; i++)
+		for (p = 0; p < players; p++)
+			ugci_get_coin_count(p, &counts[p]);
+	report("ugci_get_coin_count() each", start);
+
+	start = ugci_now_ns();
+	for (i = 0; i < loops; i++)
+		ugci_get_coin_counts(counts, players);
+	report("ugci_get_coin_counts()", start);
+}
+
+static void bench_secblk(int id)
+{
+	unsigned char values[UGCI_SEC_VALUES];
+	unsigned long long start;
+	int i;
+
+	printf("Security block, device %d:\n", id);
+
+	ugci_set_secblk_cache(0);
+	start = ugci_now_ns();
+	for (i = 0; i < loops; i++)
+		ugci_get_secblk(id, values);
+	report("ugci_get_secblk() uncached", start);
+
+	ugci_set_secblk_cache(1);
+	start = ugci_now_ns();
+	for (i = 0; i < loops; i++)
+		ugci_get_secblk(id, values);
+	report("ugci_get_secblk() cached", start);
+}
+
+static void play_event(const struct ugci_event *ev)
+{
+	if (ev->type == UGCI_EVENT_PLAY && ev->id == 0)
+		played_ns = ugci_now_ns();
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* The board may still be coming up, or going back to usbhid */
+static int open_board(int usbfs, unsigned int mask, const char *what)
+{
+	int tries;
+
+	ugci_set_usbfs(usbfs);
+
+	for (tries = 0; tries < 50; tries++) {
+		if (ugci_init(NULL, mask, 0) > 0)
+			return 0;
+		ugci_close();
+		usleep(100000);
+	}
+
+	printf("  %-28s no board\n", what);
+
+	return -1;
+}
+
+static void print_latency(const char *what, unsigned long long *lat, int n)
+{
+	qsort(lat, n, sizeof(*lat), cmp_ull);
+
+	printf("  %-28s p50 %lluus p99 %lluus max %lluus (%d reports)\n", what,
+	       lat[n / 2] / 1000, lat[n * 99 / 100] / 1000, lat[n - 1] / 1000, n);
+}
+
+static void latency_run(FILE *emu, int usbfs, unsigned long long *lat)
+{
+	unsigned long long start;
+	int n;
+
+	if (open_board(usbfs, UGCI_EVENT_MASK_PLAY, usbfs ? "usbfs" : "hiddev"))
+		return;
+
+	ugci_set_event_callback(play_event);
+
+	for (n = 0; n < loops; n++) {
+		played_ns = 0;
+		fprintf(emu, "%c1\n", n & 1 ? 'r' : 'p');
+		start = ugci_now_ns();
+		fflush(emu);
+
+		while (!played_ns && ugci_now_ns() - start < 1000000000ULL)
+			ugci_poll(100);
+
+		if (!played_ns)
+			break;
+		lat[n] = played_ns - start;
+	}
+
+	ugci_close();
+
+	/* Leave the board released */
+	if (n & 1) {
+		fprintf(emu, "r1\n");
+		fflush(emu);
+	}
+
+	if (!n) {
+		printf("  %-28s no events\n", usbfs ? "usbfs" : "hiddev");
+		return;
+	}
+
+	print_latency(usbfs ? "usbfs" : "hiddev", lat, n);
+}
+
+static void bench_latency(const char *cmd)
+{
+	unsigned long long *lat;
+	FILE *emu;
+
+	if (!(lat = calloc(loops, sizeof(*lat))) || !(emu = popen(cmd, "w"))) {
+		perror(cmd);
+		free(lat);
+		return;
+	}
+
+	printf("Play press to delivery, through %s:\n", cmd);
+
+	latency_run(emu, 0, lat);
+	latency_run(emu, 1, lat);
+
+	pclose(emu);
+	free(lat);
+}
+
+static void stick_event(const struct ugci_event *ev)
+{
+	if (ev->type != UGCI_EVENT_STICK || ev->id != 0)
+		return;
+
+	stick_events++;
+	if (ev->value == want_buttons && !matched_ns)
+		matched_ns = ugci_now_ns();
+}
+
+static unsigned long long cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void decode_run(FILE *emu, int usbfs, int report_mode, unsigned long long *lat)
+{
+	const char *what = report_mode ? "report mode" : "per usage";
+	unsigned long long start, cpu = 0;
+	int n;
+
+	if (open_board(usbfs, UGCI_EVENT_MASK_STICK, what))
+		return;
+
+	ugci_set_report_mode(report_mode);
+	ugci_set_event_callback(stick_event);
+	stick_events = 0;
+
+	/* Every report moves both axes and changes the buttons, and no two
+	 * reports in a row carry the same buttons */
+	for (n = 0; n < loops; n++) {
+		int x = n % 200 - 100;
+
+		want_buttons = n % 127 + 1;
+		matched_ns = 0;
+		fprintf(emu, "s1 %d %d %d\n", x, -x, want_buttons);
+		start = ugci_now_ns();
+		fflush(emu);
+
+		while (!matched_ns && ugci_now_ns() - start < 1000000000ULL) {
+			unsigned long long c = cpu_ns();
+
+			ugci_poll(100);
+			cpu += cpu_ns() - c;
+		}
+
+		if (!matched_ns)
+			break;
+		lat[n] = matched_ns - start;
+	}
+
+	ugci_set_report_mode(0);
+	ugci_close();
+
+	if (!n) {
+		printf("  %-28s no events\n", what);
+		return;
+	}
+
+	print_latency(what, lat, n);
+	printf("  %-28s %.2f stick events, %lluns CPU per report\n", "",
+	       (double)stick_events / n, cpu / n);
+}
+
+static void bench_decode(const char *cmd, int usbfs)
+{
+	unsigned long long *lat;
+	FILE *emu;
+
+	if (!(lat = calloc(loops, sizeof(*lat))) || !(emu = popen(cmd, "w"))) {
+		perror(cmd);
+		free(lat);
+		return;
+	}
+
+	printf("Stick report to delivery on %s, through %s:\n",
+	       usbfs ? "usbfs" : "hiddev", cmd);
+
+	decode_run(emu, usbfs, 0, lat);
+	decode_run(emu, usbfs, 1, lat);
+
+	pclose(emu);
+	free(lat);
+}
+
+/* Needs the devices closed, so it runs before everything else */
+static void bench_init(void)
+{
+	unsigned char buf[504];
+	unsigned long long start, lazy, eager;
+	int i, id, len, rd = 0, n = loops < 100 ? loops : 100;
+
+	start = ugci_now_ns();
+	for (i = 0; i < n; i++) {
+		rd = ugci_init(NULL, 0, 0);
+		ugci_close();
+	}
+	lazy = ugci_now_ns() - start;
+
+	if (rd <= 0)
+		return;
+
+	/* What init used to fetch up front as well, through HIDIOCINITREPORT:
+	 * the eeprom and the serial feature reports */
+	start = ugci_now_ns();
+	for (i = 0; i < n; i++) {
+		rd = ugci_init(NULL, 0, 0);
+		for (id = 0; id < rd; id++) {
+			ugci_get_eeprom(id, buf, &len);
+			ugci_get_secblk(id, buf);
+		}
+		ugci_close();
+	}
+	eager = ugci_now_ns() - start;
+
+	if (rd <= 0)
+		return;
+
+	printf("Init, %d board%s:\n", rd, rd == 1 ? "" : "s");
+	printf("  %-28s %8llu us/board\n", "ugci_init() + ugci_close()",
+	       lazy / n / rd / 1000);
+	printf("  %-28s %8llu us/board\n", "with the feature reports",
+	       eager / n / rd / 1000);
+	printf("  %-28s %8lld us/board\n", "saved at startup",
+	       ((long long)eager - (long long)lazy) / n / rd / 1000);
+}
+
+static void usage(int exitval) __attribute__((__noreturn__));
+static void usage(int exitval)
+{
+	fprintf(exitval ? stderr : stdout, "Usage: benchugci [--help] [--device id] "
+		"[--loops n] [--requests] [--coins] [--secblk] [--init] [--usbfs] "
+		"[--latency emulator] [--decode emulator]\n");
+	exit(exitval);
+}
+
+int main(int argc, char *argv[])
+{
+	int rd, id = 0, requests = 0, coins = 0, secblk = 0, init = 0, usbfs = 0;
+	const char *latency = NULL, *decode = NULL;
+
+	while (1) {
+		int c;
+		static struct option long_options[] = {
+			{"help",	0, NULL, 'h'},
+			{"device",	1, NULL, 'd'},
+			{"loops",	1, NULL, 'n'},
+			{"requests",	0, NULL, 'r'},
+			{"coins",	0, NULL, 'c'},
+			{"secblk",	0, NULL, 's'},
+			{"init",	0, NULL, 'i'},
+			{"usbfs",	0, NULL, 'u'},
+			{"latency",	1, NULL, 'l'},
+			{"decode",	1, NULL, 'D'},
+			{ 0 },
+		};
+
+		c = getopt_long(argc, argv, "hd:n:rcsiul:D:", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'h':
+				usage(0);
+				break;
+
+			case 'd':
+				id = atoi(optarg);
+				break;
+
+			case 'n':
+				loops = atoi(optarg);
+				break;
+
+			case 'r':
+				requests = 1;
+				break;
+
+			case 'c':
+				coins = 1;
+				break;
+
+			case 's':
+				secblk = 1;
+				break;
+
+			case 'i':
+				init = 1;
+				break;
+
+			case 'u':
+				usbfs = 1;
+				break;
+
+			case 'l':
+				latency = optarg;
+				break;
+
+			case 'D':
+				decode = optarg;
+				break;
+
+			default:
+				usage(1);
+		}
+	}
+
+	if (argc != optind || loops <= 0)
+		usage(1);
+
+	/* The emulated board is all these need */
+	if (latency || decode) {
+		if (latency)
+			bench_latency(latency);
+		if (decode)
+			bench_decode(decode, usbfs);
+		exit(0);
+	}
+
+	/* Run everything if nothing in particular was asked for */
+	if (!requests && !coins && !secblk && !init)
+		requests = coins = secblk = init = 1;
+
+	ugci_set_usbfs(usbfs);
+
+	if (init)
+		bench_init();
+
+	rd = ugci_init(NULL, 0, 1);
+
+	printf("Detected %d UGCI device%s\n", rd, rd == 1 ? "" : "s");
+
+	if (rd <= 0)
+		exit(0);
+
+	if (requests)
+		bench_requests(id * 2);
+
+	if (coins)
+		bench_coins(rd * 2);
+
+	if (secblk)
+		bench_secblk(id);
+
+	ugci_close();
+
+	exit(0);
+}
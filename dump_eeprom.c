@@ -24,19 +24,27 @@
 
 #include "ugci.h"
 
+static const char *input_names[UGCI_INPUTS] = {
+	"coin", "play", "up", "down", "left", "right",
+	"b1", "b2", "b3", "b4", "b5", "b6", "b7",
+};
+
 static void usage(int exitval) __attribute__((__noreturn__));
 static void usage(int exitval)
 {
-	fprintf(exitval ? stderr : stdout, "Usage: dump_eeprom [--help] [--device id] [--raw]\n");
+	fprintf(exitval ? stderr : stdout, "Usage: dump_eeprom [--help] [--device id] [--raw] "
+		"[--write file]\n");
 	exit(exitval);
 }
 
 int main(int argc, char *argv[])
 {
-	int i;
+	int i, p;
 	int rd, id = 0, raw = 0;
+	struct ugci_keymap map;
 	unsigned char eeprom[512];
 	int eeprom_len;
+	char *image = NULL;
 
 	while (1) {
 		int c;
@@ -44,10 +52,11 @@ int main(int argc, char *argv[])
 			{"help",	0, NULL, 'h'},
 			{"device",	1, NULL, 'd'},
 			{"raw",		0, NULL, 'r'},
+			{"write",	1, NULL, 'w'},
 			{ 0 },
 		};
 
-		c = getopt_long(argc, argv, "hd:r", long_options, NULL);
+		c = getopt_long(argc, argv, "hd:rw:", long_options, NULL);
 		if (c == -1)
 			break;
 
@@ -63,6 +72,10 @@ int main(int argc, char *argv[])
 			case 'r':
 				raw = 1;
 				break;
+
+			case 'w':
+				image = optarg;
+				break;
 		}
 	}
 
@@ -77,6 +90,29 @@ int main(int argc, char *argv[])
 	if (!rd)
 		exit(0);
 
+	if (image) {
+		struct ugci_eeprom_result res;
+		FILE *fp = fopen(image, "r");
+
+		if (fp == NULL) {
+			perror(image);
+			exit(1);
+		}
+		eeprom_len = fread(eeprom, 1, sizeof(eeprom), fp);
+		fclose(fp);
+
+		if (ugci_set_eeprom(id, eeprom, eeprom_len, &res)) {
+			fprintf(stderr, "UGCI(%d): ", id);
+			perror("ugci_set_eeprom");
+			exit(1);
+		}
+
+		if (!raw)
+			printf("Changed %d byte%s, sent %d, took %llums\n",
+			       res.bytes_changed, res.bytes_changed == 1 ? "" : "s",
+			       res.bytes_sent, res.time_ns / 1000000);
+	}
+
 	ugci_get_eeprom(id, eeprom, &eeprom_len);
 
 	/* Standard binary output */
@@ -94,5 +130,18 @@ int main(int argc, char *argv[])
 	}
 	printf("\n");
 
+	/* Decoded key map, from a layout that is only a guess */
+	if (!ugci_get_keymap(id, &map)) {
+		printf("\nKey mapping %sabled (entries unverified)\n",
+		       map.enabled ? "en" : "dis");
+		for (p = 0; p < 2; p++) {
+			printf("  Player %d:", p + 1);
+			for (i = 0; i < UGCI_INPUTS; i++)
+				printf(" %s=%02x:%02x", input_names[i],
+				       map.key[p][i].modifiers, map.key[p][i].usage);
+			printf("\n");
+		}
+	}
+
 	exit(0);
 }
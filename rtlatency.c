@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Measures wakeup latency of a thread set up with ugci_rt_setup(), the
+ * same way the reader thread sets itself up, while other threads load
+ * every CPU. Run it once plain and once with --rt to compare. No UGCI
+ * device is needed. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <getopt.h>
+
+#include "ugci.h"
+
+static volatile int stop;
+
+static void *load_thread(void *arg)
+{
+	volatile unsigned long spin = 0;
+
+	while (!stop)
+		spin++;
+
+	return NULL;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void usage(int exitval) __attribute__((__noreturn__));
+static void usage(int exitval)
+{
+	fprintf(exitval ? stderr : stdout, "Usage: rtlatency [--help] [--rt prio] "
+		"[--cpu n] [--load threads] [--loops n]\n");
+	exit(exitval);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ugci_rt_config cfg = { .policy = SCHED_OTHER, .cpu = -1 };
+	int i, loads = sysconf(_SC_NPROCESSORS_ONLN), loops = 10000;
+	unsigned long long *lat;
+	pthread_t *threads;
+	struct timespec next;
+
+	while (1) {
+		int c;
+		static struct option long_options[] = {
+			{"help",	0, NULL, 'h'},
+			{"rt",		1, NULL, 'r'},
+			{"cpu",		1, NULL, 'c'},
+			{"load",	1, NULL, 'l'},
+			{"loops",	1, NULL, 'n'},
+			{ 0 },
+		};
+
+		c = getopt_long(argc, argv, "hr:c:l:n:", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'h':
+				usage(0);
+				break;
+
+			case 'r':
+				cfg.policy = SCHED_FIFO;
+				cfg.priority = atoi(optarg);
+				cfg.mlock = 1;
+				break;
+
+			case 'c':
+				cfg.cpu = atoi(optarg);
+				break;
+
+			case 'l':
+				loads = atoi(optarg);
+				break;
+
+			case 'n':
+				loops = atoi(optarg);
+				break;
+
+			default:
+				usage(1);
+		}
+	}
+
+	if (argc != optind || loops <= 0 || loads < 0)
+		usage(1);
+
+	lat = calloc(loops, sizeof(*lat));
+	threads = calloc(loads ?: 1, sizeof(*threads));
+	if (!lat || !threads)
+		exit(1);
+
+	for (i = 0; i < loads; i++)
+		pthread_create(&threads[i], NULL, load_thread, NULL);
+
+	if (ugci_rt_setup(&cfg))
+		fprintf(stderr, "Warning: realtime setup incomplete\n");
+
+	printf("Measuring %d wakeups, %s, %d load thread%s...\n", loops,
+	       cfg.policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_OTHER",
+	       loads, loads == 1 ? "" : "s");
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	/* Same 1ms cadence a reader sees from a busy board */
+	for (i = 0; i < loops; i++) {
+		unsigned long long due;
+
+		next.tv_nsec += 1000000;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		due = (unsigned long long)next.tv_sec * 1000000000ULL + next.tv_nsec;
+		lat[i] = ugci_now_ns() - due;
+	}
+
+	stop = 1;
+	for (i = 0; i < loads; i++)
+		pthread_join(threads[i], NULL);
+
+	qsort(lat, loops, sizeof(*lat), cmp_ull);
+
+	printf("Wakeup latency: p50 %lluus p99 %lluus p999 %lluus max %lluus\n",
+	       lat[loops / 2] / 1000, lat[loops * 99 / 100] / 1000,
+	       lat[loops * 999 / 1000] / 1000, lat[loops - 1] / 1000);
+
+	exit(0);
+}
@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Simulates an emulator frame loop on top of ugci_sample_frame(), and
+ * reports how old the newest input was at the time it was sampled, along
+ * with the CPU time it took. Press buttons while this runs to collect
+ * samples. Run it with the various jit, busy poll, reader thread and
+ * report mode settings to compare their latency and CPU cost. With --axis,
+ * player 1's X axis is also read through a resampled axis stream, and the
+ * total movement per frame of the raw and resampled values is compared;
+ * move the wheel or stick while it runs. With --stages, the time spent in
+ * each stage of the event pipeline is shown at the end. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include "ugci.h"
+
+static int callbacks;
+
+static void count_events(int id, enum ugci_event_type type, int value)
+{
+	callbacks++;
+}
+
+static void usage(int exitval) __attribute__((__noreturn__));
+static void usage(int exitval)
+{
+	fprintf(exitval ? stderr : stdout, "Usage: sampleugci [--help] [--fps n] "
+		"[--jit usecs] [--frames n] [--busy usecs] [--active msecs] "
+		"[--reader] [--report] [--axis smoothing] [--stages]\n");
+	exit(exitval);
+}
+
+int main(int argc, char *argv[])
+{
+	int rd, fps = 60, jit = 0, frames = 600, frame;
+	int busy = 0, active = 0, threaded = 0, report = 0, axis = -1, stages = 0;
+	int value, last_raw = 0, last_value = 0;
+	unsigned long long raw_moved = 0, moved = 0;
+	struct rusage ru;
+	unsigned long long period, deadline, last_input = 0;
+	unsigned long long age, age_min = ~0ULL, age_max = 0, age_total = 0;
+	int samples = 0;
+
+	while (1) {
+		int c;
+		static struct option long_options[] = {
+			{"help",	0, NULL, 'h'},
+			{"fps",		1, NULL, 'f'},
+			{"jit",		1, NULL, 'j'},
+			{"frames",	1, NULL, 'n'},
+			{"busy",	1, NULL, 'b'},
+			{"active",	1, NULL, 'a'},
+			{"reader",	0, NULL, 'r'},
+			{"report",	0, NULL, 'R'},
+			{"axis",	1, NULL, 'x'},
+			{"stages",	0, NULL, 's'},
+			{ 0 },
+		};
+
+		c = getopt_long(argc, argv, "hf:j:n:b:a:rRx:s", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'h':
+				usage(0);
+				break;
+
+			case 'f':
+				fps = atoi(optarg);
+				break;
+
+			case 'j':
+				jit = atoi(optarg);
+				break;
+
+			case 'n':
+				frames = atoi(optarg);
+				break;
+
+			case 'b':
+				busy = atoi(optarg);
+				break;
+
+			case 'a':
+				active = atoi(optarg);
+				break;
+
+			case 'r':
+				threaded = 1;
+				break;
+
+			case 'R':
+				report = 1;
+				break;
+
+			case 'x':
+				axis = atoi(optarg);
+				break;
+
+			case 's':
+				stages = 1;
+				break;
+
+			default:
+				usage(1);
+		}
+	}
+
+	if (argc != optind || fps <= 0)
+		usage(1);
+
+	rd = ugci_init(count_events, UGCI_EVENT_MASK_COIN | UGCI_EVENT_MASK_PLAY |
+		       UGCI_EVENT_MASK_STICK, 1);
+
+	printf("Detected %d UGCI device%s\n", rd, rd == 1 ? "" : "s");
+
+	if (rd <= 0)
+		exit(0);
+
+	ugci_set_jit_margin(jit);
+	ugci_set_busy_poll(busy, active);
+	ugci_set_report_mode(report);
+	ugci_set_stage_timing(stages);
+
+	if (threaded && ugci_start_reader(NULL))
+		fprintf(stderr, "Could not start reader thread\n");
+
+	if (axis >= 0) {
+		struct ugci_axis_config cfg = { .tick_hz = fps, .smoothing = axis };
+
+		if (ugci_axis_subscribe(0, UGCI_AXIS_X, &cfg)) {
+			fprintf(stderr, "Could not subscribe to the axis\n");
+			axis = -1;
+		}
+	}
+
+	period = 1000000000ULL / fps;
+	deadline = ugci_now_ns() + period;
+
+	printf("Sampling %d frames at %d fps, jit margin %dus, busy poll %dus/%dms%s%s...\n",
+	       frames, fps, jit, busy, active, threaded ? ", reader thread" : "",
+	       report ? ", report mode" : "");
+
+	for (frame = 0; frame < frames; frame++, deadline += period) {
+		struct ugci_state state;
+		struct timespec ts;
+
+		if (ugci_sample_frame(deadline, &state) < 0)
+			break;
+
+		if (state.input_ns && state.input_ns != last_input) {
+			age = state.sample_ns - state.input_ns;
+			last_input = state.input_ns;
+
+			if (age < age_min)
+				age_min = age;
+			if (age > age_max)
+				age_max = age;
+			age_total += age;
+			samples++;
+		}
+
+		if (axis >= 0 && !ugci_axis_read(0, UGCI_AXIS_X, state.sample_ns, &value)) {
+			if (frame) {
+				raw_moved += abs(state.stick_x[0] - last_raw);
+				moved += abs(value - last_value);
+			}
+			last_raw = state.stick_x[0];
+			last_value = value;
+		}
+
+		/* Pretend to run the frame, then wait for the next one */
+		ts.tv_sec = deadline / 1000000000ULL;
+		ts.tv_nsec = deadline % 1000000000ULL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf("Callbacks: %d\n", callbacks);
+	printf("CPU time: user %ldms system %ldms\n",
+	       ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000,
+	       ru.ru_stime.tv_sec * 1000 + ru.ru_stime.tv_usec / 1000);
+
+	if (axis >= 0)
+		printf("Axis movement over %d frames: raw %llu, resampled %llu\n",
+		       frame, raw_moved, moved);
+
+	if (stages) {
+		struct ugci_stage_stats st[16];
+		int i, n = ugci_get_stage_stats(st, 16);
+
+		printf("Pipeline stages:\n");
+		for (i = 0; i < n && i < 16; i++)
+			printf("  %-10s %-3s runs %6lu events %6lu dropped %lu avg %lluns\n",
+			       st[i].name, st[i].enabled ? "on" : "off", st[i].runs,
+			       st[i].events, st[i].dropped,
+			       st[i].runs ? st[i].ns / st[i].runs : 0);
+	}
+
+	if (!samples) {
+		printf("No input was received\n");
+		exit(0);
+	}
+
+	printf("Input age at sample time over %d samples: "
+	       "min %lluus avg %lluus max %lluus\n", samples,
+	       age_min / 1000, age_total / samples / 1000, age_max / 1000);
+
+	exit(0);
+}
@@ -95,6 +95,9 @@ int main(int argc, char *argv[])
 	if (!rd)
 		exit(0);
 
+	/* Show what the device really holds afterwards */
+	ugci_set_secblk_cache(0);
+
 	print_secblk(id, "New Block", vals);
 
 	if (ugci_set_secblk(id, vals)) {
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Checks the ordering guarantees of the multi-board merge documented for
+ * ugci_poll(), against libugci's merge directly, so no board is needed.
+ * Run by "make check"; exits non-zero on the first failure. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+#define MAX_SRCS	4
+#define MAX_ENTRIES	4
+
+/* A source's entries, as a batch list would hold them */
+struct entry {
+	unsigned long long ns;
+	int tag;
+};
+
+static int failures;
+
+/* Merge the sources, and compare the tags in the order they came out */
+static void check(const char *name, struct entry src[][MAX_ENTRIES],
+		  const int *counts, int n, const int *expect, int nexpect)
+{
+	struct ugci_merge_src m[MAX_SRCS];
+	int got[MAX_SRCS * MAX_ENTRIES];
+	int i, s, ngot = 0;
+
+	for (i = 0; i < n; i++) {
+		m[i].ns = &src[i][0].ns;
+		m[i].stride = sizeof(src[i][0]);
+		m[i].count = counts[i];
+		m[i].head = 0;
+	}
+
+	while ((s = ugci_merge_next(m, n)) >= 0)
+		got[ngot++] = src[s][m[s].head++].tag;
+
+	if (ngot == nexpect && !memcmp(got, expect, ngot * sizeof(int))) {
+		printf("ok    %s\n", name);
+		return;
+	}
+
+	printf("FAIL  %s: got", name);
+	for (i = 0; i < ngot; i++)
+		printf(" %d", got[i]);
+	printf(", expected");
+	for (i = 0; i < nexpect; i++)
+		printf(" %d", expect[i]);
+	printf("\n");
+	failures++;
+}
+
+int main(void)
+{
+	/* Board 1 was read first, so it goes first despite its index */
+	{
+		struct entry src[2][MAX_ENTRIES] = { { { 200, 0 } }, { { 100, 1 } } };
+		int counts[2] = { 1, 1 }, expect[] = { 1, 0 };
+
+		check("earlier read wins over lower board", src, counts, 2, expect, 2);
+	}
+
+	/* Same wakeup: the documented tie rule, lower board first */
+	{
+		struct entry src[2][MAX_ENTRIES] = { { { 100, 0 } }, { { 100, 1 } } };
+		int counts[2] = { 1, 1 }, expect[] = { 0, 1 };
+
+		check("ties go to the lower board", src, counts, 2, expect, 2);
+	}
+
+	/* Reads interleave by time, each board keeps its own order */
+	{
+		struct entry src[2][MAX_ENTRIES] = {
+			{ { 10, 0 }, { 30, 2 }, { 50, 4 } },
+			{ { 20, 1 }, { 40, 3 } },
+		};
+		int counts[2] = { 3, 2 }, expect[] = { 0, 1, 2, 3, 4 };
+
+		check("interleaved reads", src, counts, 2, expect, 5);
+	}
+
+	/* A run of equal times on one board stays together and in order,
+	 * ahead of the same time on a later board */
+	{
+		struct entry src[3][MAX_ENTRIES] = {
+			{ { 5, 0 }, { 5, 1 } },
+			{ { 5, 2 } },
+			{ { 1, 3 }, { 5, 4 } },
+		};
+		int counts[3] = { 2, 1, 2 }, expect[] = { 3, 0, 1, 2, 4 };
+
+		check("stable on equal times", src, counts, 3, expect, 5);
+	}
+
+	/* A board's hiddev reads go before its evdev events of the same
+	 * time, as they come first in the source order */
+	{
+		struct entry src[3][MAX_ENTRIES] = {
+			{ { 100, 0 } },			/* Board 0 hiddev */
+			{ { 90, 1 }, { 100, 2 } },	/* Board 0 evdev */
+			{ { 95, 3 } },			/* Board 1 hiddev */
+		};
+		int counts[3] = { 1, 2, 1 }, expect[] = { 1, 3, 0, 2 };
+
+		check("evdev merges on its own timestamps", src, counts, 3, expect, 4);
+	}
+
+	/* Empty sources are skipped, and nothing at all ends at once */
+	{
+		struct entry src[3][MAX_ENTRIES] = { { { 0 } }, { { 7, 1 } }, { { 0 } } };
+		int counts[3] = { 0, 1, 0 }, expect[] = { 1 };
+
+		check("empty sources", src, counts, 3, expect, 1);
+		counts[1] = 0;
+		check("no sources", src, counts, 3, expect, 0);
+	}
+
+	exit(failures ? 1 : 0);
+}
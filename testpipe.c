@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Checks the event pipeline (debounce, state, changes, combo, coin-sim,
+ * mask and callback) by feeding it synthetic events, as decode would,
+ * with made up timestamps, so no board is needed. Run by "make check";
+ * exits non-zero if anything failed. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* Monotonic time never starts at zero, and the stages rely on that */
+#define T0		1000000000ULL
+#define MS(x)		(T0 + (unsigned long long)(x) * 1000000ULL)
+#define MAX_GOT		32
+
+/* An event as the callback got it */
+struct got {
+	enum ugci_event_type type;
+	int id;
+	int value;
+	unsigned long long ns;
+};
+
+static struct got got[MAX_GOT];
+static int ngot;
+static int failures;
+
+static void record(const struct ugci_event *ev)
+{
+	if (ngot == MAX_GOT)
+		return;
+
+	got[ngot].type = ev->type;
+	got[ngot].id = ev->id;
+	got[ngot].value = ev->value;
+	got[ngot].ns = ev->time_ns;
+	ngot++;
+}
+
+static void plain(int id, enum ugci_event_type type, int value)
+{
+}
+
+static void send(int id, enum ugci_event_type type, int value, unsigned long long ns)
+{
+	ugci_pipe_send(id, type, value, ns);
+	ugci_pipe_flush(ns);
+}
+
+/* Compare what the callback got since the last check, and start over */
+static void check(const char *name, const struct got *expect, int nexpect)
+{
+	int i;
+
+	for (i = 0; i < ngot && i < nexpect; i++)
+		if (got[i].type != expect[i].type || got[i].id != expect[i].id ||
+		    got[i].value != expect[i].value || got[i].ns != expect[i].ns)
+			break;
+
+	if (i == ngot && i == nexpect)
+		printf("ok    %s\n", name);
+	else {
+		printf("FAIL  %s: got", name);
+		for (i = 0; i < ngot; i++)
+			printf(" %s/%d=%d@%llums", ugci_event_to_name[got[i].type],
+			       got[i].id, got[i].value, (got[i].ns - T0) / 1000000ULL);
+		printf(", expected");
+		for (i = 0; i < nexpect; i++)
+			printf(" %s/%d=%d@%llums", ugci_event_to_name[expect[i].type],
+			       expect[i].id, expect[i].value, (expect[i].ns - T0) / 1000000ULL);
+		printf("\n");
+		failures++;
+	}
+
+	ngot = 0;
+}
+
+static void check_true(const char *name, int ok)
+{
+	printf("%s  %s\n", ok ? "ok  " : "FAIL", name);
+	if (!ok)
+		failures++;
+}
+
+#define CHECK(name, ...) do {						\
+	const struct got expect[] = { __VA_ARGS__ };			\
+	check(name, expect, sizeof(expect) / sizeof(expect[0]));	\
+} while (0)
+
+#define BIT(input)		UGCI_INPUT_BIT(UGCI_INPUT_##input)
+
+static void test_delivery(void)
+{
+	/* Play comes with every report, and by default so does the event */
+	send(0, UGCI_EVENT_PLAY, 1, MS(0));
+	send(0, UGCI_EVENT_PLAY, 1, MS(1));
+	send(0, UGCI_EVENT_STICK, 0, MS(2));
+	send(0, UGCI_EVENT_PLAY, 0, MS(3));
+	CHECK("unchanged play and stick are delivered by default",
+	      { UGCI_EVENT_PLAY, 0, 1, MS(0) }, { UGCI_EVENT_PLAY, 0, 1, MS(1) },
+	      { UGCI_EVENT_STICK, 0, 0, MS(2) }, { UGCI_EVENT_PLAY, 0, 0, MS(3) });
+
+	ugci_set_changes_only(1);
+	send(0, UGCI_EVENT_PLAY, 1, MS(10));
+	send(0, UGCI_EVENT_PLAY, 1, MS(11));
+	send(0, UGCI_EVENT_STICK, 0, MS(12));
+	send(0, UGCI_EVENT_PLAY, 0, MS(13));
+	CHECK("changes only drops them",
+	      { UGCI_EVENT_PLAY, 0, 1, MS(10) }, { UGCI_EVENT_PLAY, 0, 0, MS(13) });
+	ugci_set_changes_only(0);
+}
+
+static void test_combo(void)
+{
+	struct ugci_combo combo;
+	int id;
+
+	/* Play held for 100ms */
+	memset(&combo, 0, sizeof(combo));
+	combo.steps = 1;
+	combo.step[0].chord[0] = BIT(PLAY);
+	combo.step[0].hold_ms = 100;
+	id = ugci_combo_add(&combo);
+
+	send(0, UGCI_EVENT_PLAY, 1, MS(0));
+	ugci_pipe_flush(MS(50));
+	check_true("combo deadline is the end of the hold", ugci_pipe_deadline() == MS(100));
+	ugci_pipe_flush(MS(100));
+	send(0, UGCI_EVENT_PLAY, 0, MS(150));
+	CHECK("combo fires once held long enough",
+	      { UGCI_EVENT_PLAY, 0, 1, MS(0) }, { UGCI_EVENT_COMBO, 0, id, MS(100) },
+	      { UGCI_EVENT_PLAY, 0, 0, MS(150) });
+
+	send(0, UGCI_EVENT_PLAY, 1, MS(200));
+	send(0, UGCI_EVENT_PLAY, 0, MS(250));
+	ugci_pipe_flush(MS(400));
+	CHECK("combo does not fire when let go early",
+	      { UGCI_EVENT_PLAY, 0, 1, MS(200) }, { UGCI_EVENT_PLAY, 0, 0, MS(250) });
+	ugci_combo_clear();
+
+	/* Button 1 then button 2, within 200ms */
+	memset(&combo, 0, sizeof(combo));
+	combo.steps = 2;
+	combo.step[0].chord[1] = BIT(BUTTON_1);
+	combo.step[1].chord[1] = BIT(BUTTON_2);
+	combo.timeout_ms = 200;
+	id = ugci_combo_add(&combo);
+
+	send(1, UGCI_EVENT_STICK, 0x01, MS(0));
+	send(1, UGCI_EVENT_STICK, 0x00, MS(10));
+	ugci_pipe_flush(MS(200));
+	send(1, UGCI_EVENT_STICK, 0x02, MS(300));
+	send(1, UGCI_EVENT_STICK, 0x00, MS(310));
+	CHECK("combo step times out",
+	      { UGCI_EVENT_STICK, 1, 0x01, MS(0) }, { UGCI_EVENT_STICK, 1, 0x00, MS(10) },
+	      { UGCI_EVENT_STICK, 1, 0x02, MS(300) }, { UGCI_EVENT_STICK, 1, 0x00, MS(310) });
+
+	send(1, UGCI_EVENT_STICK, 0x01, MS(400));
+	send(1, UGCI_EVENT_STICK, 0x00, MS(410));
+	send(1, UGCI_EVENT_STICK, 0x02, MS(590));
+	send(1, UGCI_EVENT_STICK, 0x00, MS(600));
+	CHECK("combo steps within the timeout",
+	      { UGCI_EVENT_STICK, 1, 0x01, MS(400) }, { UGCI_EVENT_STICK, 1, 0x00, MS(410) },
+	      { UGCI_EVENT_STICK, 1, 0x02, MS(590) }, { UGCI_EVENT_COMBO, 1, id, MS(590) },
+	      { UGCI_EVENT_STICK, 1, 0x00, MS(600) });
+	ugci_combo_clear();
+
+	memset(&combo, 0, sizeof(combo));
+	combo.steps = 2;
+	combo.step[0].chord[0] = BIT(COIN);
+	combo.step[1].chord[0] = BIT(PLAY);
+	combo.step[1].hold_ms = 200;
+	combo.timeout_ms = 200;
+	errno = 0;
+	check_true("combo hold as long as the timeout is refused",
+		   ugci_combo_add(&combo) < 0 && errno == EINVAL);
+
+	/* Coin, then play held for 50ms: play may already be down */
+	combo.step[1].hold_ms = 50;
+	combo.timeout_ms = 500;
+	id = ugci_combo_add(&combo);
+
+	send(0, UGCI_EVENT_PLAY, 1, MS(0));
+	send(0, UGCI_EVENT_COIN, 1, MS(10));
+	ugci_pipe_flush(MS(60));
+	send(0, UGCI_EVENT_PLAY, 0, MS(70));
+	CHECK("already held chord counts for a hold step",
+	      { UGCI_EVENT_PLAY, 0, 1, MS(0) }, { UGCI_EVENT_COIN, 0, 1, MS(10) },
+	      { UGCI_EVENT_COMBO, 0, id, MS(60) }, { UGCI_EVENT_PLAY, 0, 0, MS(70) });
+	ugci_combo_clear();
+
+	/* Without a hold time the step needs a fresh press */
+	combo.step[1].hold_ms = 0;
+	id = ugci_combo_add(&combo);
+
+	send(0, UGCI_EVENT_PLAY, 1, MS(0));
+	send(0, UGCI_EVENT_COIN, 2, MS(10));
+	send(0, UGCI_EVENT_PLAY, 0, MS(20));
+	send(0, UGCI_EVENT_PLAY, 1, MS(30));
+	send(0, UGCI_EVENT_PLAY, 0, MS(40));
+	CHECK("already held chord needs a fresh press otherwise",
+	      { UGCI_EVENT_PLAY, 0, 1, MS(0) }, { UGCI_EVENT_COIN, 0, 2, MS(10) },
+	      { UGCI_EVENT_PLAY, 0, 0, MS(20) }, { UGCI_EVENT_PLAY, 0, 1, MS(30) },
+	      { UGCI_EVENT_COMBO, 0, id, MS(30) }, { UGCI_EVENT_PLAY, 0, 0, MS(40) });
+	ugci_combo_clear();
+
+	/* Play went down while there were no combos */
+	send(0, UGCI_EVENT_PLAY, 1, MS(0));
+	combo.step[1].hold_ms = 50;
+	id = ugci_combo_add(&combo);
+	send(0, UGCI_EVENT_COIN, 3, MS(10));
+	ugci_pipe_flush(MS(60));
+	send(0, UGCI_EVENT_PLAY, 0, MS(70));
+	CHECK("held inputs are seeded by the first combo",
+	      { UGCI_EVENT_PLAY, 0, 1, MS(0) }, { UGCI_EVENT_COIN, 0, 3, MS(10) },
+	      { UGCI_EVENT_COMBO, 0, id, MS(60) }, { UGCI_EVENT_PLAY, 0, 0, MS(70) });
+	ugci_combo_clear();
+}
+
+static void test_debounce(void)
+{
+	struct ugci_debounce_config cfg;
+
+	/* Lockout: 5ms after each edge */
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.mode = UGCI_DEBOUNCE_LOCKOUT;
+	cfg.press_us = 5000;
+	cfg.release_us = 5000;
+	ugci_set_debounce(2, UGCI_INPUT_PLAY, &cfg);
+	ugci_set_changes_only(1);
+
+	send(2, UGCI_EVENT_PLAY, 1, MS(0));
+	send(2, UGCI_EVENT_PLAY, 0, MS(1));
+	send(2, UGCI_EVENT_PLAY, 1, MS(2));
+	send(2, UGCI_EVENT_PLAY, 0, MS(3));
+	check_true("lockout deadline is the end of the window", ugci_pipe_deadline() == MS(5));
+	ugci_pipe_flush(MS(5));
+	CHECK("lockout holds back bounces inside the window",
+	      { UGCI_EVENT_PLAY, 2, 1, MS(0) }, { UGCI_EVENT_PLAY, 2, 0, MS(5) });
+
+	send(2, UGCI_EVENT_PLAY, 1, MS(20));
+	send(2, UGCI_EVENT_PLAY, 0, MS(30));
+	CHECK("lockout passes edges outside the window",
+	      { UGCI_EVENT_PLAY, 2, 1, MS(20) }, { UGCI_EVENT_PLAY, 2, 0, MS(30) });
+	ugci_set_debounce(2, UGCI_INPUT_PLAY, NULL);
+
+	/* Asymmetric: releases must stay open for 10ms */
+	cfg.mode = UGCI_DEBOUNCE_ASYMMETRIC;
+	cfg.press_us = 0;
+	cfg.release_us = 10000;
+	ugci_set_debounce(3, UGCI_INPUT_BUTTON_1, &cfg);
+
+	send(3, UGCI_EVENT_STICK, 0x01, MS(0));
+	send(3, UGCI_EVENT_STICK, 0x00, MS(2));
+	send(3, UGCI_EVENT_STICK, 0x01, MS(4));
+	send(3, UGCI_EVENT_STICK, 0x00, MS(6));
+	ugci_pipe_flush(MS(15));
+	CHECK("asymmetric holds a release that bounces",
+	      { UGCI_EVENT_STICK, 3, 0x01, MS(0) });
+	ugci_pipe_flush(MS(16));
+	CHECK("asymmetric releases once open long enough",
+	      { UGCI_EVENT_STICK, 3, 0x00, MS(16) });
+
+	ugci_set_debounce(3, UGCI_INPUT_BUTTON_1, NULL);
+	ugci_set_changes_only(0);
+}
+
+static void test_order(void)
+{
+	static const char *names[] = {
+		"read", "decode", "debounce", "state", "changes", "combo",
+		"coin-sim", "bridge", "mask", "callback",
+	};
+	struct ugci_stage_stats st[UGCI_STAGES];
+	struct ugci_debounce_config cfg;
+	struct ugci_combo combo;
+	int i, n, id, ok;
+
+	n = ugci_get_stage_stats(st, UGCI_STAGES);
+	ok = n == sizeof(names) / sizeof(names[0]);
+	for (i = 0; ok && i < n; i++)
+		ok = !strcmp(st[i].name, names[i]);
+	check_true("stages run debounce, state, changes, combo, coin-sim, bridge, "
+		   "mask, callback", ok);
+
+	/* Debounce before state and changes: a bounce it swallows changes
+	 * nothing. Changes before combo: the combo sees only changes, and
+	 * its event is not dropped. Combo before coin-sim: the combo sees
+	 * the coin, coin-sim turns the counter into a press. */
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.mode = UGCI_DEBOUNCE_LOCKOUT;
+	cfg.press_us = 5000;
+	cfg.release_us = 5000;
+	ugci_set_debounce(0, UGCI_INPUT_PLAY, &cfg);
+	ugci_set_changes_only(1);
+	ugci_set_coin_simulate(100);
+
+	memset(&combo, 0, sizeof(combo));
+	combo.steps = 2;
+	combo.step[0].chord[0] = BIT(PLAY);
+	combo.step[1].chord[0] = BIT(COIN);
+	id = ugci_combo_add(&combo);
+
+	ugci_reset_stage_stats();
+	send(0, UGCI_EVENT_PLAY, 1, MS(0));
+	send(0, UGCI_EVENT_PLAY, 0, MS(1));
+	send(0, UGCI_EVENT_PLAY, 1, MS(2));
+	send(0, UGCI_EVENT_COIN, 7, MS(3));
+	CHECK("debounce, changes, combo and coin-sim run in order",
+	      { UGCI_EVENT_PLAY, 0, 1, MS(0) }, { UGCI_EVENT_COIN, 0, 1, MS(3) },
+	      { UGCI_EVENT_COMBO, 0, id, MS(3) });
+
+	ugci_get_stage_stats(st, UGCI_STAGES);
+	ok = 1;
+	for (i = UGCI_STAGE_DEBOUNCE; i < UGCI_STAGES; i++)
+		ok &= i == UGCI_STAGE_BRIDGE ? !st[i].enabled && !st[i].runs :
+			st[i].enabled && st[i].runs == 4;
+	check_true("every enabled stage ran for each flush", ok);
+
+	send(0, UGCI_EVENT_PLAY, 0, MS(10));
+	ngot = 0;
+	ugci_combo_clear();
+	ugci_set_coin_simulate(0);
+	ugci_set_changes_only(0);
+	ugci_set_debounce(0, UGCI_INPUT_PLAY, NULL);
+}
+
+static void test_mask(void)
+{
+	struct ugci_combo combo;
+	int id;
+
+	/* Mask after combo: inputs the application does not want still
+	 * make up combos */
+	ugci_close();
+	ugci_init(plain, UGCI_EVENT_MASK_COMBO, 0);
+	ugci_set_event_callback(record);
+
+	memset(&combo, 0, sizeof(combo));
+	combo.steps = 1;
+	combo.step[0].chord[1] = BIT(PLAY) | BIT(BUTTON_3);
+	id = ugci_combo_add(&combo);
+
+	send(1, UGCI_EVENT_STICK, 0x04, MS(0));
+	send(1, UGCI_EVENT_PLAY, 1, MS(5));
+	send(1, UGCI_EVENT_PLAY, 0, MS(6));
+	send(1, UGCI_EVENT_STICK, 0x00, MS(7));
+	CHECK("mask runs after combo", { UGCI_EVENT_COMBO, 1, id, MS(5) });
+}
+
+int main(void)
+{
+	if (ugci_init(plain, UGCI_EVENT_MASK_COIN | UGCI_EVENT_MASK_PLAY |
+		      UGCI_EVENT_MASK_STICK | UGCI_EVENT_MASK_COMBO, 0) < 0) {
+		perror("ugci_init");
+		exit(1);
+	}
+	ugci_set_event_callback(record);
+
+	test_delivery();
+	test_combo();
+	test_debounce();
+	test_order();
+	test_mask();
+
+	ugci_close();
+
+	exit(failures ? 1 : 0);
+}
@@ -30,29 +30,76 @@ static void mycallback(int id, enum ugci_event_type type, int value)
 		id + 1, ugci_event_to_name[type], value);
 }
 
+/* Used with --evdev, to show the merged timeline */
+static void myevcallback(const struct ugci_event *ev)
+{
+	if (ev->type == UGCI_EVENT_EVDEV)
+		printf("UGCI: %llu.%06llu: Players %d/%d: evdev type %u code %u: %d\n",
+		       ev->time_ns / 1000000000ULL, ev->time_ns / 1000ULL % 1000000ULL,
+		       ev->id + 1, ev->id + 2, ev->ev_type, ev->code, ev->value);
+	else
+		printf("UGCI: %llu.%06llu: Player %d: %s button: %d\n",
+		       ev->time_ns / 1000000000ULL, ev->time_ns / 1000ULL % 1000000ULL,
+		       ev->id + 1, ugci_event_to_name[ev->type], ev->value);
+}
+
+/* Used with --combo: a coin inserted while play is held, with play then
+ * held for 3 seconds, as a service menu would be opened, and all of
+ * player 1's buttons at once */
+static void add_combos(void)
+{
+	struct ugci_combo combo;
+
+	memset(&combo, 0, sizeof(combo));
+	combo.steps = 2;
+	combo.step[0].chord[0] = UGCI_INPUT_BIT(UGCI_INPUT_COIN) |
+		UGCI_INPUT_BIT(UGCI_INPUT_PLAY);
+	combo.step[1].chord[0] = UGCI_INPUT_BIT(UGCI_INPUT_PLAY);
+	combo.step[1].hold_ms = 3000;
+	combo.timeout_ms = 5000;
+	printf("Combo %d: hold play, coin, keep holding for 3s\n", ugci_combo_add(&combo));
+
+	memset(&combo, 0, sizeof(combo));
+	combo.steps = 1;
+	combo.step[0].chord[0] = UGCI_INPUT_BIT(UGCI_INPUT_BUTTON_1) |
+		UGCI_INPUT_BIT(UGCI_INPUT_BUTTON_2) | UGCI_INPUT_BIT(UGCI_INPUT_BUTTON_3);
+	printf("Combo %d: buttons 1, 2 and 3 together\n", ugci_combo_add(&combo));
+}
+
 static void usage(int exitval) __attribute__((__noreturn__));
 static void usage(int exitval)
 {
-	fprintf(exitval ? stderr : stdout, "Usage: testugci [--help] [--simul]\n");
+	fprintf(exitval ? stderr : stdout, "Usage: testugci [--help] [--simul] [--evdev] "
+		"[--combo] [--debounce msecs]\n");
 	exit(exitval);
 }
 
 int main(int argc, char *argv[])
 {
-	int i, rd, simul = 0;
+	int i, rd, simul = 0, evdev = 0, combo = 0, debounce = 0;
 	unsigned char vals[UGCI_SEC_VALUES + 1];
 
-	if (argc > 1) {
-		if (argc > 2 || strcmp(argv[1], "--help") == 0)
-			usage(argc > 2 ? 1 : 0);
-		else if (strcmp(argv[1], "--simul") == 0)
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--help") == 0)
+			usage(0);
+		else if (strcmp(argv[i], "--simul") == 0)
 			simul = 1;
+		else if (strcmp(argv[i], "--evdev") == 0)
+			evdev = 1;
+		else if (strcmp(argv[i], "--combo") == 0)
+			combo = 1;
+		else if (strcmp(argv[i], "--debounce") == 0 && i + 1 < argc)
+			debounce = atoi(argv[++i]);
 		else
 			usage(1);
 	}
 	
-	rd = ugci_init(mycallback, UGCI_EVENT_MASK_COIN |
-		       UGCI_EVENT_MASK_PLAY, 1);
+	rd = ugci_init(mycallback, UGCI_EVENT_MASK_COIN | UGCI_EVENT_MASK_PLAY |
+		       (evdev ? UGCI_EVENT_MASK_EVDEV : 0) |
+		       (combo ? UGCI_EVENT_MASK_COMBO : 0), 1);
+
+	if (evdev)
+		ugci_set_event_callback(myevcallback);
 
 	printf("Detected %d UGCI device%s\n", rd, rd == 1 ? "" : "s");
 
@@ -93,6 +140,20 @@ int main(int argc, char *argv[])
 		ugci_set_coin_simulate(SIM_WAIT_MS);
 	}
 
+	if (combo)
+		add_combos();
+
+	if (debounce > 0) {
+		struct ugci_debounce_config cfg = {
+			.press_us = debounce * 1000,
+			.release_us = debounce * 1000,
+			.mode = UGCI_DEBOUNCE_LOCKOUT,
+		};
+
+		printf("\nDebouncing play buttons for %dms\n", debounce);
+		ugci_set_debounce(-1, UGCI_INPUT_PLAY, &cfg);
+	}
+
 	printf("\nPolling...\n");
 
 	while (ugci_poll(100) >= 0)
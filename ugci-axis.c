@@ -0,0 +1,152 @@
+/* 
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* Axis streams. Raw values are kept with their read time in a small ring
+ * per axis; reads interpolate between them one tick in the past, so there
+ * is always a newer sample to interpolate towards. All the math is 16.16
+ * fixed point. */
+struct ugci_axis_sample {
+	unsigned long long ns;
+	int value;
+};
+
+struct ugci_axis_stream {
+	int subscribed;
+	int latest;
+	unsigned int alpha;		/* 16.16 filter gain, 1.0 is no smoothing */
+	unsigned long long period_ns;
+	unsigned int head;		/* Samples recorded so far */
+	struct ugci_axis_sample raw[UGCI_AXIS_SAMPLES];
+	long long filtered;		/* 16.16 */
+	int filtered_valid;
+};
+
+static struct ugci_axis_stream streams[UGCI_MAX_PLAYERS][UGCI_AXES];
+
+int ugci_axis_subscribe(int player, enum ugci_axis axis,
+			const struct ugci_axis_config *cfg)
+{
+	struct ugci_axis_stream *s;
+
+	if ((unsigned int)player >= UGCI_MAX_PLAYERS ||
+	    (unsigned int)axis >= UGCI_AXES)
+		return -1;
+
+	s = &streams[player][axis];
+	memset(s, 0, sizeof(*s));
+
+	if (cfg == NULL)
+		return 0;
+
+	if (!cfg->tick_hz || cfg->smoothing > 0xffff)
+		return -1;
+
+	s->latest = cfg->latest;
+	s->alpha = 0x10000 - cfg->smoothing;
+	s->period_ns = 1000000000ULL / cfg->tick_hz;
+
+	/* Start from the current position, the axis may not move for a while */
+	s->raw[0].ns = ugci_now_ns();
+	s->raw[0].value = ugci_stick_value(player, axis);
+	s->head = 1;
+	s->subscribed = 1;
+
+	return 0;
+}
+
+void ugci_axis_record(int player, enum ugci_axis axis, int value,
+		      unsigned long long ns)
+{
+	struct ugci_axis_stream *s = &streams[player][axis];
+
+	if (!s->subscribed)
+		return;
+
+	s->raw[s->head & (UGCI_AXIS_SAMPLES - 1)].ns = ns;
+	s->raw[s->head & (UGCI_AXIS_SAMPLES - 1)].value = value;
+	s->head++;
+}
+
+/* Value at time ns, in 16.16, interpolated from the raw samples */
+static long long ugci_axis_resample(struct ugci_axis_stream *s, unsigned long long ns)
+{
+	const struct ugci_axis_sample *a, *b;
+	unsigned int i, oldest;
+	long long frac;
+
+	b = &s->raw[(s->head - 1) & (UGCI_AXIS_SAMPLES - 1)];
+	if (s->latest || b->ns <= ns)
+		return (long long)b->value << 16;
+
+	oldest = s->head > UGCI_AXIS_SAMPLES ? s->head - UGCI_AXIS_SAMPLES : 0;
+
+	/* Find the newest sample at or before ns; b is the one after it */
+	for (i = s->head - 1; i-- > oldest; b = a)
+	{
+		a = &s->raw[i & (UGCI_AXIS_SAMPLES - 1)];
+		if (a->ns > ns)
+			continue;
+
+		frac = ((ns - a->ns) << 16) / (b->ns - a->ns);
+		return ((long long)a->value << 16) +
+			(long long)(b->value - a->value) * frac;
+	}
+
+	/* Everything we still have is newer, so use the oldest */
+	return (long long)b->value << 16;
+}
+
+int ugci_axis_read(int player, enum ugci_axis axis, unsigned long long tick_ns,
+		   int *value)
+{
+	struct ugci_axis_stream *s;
+	long long v;
+
+	if ((unsigned int)player >= UGCI_MAX_PLAYERS ||
+	    (unsigned int)axis >= UGCI_AXES || value == NULL)
+		return -1;
+
+	s = &streams[player][axis];
+	if (!s->subscribed)
+		return -1;
+
+	v = ugci_axis_resample(s, tick_ns > s->period_ns ? tick_ns - s->period_ns : 0);
+
+	if (!s->filtered_valid)
+	{
+		s->filtered = v;
+		s->filtered_valid = 1;
+	}
+	else
+		s->filtered += ((v - s->filtered) * s->alpha) >> 16;
+
+	/* Round to nearest */
+	*value = (int)((s->filtered + 0x8000) >> 16);
+
+	return 0;
+}
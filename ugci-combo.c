@@ -0,0 +1,374 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* Inputs the board reports as buttons. The stick directions are analog
+ * axes without a known range, so they cannot be part of a combo. */
+#define UGCI_COMBO_INPUTS	(UGCI_INPUT_BIT(UGCI_INPUT_COIN) | \
+				 UGCI_INPUT_BIT(UGCI_INPUT_PLAY) | \
+				 UGCI_INPUT_BIT(UGCI_INPUT_BUTTON_1) | \
+				 UGCI_INPUT_BIT(UGCI_INPUT_BUTTON_2) | \
+				 UGCI_INPUT_BIT(UGCI_INPUT_BUTTON_3) | \
+				 UGCI_INPUT_BIT(UGCI_INPUT_BUTTON_4) | \
+				 UGCI_INPUT_BIT(UGCI_INPUT_BUTTON_5) | \
+				 UGCI_INPUT_BIT(UGCI_INPUT_BUTTON_6) | \
+				 UGCI_INPUT_BIT(UGCI_INPUT_BUTTON_7))
+
+/* A combo's state is the step it is waiting on. A step is armed by a
+ * press of one of its inputs, so holding the previous chord down does
+ * not satisfy the next one, and a matched combo needs a fresh press to
+ * match again. Steps with a hold time are the exception: they are armed
+ * as soon as they are reached, so a chord held since before counts, as
+ * when start is held through a coin. Once the armed step's chord is all
+ * held, held_since is set, and the step completes when its hold time has
+ * passed. */
+struct ugci_combo_state {
+	struct ugci_combo def;
+	int used;
+	int player;			/* Reported in the COMBO event */
+	int step;
+	int armed;
+	unsigned long long held_since;
+	unsigned long long step_done;	/* When the previous step completed */
+};
+
+static struct ugci_combo_state combos[UGCI_MAX_COMBOS];
+static int ncombos;
+
+/* Inputs held right now, and for each input the combos that use it in
+ * any step, so an event only touches the combos it can affect. */
+static unsigned short held[UGCI_MAX_PLAYERS];
+static unsigned int watch[UGCI_MAX_PLAYERS][UGCI_INPUTS];
+
+static inline unsigned long long ugci_ms_to_ns(unsigned int ms)
+{
+	return (unsigned long long)ms * 1000000ULL;
+}
+
+int ugci_combo_add(const struct ugci_combo *combo)
+{
+	struct ugci_combo_state *s;
+	int c, t, p, i;
+
+	if (combo == NULL || combo->steps <= 0 || combo->steps > UGCI_COMBO_STEPS)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (t = 0; t < combo->steps; t++)
+	{
+		unsigned short all = 0;
+
+		for (p = 0; p < UGCI_MAX_PLAYERS; p++)
+		{
+			if (combo->step[t].chord[p] & ~UGCI_COMBO_INPUTS)
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			all |= combo->step[t].chord[p];
+		}
+
+		if (!all)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+
+		/* The timeout runs from the previous step, so a step held
+		 * for that long could never be taken */
+		if (t && combo->timeout_ms && combo->step[t].hold_ms >= combo->timeout_ms)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	for (c = 0; c < UGCI_MAX_COMBOS && combos[c].used; c++)
+		;
+
+	if (c == UGCI_MAX_COMBOS)
+	{
+		errno = ENOSPC;
+		return -1;
+	}
+
+	/* Nothing kept track of what is held while there were no combos,
+	 * and a chord held right now should count */
+	if (!ncombos)
+		for (p = 0; p < UGCI_MAX_PLAYERS; p++)
+			held[p] = ugci_held_inputs(p);
+
+	s = &combos[c];
+	memset(s, 0, sizeof(*s));
+	s->def = *combo;
+	s->used = 1;
+	ncombos++;
+
+	for (p = UGCI_MAX_PLAYERS - 1; p >= 0; p--)
+		if (combo->step[0].chord[p])
+			s->player = p;
+
+	for (t = 0; t < combo->steps; t++)
+		for (p = 0; p < UGCI_MAX_PLAYERS; p++)
+			for (i = 0; i < UGCI_INPUTS; i++)
+				if (combo->step[t].chord[p] & UGCI_INPUT_BIT(i))
+					watch[p][i] |= 1U << c;
+
+	ugci_pipe_changed();
+
+	return c;
+}
+
+int ugci_combo_remove(int id)
+{
+	int p, i;
+
+	if (id < 0 || id >= UGCI_MAX_COMBOS || !combos[id].used)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	combos[id].used = 0;
+	ncombos--;
+
+	for (p = 0; p < UGCI_MAX_PLAYERS; p++)
+		for (i = 0; i < UGCI_INPUTS; i++)
+			watch[p][i] &= ~(1U << id);
+
+	ugci_pipe_changed();
+
+	return 0;
+}
+
+void ugci_combo_clear(void)
+{
+	memset(combos, 0, sizeof(combos));
+	memset(watch, 0, sizeof(watch));
+	memset(held, 0, sizeof(held));
+	ncombos = 0;
+	ugci_pipe_changed();
+}
+
+int ugci_combo_active(void)
+{
+	return ncombos > 0;
+}
+
+static void ugci_combo_reset(struct ugci_combo_state *s)
+{
+	s->step = 0;
+	s->armed = 0;
+	s->held_since = 0;
+	s->step_done = 0;
+}
+
+static int ugci_combo_check(int c, unsigned long long ns);
+
+static int ugci_combo_advance(int c, unsigned long long ns)
+{
+	struct ugci_combo_state *s = &combos[c];
+
+	s->step++;
+	s->armed = 0;
+	s->held_since = 0;
+	s->step_done = ns;
+
+	if (s->step < s->def.steps)
+	{
+		/* A chord that is already held starts its hold time now */
+		if (s->def.step[s->step].hold_ms)
+		{
+			s->armed = 1;
+			ugci_combo_check(c, ns);
+		}
+		return 0;
+	}
+
+	ugci_combo_reset(s);
+	ugci_pipe_send(s->player, UGCI_EVENT_COMBO, c, ns);
+
+	return 1;
+}
+
+/* Re-evaluate the step a combo is waiting on against the held inputs */
+static int ugci_combo_check(int c, unsigned long long ns)
+{
+	struct ugci_combo_state *s = &combos[c];
+	const struct ugci_combo_step *st = &s->def.step[s->step];
+	int p;
+
+	if (!s->armed)
+		return 0;
+
+	for (p = 0; p < UGCI_MAX_PLAYERS; p++)
+		if ((held[p] & st->chord[p]) != st->chord[p])
+		{
+			s->held_since = 0;
+			return 0;
+		}
+
+	if (!s->held_since)
+		s->held_since = ns;
+
+	if (ns - s->held_since < ugci_ms_to_ns(st->hold_ms))
+		return 0;
+
+	return ugci_combo_advance(c, ns);
+}
+
+static int ugci_combo_input(int player, enum ugci_input input, int pressed,
+			    unsigned long long ns)
+{
+	unsigned int m;
+	int c, fired = 0;
+
+	if (player < 0 || player >= UGCI_MAX_PLAYERS || input >= UGCI_INPUTS)
+		return 0;
+
+	if (pressed)
+		held[player] |= UGCI_INPUT_BIT(input);
+	else
+		held[player] &= ~UGCI_INPUT_BIT(input);
+
+	for (m = watch[player][input]; m; m &= m - 1)
+	{
+		struct ugci_combo_state *s;
+
+		c = __builtin_ctz(m);
+		s = &combos[c];
+
+		/* Too late for the next step, start over */
+		if (s->step && s->def.timeout_ms &&
+		    ns - s->step_done >= ugci_ms_to_ns(s->def.timeout_ms))
+			ugci_combo_reset(s);
+
+		if (pressed && (s->def.step[s->step].chord[player] & UGCI_INPUT_BIT(input)))
+			s->armed = 1;
+
+		fired += ugci_combo_check(c, ns);
+	}
+
+	return fired;
+}
+
+unsigned long long ugci_combo_deadline(void)
+{
+	unsigned long long d, next = 0;
+	int c;
+
+	for (c = 0; c < UGCI_MAX_COMBOS; c++)
+	{
+		struct ugci_combo_state *s = &combos[c];
+
+		if (!s->used)
+			continue;
+
+		if (s->held_since)
+		{
+			d = s->held_since + ugci_ms_to_ns(s->def.step[s->step].hold_ms);
+			if (!next || d < next)
+				next = d;
+		}
+
+		if (s->step && s->def.timeout_ms)
+		{
+			d = s->step_done + ugci_ms_to_ns(s->def.timeout_ms);
+			if (!next || d < next)
+				next = d;
+		}
+	}
+
+	return next;
+}
+
+static int ugci_combo_expire(unsigned long long now)
+{
+	int c, fired = 0;
+
+	for (c = 0; c < UGCI_MAX_COMBOS; c++)
+	{
+		struct ugci_combo_state *s = &combos[c];
+
+		if (!s->used)
+			continue;
+
+		if (s->held_since &&
+		    now - s->held_since >= ugci_ms_to_ns(s->def.step[s->step].hold_ms))
+			fired += ugci_combo_advance(c, now);
+		else if (s->step && s->def.timeout_ms &&
+			 now - s->step_done >= ugci_ms_to_ns(s->def.timeout_ms))
+			ugci_combo_reset(s);
+	}
+
+	return fired;
+}
+
+/* Combo stage. Matched combos are emitted right after the input event
+ * that completed them. */
+void ugci_combo_stage(const struct ugci_pipe_event *in, int n, unsigned long long now)
+{
+	const struct ugci_event *ev;
+	int i, b;
+
+	for (i = 0; i < n; i++)
+	{
+		ev = &in[i].ev;
+		ugci_pipe_emit(&in[i]);
+
+		switch (ev->type)
+		{
+		/* Play comes with every report in per usage mode, and a
+		 * repeat must not count as a fresh press */
+		case UGCI_EVENT_PLAY:
+			if (in[i].changed)
+				ugci_combo_input(ev->id, UGCI_INPUT_PLAY, ev->value, ev->time_ns);
+			break;
+
+		/* Coin events are counters, so a coin is only held for the
+		 * moment it goes in */
+		case UGCI_EVENT_COIN:
+			ugci_combo_input(ev->id, UGCI_INPUT_COIN, 1, ev->time_ns);
+			ugci_combo_input(ev->id, UGCI_INPUT_COIN, 0, ev->time_ns);
+			break;
+
+		case UGCI_EVENT_STICK:
+			for (b = 0; b < 7; b++)
+				if (in[i].changed & (1 << b))
+					ugci_combo_input(ev->id, UGCI_INPUT_BUTTON_1 + b,
+							 ev->value & (1 << b), ev->time_ns);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	ugci_combo_expire(now);
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* Debounce state of one input. accepted is what subscribers have seen,
+ * raw is what the device last reported. While the two differ the input
+ * is pending, and the raw value is applied once the window allows it,
+ * either by the next change or by ugci_debounce_expire(). */
+struct ugci_debounce_state {
+	int enabled;
+	int mode;
+	unsigned long long press_ns;
+	unsigned long long release_ns;
+	int accepted;
+	int raw;
+	unsigned long long edge_ns;	/* When accepted last changed */
+	unsigned long long raw_ns;	/* When raw last changed */
+};
+
+static struct ugci_debounce_state inputs[UGCI_MAX_PLAYERS][UGCI_INPUTS];
+static unsigned short pending[UGCI_MAX_PLAYERS];
+static int nenabled;
+
+static int ugci_debounce_valid(enum ugci_input input)
+{
+	return input == UGCI_INPUT_PLAY ||
+		(input >= UGCI_INPUT_BUTTON_1 && input <= UGCI_INPUT_BUTTON_7);
+}
+
+/* The earliest time the raw value of a pending input can be accepted */
+static unsigned long long ugci_debounce_ready(const struct ugci_debounce_state *d)
+{
+	unsigned long long ready;
+
+	if (d->mode == UGCI_DEBOUNCE_LOCKOUT)
+		return d->edge_ns + (d->accepted ? d->press_ns : d->release_ns);
+
+	/* Presses go through at once, releases must also have held for
+	 * their whole window */
+	if (d->raw)
+		return 0;
+
+	ready = d->edge_ns + d->press_ns;
+	if (d->raw_ns + d->release_ns > ready)
+		ready = d->raw_ns + d->release_ns;
+
+	return ready;
+}
+
+int ugci_set_debounce(int player, enum ugci_input input,
+		      const struct ugci_debounce_config *cfg)
+{
+	struct ugci_debounce_state *d;
+	int p;
+
+	if (player >= UGCI_MAX_PLAYERS || !ugci_debounce_valid(input) ||
+	    (cfg && cfg->mode != UGCI_DEBOUNCE_LOCKOUT &&
+	     cfg->mode != UGCI_DEBOUNCE_ASYMMETRIC))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (p = player < 0 ? 0 : player;
+	     p < (player < 0 ? UGCI_MAX_PLAYERS : player + 1); p++)
+	{
+		d = &inputs[p][input];
+		nenabled -= d->enabled;
+		memset(d, 0, sizeof(*d));
+		pending[p] &= ~UGCI_INPUT_BIT(input);
+
+		if (cfg == NULL)
+			continue;
+
+		d->enabled = 1;
+		nenabled++;
+		d->mode = cfg->mode;
+		d->press_ns = (unsigned long long)cfg->press_us * 1000ULL;
+		d->release_ns = (unsigned long long)cfg->release_us * 1000ULL;
+		d->accepted = d->raw = ugci_input_value(p, input);
+	}
+
+	ugci_pipe_changed();
+
+	return 0;
+}
+
+void ugci_debounce_clear(void)
+{
+	memset(inputs, 0, sizeof(inputs));
+	memset(pending, 0, sizeof(pending));
+	nenabled = 0;
+	ugci_pipe_changed();
+}
+
+int ugci_debounce_active(void)
+{
+	return nenabled > 0;
+}
+
+/* Take a newly decoded value of an input, and return the one to report */
+static int ugci_debounce(int player, enum ugci_input input, int value,
+			 unsigned long long ns)
+{
+	struct ugci_debounce_state *d = &inputs[player][input];
+
+	if (!d->enabled)
+		return value;
+
+	value = !!value;
+	if (value == d->raw)
+		return d->accepted;
+
+	d->raw = value;
+	d->raw_ns = ns;
+
+	/* Back to what was reported before the window ran out */
+	if (value == d->accepted)
+	{
+		pending[player] &= ~UGCI_INPUT_BIT(input);
+		UGCI_STAT_INC(ugci_dev_stats(player / 2), bounces[player % 2]);
+		return d->accepted;
+	}
+
+	if (ns < ugci_debounce_ready(d))
+	{
+		pending[player] |= UGCI_INPUT_BIT(input);
+		return d->accepted;
+	}
+
+	d->accepted = value;
+	d->edge_ns = ns;
+
+	return value;
+}
+
+unsigned long long ugci_debounce_deadline(void)
+{
+	unsigned long long d, next = 0;
+	unsigned int m;
+	int p;
+
+	for (p = 0; p < UGCI_MAX_PLAYERS; p++)
+		for (m = pending[p]; m; m &= m - 1)
+		{
+			d = ugci_debounce_ready(&inputs[p][__builtin_ctz(m)]);
+			if (!next || d < next)
+				next = d;
+		}
+
+	return next;
+}
+
+static unsigned char ugci_debounce_buttons(int player, unsigned char raw,
+					   unsigned long long ns)
+{
+	unsigned char buttons = 0;
+	int b;
+
+	for (b = 0; b < 7; b++)
+		if (ugci_debounce(player, UGCI_INPUT_BUTTON_1 + b, raw & (1 << b), ns))
+			buttons |= 1 << b;
+
+	return buttons;
+}
+
+/* Report the changes held back that are now due */
+static void ugci_debounce_expire(unsigned long long now)
+{
+	struct ugci_debounce_state *d;
+	unsigned char raw;
+	unsigned int m;
+	int p, i, b;
+
+	for (p = 0; p < UGCI_MAX_PLAYERS; p++)
+		for (m = pending[p]; m; m &= m - 1)
+		{
+			i = __builtin_ctz(m);
+			d = &inputs[p][i];
+
+			if (now < ugci_debounce_ready(d))
+				continue;
+
+			pending[p] &= ~UGCI_INPUT_BIT(i);
+			d->accepted = d->raw;
+			d->edge_ns = now;
+
+			if (i == UGCI_INPUT_PLAY)
+			{
+				ugci_pipe_send(p, UGCI_EVENT_PLAY, d->accepted, now);
+				continue;
+			}
+
+			for (b = raw = 0; b < 7; b++)
+				if (ugci_input_value(p, UGCI_INPUT_BUTTON_1 + b))
+					raw |= 1 << b;
+
+			ugci_pipe_send(p, UGCI_EVENT_STICK,
+				       ugci_debounce_buttons(p, raw, now), now);
+		}
+}
+
+void ugci_debounce_stage(const struct ugci_pipe_event *in, int n, unsigned long long now)
+{
+	struct ugci_pipe_event ev;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		ev = in[i];
+
+		if (ev.ev.type == UGCI_EVENT_PLAY)
+			ev.ev.value = ugci_debounce(ev.ev.id, UGCI_INPUT_PLAY,
+						    ev.ev.value, ev.ev.time_ns);
+		else if (ev.ev.type == UGCI_EVENT_STICK)
+			ev.ev.value = ugci_debounce_buttons(ev.ev.id, ev.ev.value,
+							    ev.ev.time_ns);
+
+		ugci_pipe_emit(&ev);
+	}
+
+	ugci_debounce_expire(now);
+}
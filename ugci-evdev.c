@@ -0,0 +1,131 @@
+/* 
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+#include <linux/input.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+#ifndef input_event_sec
+#define input_event_sec		time.tv_sec
+#define input_event_usec	time.tv_usec
+#endif
+
+static const char *hiddev_sysfs_fmts[] = {
+	"/sys/class/usbmisc/hiddev%d/device",
+	"/sys/class/usb/hiddev%d/device",
+	NULL,
+};
+
+/* Find the evdev nodes the input layer created for the same USB
+ * interface as hiddev number "hiddev", and open them. The interface
+ * directory in sysfs is the parent of both. */
+int ugci_evdev_open(int hiddev, int *fds, int max)
+{
+	char path[PATH_MAX], intf[PATH_MAX], node[PATH_MAX];
+	struct dirent *de;
+	DIR *dir;
+	int t, len, n = 0;
+
+	for (t = 0; hiddev_sysfs_fmts[t]; t++)
+	{
+		snprintf(path, sizeof(path), hiddev_sysfs_fmts[t], hiddev);
+		if (realpath(path, intf))
+			break;
+	}
+
+	if (!hiddev_sysfs_fmts[t] || !(dir = opendir("/sys/class/input")))
+		return 0;
+
+	len = strlen(intf);
+
+	while (n < max && (de = readdir(dir)))
+	{
+		int fd, clk = CLOCK_MONOTONIC;
+
+		if (strncmp(de->d_name, "event", 5))
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/class/input/%s", de->d_name);
+		if (!realpath(path, node) || strncmp(node, intf, len) || node[len] != '/')
+			continue;
+
+		snprintf(path, sizeof(path), "/dev/input/%s", de->d_name);
+		if ((fd = open(path, O_RDONLY | O_NONBLOCK)) < 0)
+			continue;
+
+		/* So the timestamps compare with ugci_now_ns() */
+		if (ioctl(fd, EVIOCSCLOCKID, &clk) < 0)
+		{
+			close(fd);
+			continue;
+		}
+
+		fds[n++] = fd;
+	}
+
+	closedir(dir);
+
+	return n;
+}
+
+/* Read what is queued on an evdev node, keeping only the key, axis and
+ * relative events. Returns the number kept, or less than zero if the
+ * node went away. */
+int ugci_evdev_read(int fd, struct ugci_evdev_batch *batch)
+{
+	struct input_event ev[UGCI_BATCH_EVENTS];
+	int rd, t;
+
+	batch->count = 0;
+
+	rd = read(fd, ev, sizeof(ev));
+	if (rd < 0)
+		return errno == EAGAIN ? 0 : -1;
+
+	for (t = 0; t < rd / (int)sizeof(ev[0]); t++)
+	{
+		struct ugci_evdev_event *e = &batch->ev[batch->count];
+
+		if (ev[t].type != EV_KEY && ev[t].type != EV_ABS && ev[t].type != EV_REL)
+			continue;
+
+		e->time_ns = ev[t].input_event_sec * 1000000000ULL +
+			ev[t].input_event_usec * 1000ULL;
+		e->type = ev[t].type;
+		e->code = ev[t].code;
+		e->value = ev[t].value;
+		batch->count++;
+	}
+
+	return batch->count;
+}
@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* Metrics exporter. A thread answers HTTP scrapes with the per device
+ * counters in the Prometheus text format, one client at a time. It only
+ * ever loads the counters, which everything else bumps atomically, and
+ * takes no lock, so it can not get in the way of ugci_poll(). */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* Longest request we read, and how long a client gets to send it */
+#define UGCI_EXPORTER_REQUEST		1024
+#define UGCI_EXPORTER_TIMEOUT		1000
+
+static pthread_t exporter;
+static int exporter_running;
+static int listen_fd = -1;
+static int stop_fd = -1;	/* ugci_stop_exporter() -> exporter */
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static const char *type_names[UGCI_EVENT_TYPES] = {
+	"unknown", "coin", "play", "wd", "stick", "evdev", "combo",
+};
+
+static const char *report_names[3] = { "input", "output", "feature" };
+
+/* Counters exported as they are */
+static const struct {
+	const char *name;
+	const char *help;
+	size_t offset;
+} counters[] = {
+	{ "reads", "Reads from the device.",
+	  offsetof(struct ugci_stats, reads) },
+	{ "short_reads", "Reads that held no whole event.",
+	  offsetof(struct ugci_stats, short_reads) },
+	{ "disables", "Times the device was disabled.",
+	  offsetof(struct ugci_stats, disables) },
+	{ "watchdog_pets", "Runtime watchdog refreshes.",
+	  offsetof(struct ugci_stats, wd_pets) },
+};
+
+static unsigned long ugci_load(const unsigned long *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static double ugci_load_secs(const unsigned long long *ns)
+{
+	return __atomic_load_n(ns, __ATOMIC_RELAXED) / 1e9;
+}
+
+static void ugci_metric_header(FILE *f, const char *name, const char *type,
+			       const char *help)
+{
+	fprintf(f, "# HELP ugci_%s %s\n# TYPE ugci_%s %s\n", name, help, name, type);
+}
+
+static void ugci_write_metrics(FILE *f)
+{
+	struct ugci_stats *st;
+	int n = ugci_dev_count(), id, i;
+
+	ugci_metric_header(f, "up", "gauge", "Whether the device is open.");
+	for (id = 0; id < n; id++)
+		fprintf(f, "ugci_up{device=\"%d\"} %d\n", id, ugci_dev_fd(id) >= 0);
+
+	ugci_metric_header(f, "events_total", "counter",
+			   "Events per type, before the event mask.");
+	for (id = 0; id < n; id++)
+		for (i = UGCI_EVENT_COIN, st = ugci_dev_stats(id); i < UGCI_EVENT_TYPES; i++)
+			fprintf(f, "ugci_events_total{device=\"%d\",type=\"%s\"} %lu\n",
+				id, type_names[i], ugci_load(&st->events[i]));
+
+	for (i = 0; i < (int)(sizeof(counters) / sizeof(counters[0])); i++)
+	{
+		fprintf(f, "# HELP ugci_%s_total %s\n# TYPE ugci_%s_total counter\n",
+			counters[i].name, counters[i].help, counters[i].name);
+		for (id = 0; id < n; id++)
+			fprintf(f, "ugci_%s_total{device=\"%d\"} %lu\n", counters[i].name, id,
+				ugci_load((unsigned long *)((char *)ugci_dev_stats(id) +
+							    counters[i].offset)));
+	}
+
+	ugci_metric_header(f, "ioctl_seconds", "summary",
+			   "Time spent in report ioctls, per HID report type.");
+	for (id = 0; id < n; id++)
+		for (i = 0, st = ugci_dev_stats(id); i < 3; i++)
+			fprintf(f, "ugci_ioctl_seconds_count{device=\"%d\",report=\"%s\"} %lu\n"
+				"ugci_ioctl_seconds_sum{device=\"%d\",report=\"%s\"} %.9f\n",
+				id, report_names[i], ugci_load(&st->ioctls[i]),
+				id, report_names[i], ugci_load_secs(&st->ioctl_ns[i]));
+
+	ugci_metric_header(f, "callback_seconds", "summary",
+			   "Time spent in the application's callback.");
+	for (id = 0; id < n; id++)
+	{
+		st = ugci_dev_stats(id);
+		fprintf(f, "ugci_callback_seconds_count{device=\"%d\"} %lu\n"
+			"ugci_callback_seconds_sum{device=\"%d\"} %.9f\n",
+			id, ugci_load(&st->callbacks), id, ugci_load_secs(&st->callback_ns));
+	}
+}
+
+static int ugci_send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t wr;
+
+	while (len)
+	{
+		if ((wr = send(fd, buf, len, MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		buf += wr;
+		len -= wr;
+	}
+
+	return 0;
+}
+
+/* Read the request head, or as much of it as fits */
+static int ugci_read_request(int fd, char *req, int max)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int len = 0, rd;
+
+	while (len < max - 1 && !strstr(req, "\r\n\r\n"))
+	{
+		if (poll(&pfd, 1, UGCI_EXPORTER_TIMEOUT) <= 0)
+			return -1;
+
+		if ((rd = read(fd, req + len, max - 1 - len)) <= 0)
+			return -1;
+
+		len += rd;
+		req[len] = '\0';
+	}
+
+	return len;
+}
+
+static void ugci_serve(int fd)
+{
+	char req[UGCI_EXPORTER_REQUEST] = "";
+	char head[128];
+	char *body = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	if (ugci_read_request(fd, req, sizeof(req)) < 0)
+		return;
+
+	if (strncmp(req, "GET /metrics", 12) || (req[12] != ' ' && req[12] != '?'))
+	{
+		static const char *missing = "HTTP/1.0 404 Not Found\r\n"
+			"Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+		ugci_send_all(fd, missing, strlen(missing));
+		return;
+	}
+
+	if ((f = open_memstream(&body, &len)) == NULL)
+		return;
+
+	ugci_write_metrics(f);
+	fclose(f);
+
+	snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+		 "Content-Type: text/plain; version=0.0.4\r\n"
+		 "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+
+	if (!ugci_send_all(fd, head, strlen(head)))
+		ugci_send_all(fd, body, len);
+
+	free(body);
+}
+
+static void *ugci_exporter(void *arg)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = listen_fd, .events = POLLIN },
+		{ .fd = stop_fd, .events = POLLIN },
+	};
+	int fd;
+
+	while (1)
+	{
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[1].revents)
+			break;
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		if ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+			continue;
+
+		ugci_serve(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/* Bind a Unix socket at a path, replacing a stale socket there */
+static int ugci_bind_unix(const char *path)
+{
+	struct sockaddr_un sun;
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)))
+	{
+		close(fd);
+		return -1;
+	}
+
+	strcpy(socket_path, path);
+
+	return fd;
+}
+
+static int ugci_bind_loopback(const char *port)
+{
+	struct sockaddr_in sin;
+	char *end;
+	long num = strtol(port, &end, 10);
+	int fd, one = 1;
+
+	if (*port == '\0' || *end != '\0' || num <= 0 || num > 65535)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(num);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)))
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int ugci_start_exporter(const char *addr)
+{
+	if (exporter_running || addr == NULL)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	socket_path[0] = '\0';
+
+	if (addr[0] == '/')
+		listen_fd = ugci_bind_unix(addr);
+	else
+		listen_fd = ugci_bind_loopback(addr);
+
+	if (listen_fd < 0)
+		return -1;
+
+	if (listen(listen_fd, 4))
+		goto err_close;
+
+	if ((stop_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+		goto err_close;
+
+	if (pthread_create(&exporter, NULL, ugci_exporter, NULL))
+		goto err_stop;
+
+	__atomic_store_n(&exporter_running, 1, __ATOMIC_RELAXED);
+
+	return 0;
+
+err_stop:
+	close(stop_fd);
+	stop_fd = -1;
+err_close:
+	close(listen_fd);
+	listen_fd = -1;
+	if (socket_path[0])
+		unlink(socket_path);
+
+	return -1;
+}
+
+void ugci_stop_exporter(void)
+{
+	unsigned long long one = 1;
+	ssize_t wr;
+
+	if (!exporter_running)
+		return;
+
+	while ((wr = write(stop_fd, &one, sizeof(one))) < 0 && errno == EINTR)
+		;
+
+	__atomic_store_n(&exporter_running, 0, __ATOMIC_RELAXED);
+
+	/* Closing the sockets under a running thread could hand their
+	 * numbers to something else it would then accept on */
+	if (wr != sizeof(one))
+	{
+		fprintf(stderr, "UGCI: Could not stop the exporter thread\n");
+		stop_fd = listen_fd = -1;
+		return;
+	}
+
+	pthread_join(exporter, NULL);
+
+	close(stop_fd);
+	close(listen_fd);
+	stop_fd = listen_fd = -1;
+
+	if (socket_path[0])
+		unlink(socket_path);
+}
+
+int ugci_exporter_running(void)
+{
+	return __atomic_load_n(&exporter_running, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,264 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * HID-BPF program for the UGCI player reports. hid-input has no mapping
+ * for the Arcade page usages the board reports coin and play with, so
+ * ugcibpf hands us a rewritten report descriptor in which they are
+ * keyboard usages, and we substitute it at probe time. The coin field is
+ * a counter, so every step it moves queues a press of the coin key, and
+ * each report has the field replaced with whether the key is down. Each
+ * press is held for release_ms, and the key then stays up for as long
+ * before the next queued one, so frame based emulators see every coin,
+ * even coins closer together than that. Presses and releases the board
+ * sends no report for are made by replaying its last report.
+ *
+ * Needs a kernel with struct_ops HID-BPF and bpf_wq (6.11 or later).
+ */
+
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+
+#include "ugci-hid.h"
+
+#define CLOCK_MONOTONIC		1
+
+extern __u8 *hid_bpf_get_data(struct hid_bpf_ctx *ctx, unsigned int offset,
+			      const size_t __sz) __ksym;
+extern struct hid_bpf_ctx *hid_bpf_allocate_context(unsigned int hid_id) __ksym;
+extern void hid_bpf_release_context(struct hid_bpf_ctx *ctx) __ksym;
+extern int hid_bpf_input_report(struct hid_bpf_ctx *ctx, enum hid_report_type type,
+				__u8 *buf, const size_t buf__sz) __ksym;
+extern int bpf_wq_init(struct bpf_wq *wq, void *p__map, unsigned int flags) __ksym;
+extern int bpf_wq_start(struct bpf_wq *wq, unsigned int flags) __ksym;
+extern int bpf_wq_set_callback_impl(struct bpf_wq *wq,
+		int (callback_fn)(void *map, int *key, void *value),
+		unsigned int flags, void *aux__ign) __ksym;
+
+/* Filled in by ugcibpf before loading */
+const volatile struct ugci_hid_layout layout;
+const volatile __u32 release_ms = UGCI_HID_RELEASE_MS;
+const volatile __u32 rdesc_size;
+const volatile __u8 rdesc[UGCI_HID_RDESC_MAX];
+
+/* Per player: the last raw report, replayed to move the coin key, and
+ * the state of the key. pending counts the coins not pressed for yet,
+ * waiting is set while the timer runs, and inject marks the next report
+ * as the replay the timer asked for. The device event hook and the work
+ * queue both change these, so they are only touched under the lock. */
+struct ugci_hid_player {
+	struct bpf_spin_lock lock;
+	struct bpf_timer timer;
+	struct bpf_wq work;
+	int init;
+	__u8 data[UGCI_HID_REPORT_MAX];
+	__u32 size;
+	__u32 coin;
+	int valid;
+	int down;
+	int pending;
+	int waiting;
+	int inject;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 2);
+	__type(key, int);
+	__type(value, struct ugci_hid_player);
+} players SEC(".maps");
+
+/* Set on every report, always to the same device */
+static __u32 hid_id;
+
+/* Field offsets do not count the report ID byte */
+static __u32 get_bits(const __u8 *data, unsigned int offset, unsigned int size)
+{
+	unsigned int i, bit;
+	__u32 v = 0;
+
+	for (i = 0; i < 32 && i < size; i++)
+	{
+		bit = offset + i;
+		if (1 + bit / 8 >= UGCI_HID_REPORT_MAX)
+			break;
+		v |= ((data[1 + bit / 8] >> (bit & 7)) & 1) << i;
+	}
+
+	return v;
+}
+
+static void set_bits(__u8 *data, unsigned int offset, unsigned int size, __u32 v)
+{
+	unsigned int i, bit;
+
+	for (i = 0; i < 32 && i < size; i++)
+	{
+		bit = offset + i;
+		if (1 + bit / 8 >= UGCI_HID_REPORT_MAX)
+			break;
+		if ((v >> i) & 1)
+			data[1 + bit / 8] |= 1 << (bit & 7);
+		else
+			data[1 + bit / 8] &= ~(1 << (bit & 7));
+	}
+}
+
+/* Replaying the last raw report, whose counter has not moved since,
+ * takes the coin key a step further through ugci_event() */
+static int step_work(void *map, int *key, void *value)
+{
+	struct ugci_hid_player *pl = value;
+	__u8 buf[UGCI_HID_REPORT_MAX];
+	struct hid_bpf_ctx *ctx;
+	__u32 size;
+
+	bpf_spin_lock(&pl->lock);
+	pl->waiting = 0;
+	pl->inject = 1;
+	__builtin_memcpy(buf, pl->data, UGCI_HID_REPORT_MAX);
+	size = pl->size;
+	bpf_spin_unlock(&pl->lock);
+
+	if (size < 1 || size > UGCI_HID_REPORT_MAX)
+		return 0;
+
+	if (!(ctx = hid_bpf_allocate_context(hid_id)))
+		return 0;
+
+	hid_bpf_input_report(ctx, HID_INPUT_REPORT, buf, size);
+	hid_bpf_release_context(ctx);
+
+	return 0;
+}
+
+static int step_timer(void *map, int *key, struct ugci_hid_player *pl)
+{
+	bpf_wq_start(&pl->work, 0);
+	return 0;
+}
+
+/* Starts the timer for the next step. The caller has set waiting. Setting
+ * the timer up twice, should two reports race here, only fails the
+ * second time. */
+static void schedule_step(struct ugci_hid_player *pl)
+{
+	if (!pl->init)
+	{
+		bpf_timer_init(&pl->timer, &players, CLOCK_MONOTONIC);
+		bpf_timer_set_callback(&pl->timer, step_timer);
+		bpf_wq_init(&pl->work, &players, 0);
+		bpf_wq_set_callback_impl(&pl->work, step_work, 0, NULL);
+		pl->init = 1;
+	}
+
+	bpf_timer_start(&pl->timer, release_ms * 1000000ULL, 0);
+}
+
+/* Move the coin key along for a report, under the lock: a replay releases
+ * a held key, or presses for the next coin once the key has been up long
+ * enough. Returns whether the timer has to be started. */
+static __always_inline int step_coin(struct ugci_hid_player *pl)
+{
+	int inject = pl->inject;
+
+	pl->inject = 0;
+
+	if (inject && pl->down)
+	{
+		pl->down = 0;
+		if (!pl->pending)
+			return 0;
+	}
+	else if (pl->down || !pl->pending || (!inject && pl->waiting))
+		return 0;
+	else
+	{
+		pl->down = 1;
+		pl->pending--;
+	}
+
+	pl->waiting = 1;
+
+	return 1;
+}
+
+SEC("struct_ops/hid_device_event")
+int BPF_PROG(ugci_event, struct hid_bpf_ctx *hctx, enum hid_report_type type, __u64 source)
+{
+	__u8 *data = hid_bpf_get_data(hctx, 0, UGCI_HID_REPORT_MAX);
+	struct ugci_hid_player *pl;
+	__u32 coin, mask, moved;
+	int p, down, start;
+
+	if (!data || type != HID_INPUT_REPORT)
+		return 0;
+
+	for (p = 0; p < 2; p++)
+	{
+		if (data[0] != layout.report_id[p])
+			continue;
+
+		if (!(pl = bpf_map_lookup_elem(&players, &p)))
+			break;
+
+		coin = get_bits(data, layout.coin_offset[p], layout.coin_size[p]);
+		mask = layout.coin_size[p] >= 32 ? ~0U : (1U << layout.coin_size[p]) - 1;
+		hid_id = hctx->hid->id;
+
+		bpf_spin_lock(&pl->lock);
+
+		/* The first report only sets the baseline. A counter that
+		 * jumped too far was reset rather than fed coins. */
+		moved = pl->valid ? (coin - pl->coin) & mask : 0;
+		if (moved <= UGCI_HID_MAX_PENDING)
+		{
+			pl->pending += moved;
+			if (pl->pending > UGCI_HID_MAX_PENDING)
+				pl->pending = UGCI_HID_MAX_PENDING;
+		}
+
+		__builtin_memcpy(pl->data, data, UGCI_HID_REPORT_MAX);
+		pl->size = hctx->size;
+		pl->coin = coin;
+		pl->valid = 1;
+
+		start = step_coin(pl);
+		down = pl->down;
+
+		bpf_spin_unlock(&pl->lock);
+
+		set_bits(data, layout.coin_offset[p], layout.coin_size[p], down);
+
+		if (start)
+			schedule_step(pl);
+
+		break;
+	}
+
+	return 0;
+}
+
+SEC("struct_ops/hid_rdesc_fixup")
+int BPF_PROG(ugci_rdesc_fixup, struct hid_bpf_ctx *hctx)
+{
+	__u8 *data = hid_bpf_get_data(hctx, 0, UGCI_HID_RDESC_MAX);
+	int i;
+
+	if (!data || !rdesc_size || rdesc_size > UGCI_HID_RDESC_MAX)
+		return 0;
+
+	for (i = 0; i < UGCI_HID_RDESC_MAX && i < rdesc_size; i++)
+		data[i] = rdesc[i];
+
+	return rdesc_size;
+}
+
+SEC(".struct_ops.link")
+struct hid_bpf_ops ugci_hid = {
+	.hid_device_event = (void *)ugci_event,
+	.hid_rdesc_fixup = (void *)ugci_rdesc_fixup,
+};
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,46 @@
+/* 
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* Shared between the HID-BPF program (ugci-hid.bpf.c) and its loader
+ * (ugcibpf.c). */
+
+#ifndef _UGCI_HID_H
+#define _UGCI_HID_H
+
+/* The kernel's HID_MAX_DESCRIPTOR_SIZE */
+#define UGCI_HID_RDESC_MAX	4096
+
+/* Enough of a player report for the report ID, coin and play */
+#define UGCI_HID_REPORT_MAX	8
+
+/* How long the coin key is held, as with ugci_set_coin_simulate(), and
+ * then kept up before the next coin */
+#define UGCI_HID_RELEASE_MS	100
+
+/* Most coins queued up for pressing, as with libugci's coin gap limit */
+#define UGCI_HID_MAX_PENDING	16
+
+/* Where the coin counter sits in each player report, in bits after the
+ * report ID byte */
+struct ugci_hid_layout {
+	__u8 report_id[2];
+	__u16 coin_offset[2];
+	__u16 coin_size[2];
+};
+
+#endif /* _UGCI_HID_H */
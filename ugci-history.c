@@ -0,0 +1,103 @@
+/* 
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* Frame history ring. The ring is sized to a power of two so a frame
+ * number maps straight to its slot; each slot remembers which frame it
+ * holds, so stale slots are detected on lookup. */
+static struct ugci_frame_input *ring;
+static unsigned int ring_mask;
+static unsigned int next_frame;
+static unsigned short last_coin_count[UGCI_MAX_PLAYERS];
+
+int ugci_history_enable(unsigned int frames)
+{
+	unsigned int size;
+
+	free(ring);
+	ring = NULL;
+	ring_mask = 0;
+	next_frame = 0;
+
+	if (!frames)
+		return 0;
+
+	for (size = 1; size < frames; size <<= 1)
+		if (size & 0x80000000)
+			return -1;
+
+	if (!(ring = malloc(size * sizeof(*ring))))
+		return -1;
+
+	/* Frame 0 must not match an untouched slot */
+	memset(ring, 0xff, size * sizeof(*ring));
+	ring_mask = size - 1;
+
+	return 0;
+}
+
+void ugci_history_record(struct ugci_state *state)
+{
+	struct ugci_frame_input *in;
+	int i;
+
+	if (!ring)
+		return;
+
+	state->frame = next_frame;
+	in = &ring[next_frame & ring_mask];
+	in->frame = next_frame++;
+	in->coin = in->play = 0;
+
+	for (i = 0; i < state->players; i++)
+	{
+		/* The first frame has nothing to compare the counters with */
+		if (in->frame && state->coin_count[i] != last_coin_count[i])
+			in->coin |= 1 << i;
+		if (state->play[i])
+			in->play |= 1 << i;
+		in->buttons[i] = state->buttons[i];
+
+		last_coin_count[i] = state->coin_count[i];
+	}
+}
+
+int ugci_history_get(unsigned int frame, struct ugci_frame_input *input)
+{
+	const struct ugci_frame_input *in;
+
+	if (!ring)
+		return -1;
+
+	in = &ring[frame & ring_mask];
+	if (in->frame != frame)
+		return -1;
+
+	*input = *in;
+
+	return 0;
+}
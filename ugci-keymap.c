@@ -0,0 +1,123 @@
+/* 
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* Key map layout in the eeprom. Byte 0 holds the flags read by
+ * ugci_init(); bit 0 enables the mapping. Each input then has a two byte
+ * entry, the HID modifier mask followed by the HID keyboard usage, for
+ * all of player 1's inputs and then all of player 2's, in ugci_input
+ * order. A zero usage leaves the input unmapped.
+ *
+ * Only the flags byte is documented. The entries are a best guess that
+ * has not been checked against a vendor image or the vendor tool, so the
+ * map is only ever decoded, never written back. */
+#define UGCI_KEYMAP_ENABLE		0x01
+#define UGCI_KEYMAP_OFFSET		1
+#define UGCI_KEYMAP_ENTRY(player, input) \
+	(UGCI_KEYMAP_OFFSET + ((player) * UGCI_INPUTS + (input)) * 2)
+
+/* Compiled lookup table, indexed directly by player and input, and
+ * whether each device's part of it has been built from its eeprom. A
+ * device whose eeprom could not be read for a lookup is not tried again
+ * until it is reopened. */
+#define UGCI_KEYTAB_UNREAD		0
+#define UGCI_KEYTAB_FAILED		1
+#define UGCI_KEYTAB_BUILT		2
+
+static unsigned short keytab[UGCI_MAX_PLAYERS][UGCI_INPUTS];
+static unsigned char keytab_state[UGCI_MAX_DEVS];
+
+static void ugci_keymap_decode(const unsigned char *eeprom, struct ugci_keymap *map)
+{
+	int p, i, off;
+
+	memset(map, 0, sizeof(*map));
+	map->enabled = eeprom[0] & UGCI_KEYMAP_ENABLE;
+
+	for (p = 0; p < 2; p++)
+		for (i = 0; i < UGCI_INPUTS; i++)
+		{
+			off = UGCI_KEYMAP_ENTRY(p, i);
+			map->key[p][i].modifiers = eeprom[off];
+			map->key[p][i].usage = eeprom[off + 1];
+		}
+}
+
+void ugci_keymap_compile(int id, const unsigned char *eeprom)
+{
+	struct ugci_keymap map;
+	int p, i;
+
+	memset(keytab[id * 2], 0, sizeof(keytab[0]) * 2);
+	keytab_state[id] = eeprom ? UGCI_KEYTAB_BUILT : UGCI_KEYTAB_UNREAD;
+
+	if (eeprom == NULL)
+		return;
+
+	ugci_keymap_decode(eeprom, &map);
+	if (!map.enabled)
+		return;
+
+	for (p = 0; p < 2; p++)
+		for (i = 0; i < UGCI_INPUTS; i++)
+			if (map.key[p][i].usage)
+				keytab[id * 2 + p][i] = UGCI_KEY(map.key[p][i].modifiers,
+								 map.key[p][i].usage);
+}
+
+int ugci_get_keymap(int id, struct ugci_keymap *map)
+{
+	unsigned char eeprom[504];
+	int len;
+
+	if (map == NULL || ugci_get_eeprom(id, eeprom, &len))
+		return -1;
+
+	ugci_keymap_decode(eeprom, map);
+
+	return 0;
+}
+
+unsigned short ugci_lookup_key(int player, enum ugci_input input)
+{
+	if ((unsigned int)player >= UGCI_MAX_PLAYERS ||
+	    (unsigned int)input >= UGCI_INPUTS)
+		return 0;
+
+	/* The eeprom is no longer read at init, so the first lookup on a
+	 * device reads it, which compiles its part of the table */
+	if (keytab_state[player / 2] == UGCI_KEYTAB_UNREAD)
+	{
+		unsigned char eeprom[504];
+		int len;
+
+		ugci_get_eeprom(player / 2, eeprom, &len);
+		if (keytab_state[player / 2] != UGCI_KEYTAB_BUILT)
+			keytab_state[player / 2] = UGCI_KEYTAB_FAILED;
+	}
+
+	return keytab[player][input];
+}
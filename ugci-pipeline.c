@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* Every stage, in chain order. Read and decode feed the chain and are
+ * only listed for their counters. A stage without an enabled hook is
+ * always part of the chain. */
+static const struct ugci_stage stages[UGCI_STAGES] = {
+	[UGCI_STAGE_READ]	= { "read" },
+	[UGCI_STAGE_DECODE]	= { "decode" },
+	[UGCI_STAGE_DEBOUNCE]	= { "debounce", ugci_debounce_stage, ugci_debounce_active,
+				    ugci_debounce_deadline },
+	[UGCI_STAGE_STATE]	= { "state", ugci_state_stage },
+	[UGCI_STAGE_CHANGES]	= { "changes", ugci_changes_stage, ugci_changes_active },
+	[UGCI_STAGE_COMBO]	= { "combo", ugci_combo_stage, ugci_combo_active,
+				    ugci_combo_deadline },
+	[UGCI_STAGE_COIN_SIM]	= { "coin-sim", ugci_coin_sim_stage, ugci_coin_sim_active,
+				    ugci_coin_sim_deadline },
+	[UGCI_STAGE_BRIDGE]	= { "bridge", ugci_bridge_stage, ugci_bridge_running,
+				    NULL, 1 },
+	[UGCI_STAGE_MASK]	= { "mask", ugci_mask_stage },
+	[UGCI_STAGE_CALLBACK]	= { "callback", ugci_callback_stage, ugci_callback_active,
+				    NULL, 1 },
+};
+
+static struct ugci_stage_stats stats[UGCI_STAGES];
+static int timing;
+
+/* The assembled chain, rebuilt on the next run after a change */
+static int chain[UGCI_STAGES];
+static int nchain;
+static int chain_dirty = 1;
+
+/* Events go into buf[0] until the chain runs. Stages then read from one
+ * buffer and emit into the other. */
+static struct ugci_pipe_event buf[2][UGCI_PIPE_EVENTS];
+static struct ugci_pipe_event *out = buf[0];
+static int nout;
+static int cur_stage = UGCI_STAGE_DECODE;
+static int running;
+static int flushed;
+
+static void ugci_pipe_build(void)
+{
+	int s;
+
+	for (s = nchain = 0; s < UGCI_STAGES; s++)
+	{
+		stats[s].name = stages[s].name;
+		stats[s].enabled = s < UGCI_STAGE_DEBOUNCE ||
+			!stages[s].enabled || stages[s].enabled();
+
+		if (s >= UGCI_STAGE_DEBOUNCE && stats[s].enabled)
+			chain[nchain++] = s;
+	}
+
+	chain_dirty = 0;
+}
+
+void ugci_pipe_changed(void)
+{
+	chain_dirty = 1;
+}
+
+void ugci_pipe_emit(const struct ugci_pipe_event *ev)
+{
+	/* Decode ran ahead of the chain, catch up while there is still room
+	 * for what the stages add */
+	if (nout == UGCI_PIPE_EVENTS / 4 && !running)
+		flushed += ugci_pipe_run(ugci_now_ns());
+
+	if (nout == UGCI_PIPE_EVENTS)
+	{
+		stats[cur_stage].dropped++;
+		return;
+	}
+
+	if (!running)
+		stats[UGCI_STAGE_DECODE].events++;
+
+	out[nout++] = *ev;
+}
+
+void ugci_pipe_send(int id, enum ugci_event_type type, int value,
+		    unsigned long long ns)
+{
+	struct ugci_pipe_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.ev.time_ns = ns;
+	ev.ev.id = id;
+	ev.ev.type = type;
+	ev.ev.value = value;
+
+	ugci_pipe_emit(&ev);
+}
+
+unsigned long long ugci_pipe_clock(void)
+{
+	return timing ? ugci_now_ns() : 0;
+}
+
+void ugci_pipe_account(enum ugci_stage_id s, unsigned long long start, int events)
+{
+	stats[s].runs++;
+	stats[s].events += events;
+	if (start)
+		stats[s].ns += ugci_now_ns() - start;
+}
+
+unsigned long long ugci_pipe_deadline(void)
+{
+	unsigned long long d, next = 0;
+	int c;
+
+	if (chain_dirty)
+		ugci_pipe_build();
+
+	for (c = 0; c < nchain; c++)
+		if (stages[chain[c]].deadline && (d = stages[chain[c]].deadline()) &&
+		    (!next || d < next))
+			next = d;
+
+	return next;
+}
+
+int ugci_pipe_run(unsigned long long now)
+{
+	const struct ugci_pipe_event *in = buf[0];
+	unsigned long long start;
+	int c, n = nout;
+
+	if (chain_dirty)
+		ugci_pipe_build();
+
+	/* Nothing came in and no stage has a deadline due */
+	if (!n)
+	{
+		unsigned long long d = ugci_pipe_deadline();
+
+		if (!d || d > now)
+			return 0;
+	}
+
+	running = 1;
+
+	for (c = 0; c < nchain; c++)
+	{
+		const struct ugci_stage *s = &stages[chain[c]];
+
+		cur_stage = chain[c];
+		start = ugci_pipe_clock();
+
+		if (s->observe)
+			s->run(in, n, now);
+		else
+		{
+			out = in == buf[0] ? buf[1] : buf[0];
+			nout = 0;
+			s->run(in, n, now);
+			in = out;
+			n = nout;
+		}
+
+		ugci_pipe_account(cur_stage, start, n);
+	}
+
+	running = 0;
+	cur_stage = UGCI_STAGE_DECODE;
+	out = buf[0];
+	nout = 0;
+
+	return n;
+}
+
+int ugci_pipe_flush(unsigned long long now)
+{
+	int events = flushed + ugci_pipe_run(now);
+
+	flushed = 0;
+
+	return events;
+}
+
+int ugci_get_stage_stats(struct ugci_stage_stats *st, int max)
+{
+	int s;
+
+	if (chain_dirty)
+		ugci_pipe_build();
+
+	for (s = 0; s < max && s < UGCI_STAGES; s++)
+		st[s] = stats[s];
+
+	return UGCI_STAGES;
+}
+
+void ugci_set_stage_timing(int enable)
+{
+	timing = enable;
+}
+
+void ugci_reset_stage_stats(void)
+{
+	int s;
+
+	for (s = 0; s < UGCI_STAGES; s++)
+	{
+		stats[s].runs = stats[s].events = stats[s].dropped = 0;
+		stats[s].ns = 0;
+	}
+}
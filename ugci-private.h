@@ -26,7 +26,10 @@
 #endif
 
 /* Enough for 8 players should be a good default */
-#define UGCI_MAX_DEVS			4
+#define UGCI_MAX_DEVS			(UGCI_MAX_PLAYERS / 2)
+
+/* Evdev nodes opened per board, one per joystick */
+#define UGCI_MAX_EVDEV			2
 
 /* We need the support of urefs and collections */
 #define MIN_HID_VERSION 0x010004
@@ -35,18 +38,52 @@
 #error Your HIDDev header is too old.
 #endif
 
+struct ugci_usbfs;
+
 struct ugci_dev_info {
 	int id;
 
 	int fd;
 
+	/* Set when the board is driven through usbfs instead of hiddev */
+	struct ugci_usbfs *usb;
+
 	/* Simul */
 	int coin_pressed[2];
-	struct timeval last_tv[2];
+	unsigned long long coin_ns[2];
+
+	/* Play and stick buttons as last decoded, before any filtering */
+	unsigned char raw_play[2];
+	unsigned char raw_buttons[2];
+
+	/* Last known state, for ugci_sample_frame() */
+	unsigned short coin_count[2];
+	unsigned char play[2];
+	short stick_x[2];
+	short stick_y[2];
+	unsigned char buttons[2];
+	unsigned long long last_read_ns;	/* Atomic, set by the reader */
+
+	/* Queue overflow detection, full_reads is only used by the reader */
+	int full_reads;
+	int resync;
+
+	/* Counters, see ugci_get_stats() */
+	struct ugci_stats stats;
 
 	/* Watchdog */
 	unsigned int wd_interval;
 	time_t last_wd;
+	struct ugci_request *wd_req;	/* Application thread only */
+
+	/* Evdev nodes on the same interface, see UGCI_EVENT_MASK_EVDEV */
+	int evfd[UGCI_MAX_EVDEV];
+	int nevfd;
+
+	/* Security block cache */
+	int serial_fetched;
+	unsigned char secblk[UGCI_SEC_VALUES];
+	int secblk_valid;
 
 	/* EEPROM */
 	unsigned char eeprom[504];
@@ -55,6 +92,43 @@ struct ugci_dev_info {
 };
 
 
+/* Largest jump in a coin counter we will make up coin events for */
+#define UGCI_MAX_COIN_GAP		16
+
+/* Reads per device that one ugci_poll() will merge, and their size */
+#define UGCI_BATCHES			4
+#define UGCI_BATCH_EVENTS		64
+
+struct ugci_batch {
+	unsigned long long read_ns;
+	int count;
+	struct hiddev_usage_ref ev[UGCI_BATCH_EVENTS];
+};
+
+/* Events read from a board's evdev node, see ugci-evdev.c */
+struct ugci_evdev_event {
+	unsigned long long time_ns;
+	unsigned short type;
+	unsigned short code;
+	int value;
+};
+
+struct ugci_evdev_batch {
+	int count;
+	struct ugci_evdev_event ev[UGCI_BATCH_EVENTS];
+};
+
+/* hiddev signals usage events to read with POLLIN, usbfs signals
+ * transfers to reap with POLLOUT */
+#define UGCI_POLL_READY			(POLLIN | POLLOUT)
+
+/* Counters may be bumped from the reader thread */
+struct ugci_stats *ugci_dev_stats(int id);
+#define UGCI_STAT_INC(stats, field) \
+	__atomic_add_fetch(&(stats)->field, 1, __ATOMIC_RELAXED)
+#define UGCI_STAT_ADD(stats, field, n) \
+	__atomic_add_fetch(&(stats)->field, (n), __ATOMIC_RELAXED)
+
 enum ugci_report_type {
 	UGCI_UREF_P1_COIN = 0,
 	UGCI_UREF_P1_PLAY,
@@ -68,12 +142,173 @@ enum ugci_report_type {
 	UGCI_UREF_WD_TIMEOUT,
 	UGCI_UREF_KBD_MODE,
 	UGCI_UREF_EEPROM_READ,
+	UGCI_UREF_J1_AXES,
+	UGCI_UREF_J1_BUTTONS,
+	UGCI_UREF_J2_AXES,
+	UGCI_UREF_J2_BUTTONS,
+	UGCI_UREF_EEPROM_WRITE,
 	UGCI_UREFS_MAX /* Final entry */
 };
 
+struct ugci_request {
+	struct ugci_dev_info *dev;
+	enum ugci_op op;
+	struct hiddev_usage_ref_multi uref_multi[2];
+	struct hiddev_report_info rinfo;
+};
+
+/* hiddev requests to a device, whichever way it is driven */
+int ugci_dev_ioctl(struct ugci_dev_info *dev, unsigned long req, void *arg);
+
 void ugci_fill_uref(enum ugci_report_type type, struct hiddev_usage_ref_multi *uref_multi);
 int ugci_commit_uref(struct ugci_dev_info *dev, enum ugci_report_type type);
 
+void ugci_history_record(struct ugci_state *state);
+
+int ugci_evdev_open(int hiddev, int *fds, int max);
+int ugci_evdev_read(int fd, struct ugci_evdev_batch *batch);
+
+/* Event pipeline, see ugci-pipeline.c. Decode emits events into the
+ * pipeline, which runs them through the chain of enabled stages once
+ * per poll, or earlier when decode runs too far ahead. Each stage takes
+ * the array the one before it emitted and emits what is left for the
+ * next, changed, filtered or with events of its own added; sinks only
+ * look at the array. Stages with a deadline hook also run when their
+ * deadline is due, with nothing coming in. */
+#define UGCI_PIPE_EVENTS		512
+
+struct ugci_pipe_event {
+	struct ugci_event ev;
+	unsigned char changed;		/* From the state stage. PLAY: it changed,
+					 * STICK: the buttons that changed */
+	unsigned char moved;		/* STICK: the axes changed */
+};
+
+enum ugci_stage_id {
+	UGCI_STAGE_READ = 0,
+	UGCI_STAGE_DECODE,
+	UGCI_STAGE_DEBOUNCE,
+	UGCI_STAGE_STATE,
+	UGCI_STAGE_CHANGES,
+	UGCI_STAGE_COMBO,
+	UGCI_STAGE_COIN_SIM,
+	UGCI_STAGE_BRIDGE,
+	UGCI_STAGE_MASK,
+	UGCI_STAGE_CALLBACK,
+	UGCI_STAGES
+};
+
+typedef void (*ugci_stage_run_t)(const struct ugci_pipe_event *in, int n,
+				 unsigned long long now);
+
+struct ugci_stage {
+	const char *name;
+	ugci_stage_run_t run;
+	int (*enabled)(void);
+	unsigned long long (*deadline)(void);	/* 0 for none */
+	int observe;				/* Sink, does not emit */
+};
+
+void ugci_pipe_emit(const struct ugci_pipe_event *ev);
+void ugci_pipe_send(int id, enum ugci_event_type type, int value,
+		    unsigned long long ns);
+void ugci_pipe_changed(void);
+unsigned long long ugci_pipe_deadline(void);
+int ugci_pipe_run(unsigned long long now);
+int ugci_pipe_flush(unsigned long long now);
+unsigned long long ugci_pipe_clock(void);
+void ugci_pipe_account(enum ugci_stage_id s, unsigned long long start, int events);
+void ugci_reset_stage_stats(void);
+
+/* Stages that live in ugci.c */
+void ugci_state_stage(const struct ugci_pipe_event *in, int n, unsigned long long now);
+void ugci_changes_stage(const struct ugci_pipe_event *in, int n, unsigned long long now);
+int ugci_changes_active(void);
+void ugci_coin_sim_stage(const struct ugci_pipe_event *in, int n, unsigned long long now);
+int ugci_coin_sim_active(void);
+unsigned long long ugci_coin_sim_deadline(void);
+void ugci_mask_stage(const struct ugci_pipe_event *in, int n, unsigned long long now);
+void ugci_callback_stage(const struct ugci_pipe_event *in, int n, unsigned long long now);
+int ugci_callback_active(void);
+
+/* uinput bridge, see ugci-uinput.c */
+int ugci_bridge_running(void);
+void ugci_bridge_stage(const struct ugci_pipe_event *in, int n, unsigned long long now);
+
+/* usbfs transport, see ugci-usbfs.c. Interrupt transfers kept queued
+ * per board. */
+#define UGCI_USBFS_URBS			4
+
+struct ugci_usbfs *ugci_usbfs_open(int index, char *path, int len);
+void ugci_usbfs_close(struct ugci_usbfs *usb);
+int ugci_usbfs_fd(struct ugci_usbfs *usb);
+int ugci_usbfs_ioctl(struct ugci_usbfs *usb, unsigned long req, void *arg);
+int ugci_usbfs_read(struct ugci_usbfs *usb, struct hiddev_usage_ref *ev, int max);
+
+/* Metrics exporter, see ugci-exporter.c. Durations are only measured
+ * while it runs. ugci_dev_count() is the number of devices found by the
+ * last ugci_init(), open or not. */
+int ugci_exporter_running(void);
+int ugci_dev_count(void);
+
+/* Axis streams, see ugci-axis.c. Raw samples kept per axis, a power of 2 */
+#define UGCI_AXIS_SAMPLES		8
+
+void ugci_axis_record(int player, enum ugci_axis axis, int value,
+		      unsigned long long ns);
+int ugci_stick_value(int player, enum ugci_axis axis);
+
+/* Combo engine, see ugci-combo.c. ugci_combo_deadline() is the next
+ * hold time or timeout due, or 0 for none. */
+void ugci_combo_stage(const struct ugci_pipe_event *in, int n, unsigned long long now);
+int ugci_combo_active(void);
+unsigned long long ugci_combo_deadline(void);
+
+/* Debounce, see ugci-debounce.c. ugci_debounce_deadline() is the next
+ * change held back that is due, or 0 for none. ugci_input_value() is an
+ * input as last decoded. */
+void ugci_debounce_stage(const struct ugci_pipe_event *in, int n, unsigned long long now);
+int ugci_debounce_active(void);
+unsigned long long ugci_debounce_deadline(void);
+void ugci_debounce_clear(void);
+int ugci_input_value(int player, enum ugci_input input);
+
+/* The play and stick buttons a player holds, as UGCI_INPUT_BIT()s */
+unsigned short ugci_held_inputs(int player);
+
+/* k-way merge of per device event sources, each a run of timestamps in
+ * ascending order, stride bytes apart. Returns the source whose next
+ * entry is the oldest, or -1 once all are used up; the caller consumes
+ * that entry by advancing its head. Ties go to the lowest source, and a
+ * source's entries always come out in order, so the result depends on
+ * nothing but the timestamps and the order of the sources. */
+struct ugci_merge_src {
+	const unsigned long long *ns;
+	size_t stride;
+	int count;
+	int head;
+};
+
+int ugci_merge_next(struct ugci_merge_src *src, int n);
+
+/* Rebuild the key lookup table of a device, or clear it for NULL */
+void ugci_keymap_compile(int id, const unsigned char *eeprom);
+
+/* Device access for the reader thread */
+int ugci_dev_fd(int id);
+int ugci_read_dev(int id, struct ugci_batch *batch, unsigned long long ready_ns);
+int ugci_queue_batch(int id, const struct ugci_batch *batch);
+int ugci_queue_full(int id);
+void ugci_request_resync(int id);
+unsigned long long ugci_last_input_ns(void);
+
+/* Reader thread, see ugci-rt.c */
+struct pollfd;
+int ugci_reader_running(void);
+int ugci_reader_collect(const struct pollfd *extra, int nextra,
+			const struct timespec *timeout);
+int ugci_spin_poll(struct pollfd *pfd, int fds, unsigned long long *left_ns);
+
 #define USB_VENDOR_ID_HAPP		0x078b
 #define USB_DEVICE_ID_UGCI_DRIVING	0x0010
 #define USB_DEVICE_ID_UGCI_FLYING	0x0020
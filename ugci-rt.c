@@ -0,0 +1,545 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* Batches in flight between the reader thread and ugci_poll(). Must be a
+ * power of two. */
+#define UGCI_RING_SIZE		64
+
+/* How much of the reader's stack to fault in and lock up front */
+#define UGCI_RT_STACK_SIZE	(256 * 1024)
+#define UGCI_RT_PREFAULT	(64 * 1024)
+
+/* Per device overflow area, used while the ring is full. Coin events are
+ * kept in order, everything else only keeps its latest value. The latter
+ * has room for every usage of the player and joystick reports. */
+#define UGCI_SPILL_COINS	1024
+#define UGCI_SPILL_LATEST	32
+
+struct ugci_ring_entry {
+	int id;
+	struct ugci_batch batch;
+};
+
+struct ugci_spill {
+	unsigned long long read_ns;
+	int error;
+	int resync;		/* A change was dropped, resync once drained */
+	int ncoins, nlatest;
+	struct hiddev_usage_ref coins[UGCI_SPILL_COINS];
+	struct hiddev_usage_ref latest[UGCI_SPILL_LATEST];
+};
+
+/* Single producer (reader thread), single consumer (ugci_poll()) ring.
+ * The reader only ever writes ring_head, ugci_poll() only ring_tail. */
+static struct ugci_ring_entry ring[UGCI_RING_SIZE];
+static unsigned int ring_head, ring_tail;
+
+/* Only the reader sets spilling, only ugci_poll() clears it. Everything
+ * else in the spill area is under spill_lock. */
+static struct ugci_spill spill[UGCI_MAX_DEVS];
+static int spilling[UGCI_MAX_DEVS];
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ugci_batch reader_batch;	/* Reader thread only */
+static struct ugci_batch unspill_batch;	/* ugci_poll() only */
+
+static pthread_t reader;
+static int reader_running;
+static int wake_fd = -1;	/* Reader -> ugci_poll() */
+static int stop_fd = -1;	/* ugci_stop_reader() -> reader */
+static void *reader_stack;
+static struct ugci_rt_config reader_cfg;
+
+static unsigned long long busy_budget_ns;
+static unsigned long long busy_active_ns;
+
+/* Touch a chunk of the current stack and lock it, so the thread will not
+ * take page faults on it later. */
+static void ugci_rt_prefault_stack(void)
+{
+	volatile unsigned char stack[UGCI_RT_PREFAULT];
+	int i;
+
+	for (i = 0; i < UGCI_RT_PREFAULT; i += 4096)
+		stack[i] = 0;
+
+	mlock((void *)stack, sizeof(stack));
+}
+
+int ugci_rt_setup(const struct ugci_rt_config *cfg)
+{
+	struct sched_param param;
+	int ret = 0;
+
+	if (cfg->cpu >= 0)
+	{
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cfg->cpu, &set);
+
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		{
+			fprintf(stderr, "UGCI: Could not pin thread to CPU %d\n", cfg->cpu);
+			ret = -1;
+		}
+	}
+
+	if (cfg->policy != SCHED_OTHER)
+	{
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = cfg->priority;
+
+		if (pthread_setschedparam(pthread_self(), cfg->policy, &param))
+		{
+			fprintf(stderr, "UGCI: Could not set realtime priority %d\n",
+				cfg->priority);
+			ret = -1;
+		}
+	}
+
+	if (cfg->mlock)
+		ugci_rt_prefault_stack();
+
+	return ret;
+}
+
+void ugci_set_busy_poll(unsigned int budget_us, unsigned int active_ms)
+{
+	busy_budget_ns = (unsigned long long)budget_us * 1000;
+	busy_active_ns = (unsigned long long)active_ms * 1000000;
+}
+
+/* Spin on nonblocking polls for up to the busy poll budget, or left_ns if
+ * that is shorter, and take the time spent off left_ns. A NULL left_ns
+ * means the caller would block forever. Returns as poll(2) does, so 0 if
+ * nothing became ready and the caller should block as usual. */
+int ugci_spin_poll(struct pollfd *pfd, int fds, unsigned long long *left_ns)
+{
+	unsigned long long start, now, budget = busy_budget_ns;
+	int ret;
+
+	if (!budget)
+		return 0;
+
+	start = now = ugci_now_ns();
+
+	/* Nobody is playing, so don't burn the CPU */
+	if (busy_active_ns && now - ugci_last_input_ns() > busy_active_ns)
+		return 0;
+
+	if (left_ns && *left_ns < budget)
+		budget = *left_ns;
+
+	do {
+		if ((ret = poll(pfd, fds, 0)) != 0)
+			break;
+	} while ((now = ugci_now_ns()) - start < budget);
+
+	if (left_ns)
+		*left_ns -= (now - start < *left_ns) ? now - start : *left_ns;
+
+	return ret;
+}
+
+static int ugci_same_usage(const struct hiddev_usage_ref *a,
+			   const struct hiddev_usage_ref *b)
+{
+	return a->report_id == b->report_id && a->usage_code == b->usage_code &&
+		a->field_index == b->field_index && a->usage_index == b->usage_index;
+}
+
+/* Keep only the newest value of a usage. Called with spill_lock held. */
+static void ugci_spill_latest(int id, const struct hiddev_usage_ref *ev)
+{
+	struct ugci_spill *sp = &spill[id];
+	int i;
+
+	for (i = 0; i < sp->nlatest; i++)
+	{
+		if (ugci_same_usage(&sp->latest[i], ev))
+		{
+			sp->latest[i] = *ev;
+			UGCI_STAT_INC(ugci_dev_stats(id), coalesced);
+			return;
+		}
+	}
+
+	/* A usage we have no room for. Rather than lose its change, have
+	 * ugci_poll() catch up with the device's reports, once what is
+	 * spilled here has been delivered and can no longer undo that. */
+	if (sp->nlatest == UGCI_SPILL_LATEST)
+	{
+		sp->resync = 1;
+		return;
+	}
+
+	sp->latest[sp->nlatest++] = *ev;
+}
+
+/* Move a batch into the overflow area. Coin events are never dropped. If
+ * even the spill fills up, further coins are coalesced as well, which is
+ * still lossless for the count since the coin value is an absolute
+ * counter. Called with spill_lock held. */
+static void ugci_spill_batch(int id, const struct ugci_batch *batch)
+{
+	struct ugci_spill *sp = &spill[id];
+	int t;
+
+	sp->read_ns = batch->read_ns;
+
+	for (t = 0; t < batch->count; t++)
+	{
+		const struct hiddev_usage_ref *ev = &batch->ev[t];
+
+		if (ev->usage_code == UGCI_PLAYER_UCODE_COIN &&
+		    sp->ncoins < UGCI_SPILL_COINS)
+		{
+			sp->coins[sp->ncoins++] = *ev;
+			UGCI_STAT_INC(ugci_dev_stats(id), spilled);
+		}
+		else
+			ugci_spill_latest(id, ev);
+	}
+}
+
+/* Turn as much of a device's overflow area as fits into one batch, coins
+ * first. Returns non-zero once the area is empty. Called with spill_lock
+ * held. */
+static int ugci_unspill(int id, struct ugci_batch *batch)
+{
+	struct ugci_spill *sp = &spill[id];
+	int n;
+
+	batch->read_ns = sp->read_ns;
+
+	if (sp->ncoins)
+	{
+		n = sp->ncoins < UGCI_BATCH_EVENTS ? sp->ncoins : UGCI_BATCH_EVENTS;
+		memcpy(batch->ev, sp->coins, n * sizeof(batch->ev[0]));
+		memmove(sp->coins, sp->coins + n, (sp->ncoins - n) * sizeof(sp->coins[0]));
+		sp->ncoins -= n;
+		batch->count = n;
+	}
+	else
+	{
+		memcpy(batch->ev, sp->latest, sp->nlatest * sizeof(batch->ev[0]));
+		batch->count = sp->nlatest;
+		sp->nlatest = 0;
+	}
+
+	return !sp->ncoins && !sp->nlatest;
+}
+
+int ugci_reader_running(void)
+{
+	return reader_running;
+}
+
+static void *ugci_reader(void *arg)
+{
+	struct pollfd pfd[UGCI_MAX_DEVS + 1];
+	int ids[UGCI_MAX_DEVS + 1];
+	unsigned long long one = 1;
+	unsigned long long ready_ns;
+	int i, p, fds;
+
+	ugci_rt_setup(&reader_cfg);
+
+	pfd[0].fd = stop_fd;
+	pfd[0].events = POLLIN;
+
+	for (i = 0, fds = 1; i < UGCI_MAX_DEVS; i++)
+	{
+		if ((pfd[fds].fd = ugci_dev_fd(i)) < 0)
+			continue;
+
+		pfd[fds].events = UGCI_POLL_READY;
+		ids[fds++] = i;
+	}
+
+	while (1)
+	{
+		int pushed = 0;
+
+		if (!ugci_spin_poll(pfd, fds, NULL) &&
+		    poll(pfd, fds, -1) < 0 && errno != EINTR)
+			break;
+
+		if (pfd[0].revents & POLLIN)
+			break;
+
+		ready_ns = ugci_now_ns();
+
+		for (p = 1; p < fds; p++)
+		{
+			unsigned int head = ring_head;
+			struct ugci_ring_entry *entry;
+
+			if (!(pfd[p].revents & (UGCI_POLL_READY | POLLERR | POLLNVAL)))
+				continue;
+
+			/* ugci_poll() is behind. Keep reading so the kernel's queue
+			 * does not overflow, but into the spill area. Once spilling,
+			 * a device keeps doing so until ugci_poll() catches up. */
+			if (head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) == UGCI_RING_SIZE ||
+			    __atomic_load_n(&spilling[ids[p]], __ATOMIC_ACQUIRE))
+			{
+				UGCI_STAT_INC(ugci_dev_stats(ids[p]), queue_full);
+
+				pthread_mutex_lock(&spill_lock);
+				if ((pfd[p].revents & (POLLERR | POLLNVAL)) ||
+				    ugci_read_dev(ids[p], &reader_batch, ready_ns) < 0)
+				{
+					spill[ids[p]].error = 1;
+					pfd[p].fd = -1;
+				}
+				else
+					ugci_spill_batch(ids[p], &reader_batch);
+				__atomic_store_n(&spilling[ids[p]], 1, __ATOMIC_RELEASE);
+				pthread_mutex_unlock(&spill_lock);
+
+				pushed++;
+				continue;
+			}
+
+			entry = &ring[head & (UGCI_RING_SIZE - 1)];
+			entry->id = ids[p];
+
+			if ((pfd[p].revents & (POLLERR | POLLNVAL)) ||
+			    ugci_read_dev(ids[p], &entry->batch, ready_ns) < 0)
+			{
+				/* Let ugci_poll() disable it, and stop watching */
+				entry->batch.count = -1;
+				pfd[p].fd = -1;
+			}
+
+			__atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+			pushed++;
+		}
+
+		if (pushed && write(wake_fd, &one, sizeof(one)) < 0)
+			break;
+	}
+
+	return NULL;
+}
+
+int ugci_reader_collect(const struct pollfd *extra, int nextra,
+			const struct timespec *timeout)
+{
+	unsigned long long count;
+	unsigned int tail = ring_tail;
+	int reads = 0;
+
+	/* The caller's own fds, which the reader does not read, wake us
+	 * as well */
+	if (tail == __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE))
+	{
+		struct pollfd pfd[1 + UGCI_MAX_DEVS * UGCI_MAX_EVDEV];
+
+		pfd[0].fd = wake_fd;
+		pfd[0].events = POLLIN;
+		memcpy(&pfd[1], extra, nextra * sizeof(*extra));
+
+		if (ppoll(pfd, 1 + nextra, timeout, NULL) < 0 && errno != EINTR)
+			return -1;
+	}
+
+	/* Clear the wakeup before draining, so nothing pushed from here on
+	 * can be missed by the next call */
+	if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return -1;
+
+	while (tail != __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE))
+	{
+		struct ugci_ring_entry *entry = &ring[tail & (UGCI_RING_SIZE - 1)];
+
+		if (ugci_queue_batch(entry->id, &entry->batch) < 0)
+			break;
+
+		if (entry->batch.count > 0)
+			reads += entry->batch.count;
+
+		__atomic_store_n(&ring_tail, ++tail, __ATOMIC_RELEASE);
+	}
+
+	/* Anything spilled is newer than what was in the ring */
+	if (tail == __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE))
+	{
+		int i;
+
+		for (i = 0; i < UGCI_MAX_DEVS; i++)
+		{
+			if (!__atomic_load_n(&spilling[i], __ATOMIC_ACQUIRE))
+				continue;
+
+			pthread_mutex_lock(&spill_lock);
+			while (!ugci_queue_full(i))
+			{
+				int empty = ugci_unspill(i, &unspill_batch);
+
+				ugci_queue_batch(i, &unspill_batch);
+				reads += unspill_batch.count;
+
+				if (empty)
+				{
+					if (spill[i].resync)
+					{
+						spill[i].resync = 0;
+						ugci_request_resync(i);
+					}
+
+					/* The reader stopped watching it, now disable it */
+					if (spill[i].error)
+					{
+						unspill_batch.count = -1;
+						ugci_queue_batch(i, &unspill_batch);
+					}
+
+					__atomic_store_n(&spilling[i], 0, __ATOMIC_RELEASE);
+					break;
+				}
+			}
+			pthread_mutex_unlock(&spill_lock);
+		}
+	}
+
+	return reads;
+}
+
+int ugci_start_reader(const struct ugci_rt_config *cfg)
+{
+	static const struct ugci_rt_config defaults = {
+		.policy		= SCHED_OTHER,
+		.cpu		= -1,
+	};
+	pthread_attr_t attr;
+
+	if (reader_running || ugci_dev_fd(0) < 0)
+		return -1;
+
+	reader_cfg = cfg ? *cfg : defaults;
+	ring_head = ring_tail = 0;
+	memset(spilling, 0, sizeof(spilling));
+	memset(spill, 0, sizeof(spill));
+
+	if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		return -1;
+
+	if ((stop_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+		goto err_close;
+
+	pthread_attr_init(&attr);
+
+	/* Give the thread a stack we can fault in and lock in advance */
+	if (reader_cfg.mlock)
+	{
+		if (posix_memalign(&reader_stack, 4096, UGCI_RT_STACK_SIZE))
+		{
+			reader_stack = NULL;
+			goto err_attr;
+		}
+
+		memset(reader_stack, 0, UGCI_RT_STACK_SIZE);
+
+		if (mlock(reader_stack, UGCI_RT_STACK_SIZE) ||
+		    mlock(ring, sizeof(ring)) || mlock(spill, sizeof(spill)))
+			fprintf(stderr, "UGCI: Could not lock reader memory\n");
+
+		pthread_attr_setstack(&attr, reader_stack, UGCI_RT_STACK_SIZE);
+	}
+
+	if (pthread_create(&reader, &attr, ugci_reader, NULL))
+		goto err_attr;
+
+	pthread_attr_destroy(&attr);
+	reader_running = 1;
+
+	return 0;
+
+err_attr:
+	pthread_attr_destroy(&attr);
+	free(reader_stack);
+	reader_stack = NULL;
+	close(stop_fd);
+	stop_fd = -1;
+err_close:
+	close(wake_fd);
+	wake_fd = -1;
+
+	return -1;
+}
+
+void ugci_stop_reader(void)
+{
+	unsigned long long one = 1;
+	ssize_t wr;
+
+	if (!reader_running)
+		return;
+
+	while ((wr = write(stop_fd, &one, sizeof(one))) < 0 && errno == EINTR)
+		;
+
+	reader_running = 0;
+
+	/* The thread may still be using the fds, the ring and its stack, so
+	 * if it can not be told to stop, leave them all to it */
+	if (wr != sizeof(one))
+	{
+		fprintf(stderr, "UGCI: Could not stop the reader thread\n");
+		stop_fd = wake_fd = -1;
+		reader_stack = NULL;
+		return;
+	}
+
+	pthread_join(reader, NULL);
+
+	close(stop_fd);
+	close(wake_fd);
+	stop_fd = wake_fd = -1;
+
+	if (reader_stack)
+	{
+		munlock(reader_stack, UGCI_RT_STACK_SIZE);
+		munlock(ring, sizeof(ring));
+		munlock(spill, sizeof(spill));
+		free(reader_stack);
+		reader_stack = NULL;
+	}
+}
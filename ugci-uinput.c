@@ -0,0 +1,250 @@
+/* 
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* One virtual device per player, written to straight from event dispatch
+ * so the only cost on the way to evdev is a single write(2) per event. */
+static int bridge_fd[UGCI_MAX_PLAYERS];
+static unsigned short coin_code[UGCI_MAX_PLAYERS];
+static unsigned short play_code[UGCI_MAX_PLAYERS];
+static int bridge_active;
+
+/* The usual MAME keys for players 1 to 4 */
+static const unsigned short kbd_coin[4] = { KEY_5, KEY_6, KEY_7, KEY_8 };
+static const unsigned short kbd_play[4] = { KEY_1, KEY_2, KEY_3, KEY_4 };
+
+static int ugci_bridge_create(int player, int gamepad)
+{
+	struct uinput_setup setup;
+	int fd;
+
+	if ((fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK)) < 0)
+		return -1;
+
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	ioctl(fd, UI_SET_EVBIT, EV_MSC);
+	ioctl(fd, UI_SET_MSCBIT, MSC_TIMESTAMP);
+
+	if (coin_code[player])
+		ioctl(fd, UI_SET_KEYBIT, coin_code[player]);
+	if (play_code[player])
+		ioctl(fd, UI_SET_KEYBIT, play_code[player]);
+
+	/* udev and SDL only take it for a gamepad if it has a face button */
+	if (gamepad)
+		ioctl(fd, UI_SET_KEYBIT, BTN_SOUTH);
+
+	memset(&setup, 0, sizeof(setup));
+	setup.id.bustype = BUS_VIRTUAL;
+	setup.id.vendor = USB_VENDOR_ID_HAPP;
+	setup.id.product = player + 1;
+	snprintf(setup.name, sizeof(setup.name), "UGCI Player %d", player + 1);
+
+	if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Destroy the devices of the first count players */
+static void ugci_bridge_destroy(int count)
+{
+	int p;
+
+	for (p = 0; p < count; p++)
+	{
+		if (bridge_fd[p] < 0)
+			continue;
+
+		ioctl(bridge_fd[p], UI_DEV_DESTROY);
+		close(bridge_fd[p]);
+		bridge_fd[p] = -1;
+	}
+}
+
+int ugci_bridge_start(const struct ugci_bridge_config *cfg)
+{
+	int p, gamepad = cfg ? cfg->gamepad : 0;
+
+	ugci_bridge_stop();
+
+	for (p = 0; p < UGCI_MAX_PLAYERS; p++)
+	{
+		bridge_fd[p] = -1;
+
+		if (ugci_dev_fd(p / 2) < 0)
+			continue;
+
+		if (gamepad)
+		{
+			coin_code[p] = BTN_SELECT;
+			play_code[p] = BTN_START;
+		}
+		else
+		{
+			coin_code[p] = p < 4 ? kbd_coin[p] : 0;
+			play_code[p] = p < 4 ? kbd_play[p] : 0;
+		}
+
+		if (cfg && cfg->coin[p])
+			coin_code[p] = cfg->coin[p];
+		if (cfg && cfg->play[p])
+			play_code[p] = cfg->play[p];
+
+		if (!coin_code[p] && !play_code[p])
+			continue;
+
+		if ((bridge_fd[p] = ugci_bridge_create(p, gamepad)) < 0)
+		{
+			/* Not active yet, so ugci_bridge_stop() would not do this */
+			int err = errno;
+
+			ugci_bridge_destroy(p);
+			errno = err;
+			return -1;
+		}
+	}
+
+	bridge_active = 1;
+	ugci_pipe_changed();
+
+	return 0;
+}
+
+void ugci_bridge_stop(void)
+{
+	if (!bridge_active)
+		return;
+
+	bridge_active = 0;
+	ugci_pipe_changed();
+
+	ugci_bridge_destroy(UGCI_MAX_PLAYERS);
+}
+
+int ugci_bridge_running(void)
+{
+	return bridge_active;
+}
+
+int ugci_bridge_devnode(int player, char *buf, int len)
+{
+	char sysname[64], path[128];
+	struct dirent *de;
+	DIR *dir;
+	int ret = -1;
+
+	if ((unsigned int)player >= UGCI_MAX_PLAYERS || !bridge_active ||
+	    bridge_fd[player] < 0)
+		return -1;
+
+	if (ioctl(bridge_fd[player], UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s", sysname);
+	if (!(dir = opendir(path)))
+		return -1;
+
+	while ((de = readdir(dir)))
+	{
+		if (strncmp(de->d_name, "event", 5))
+			continue;
+
+		snprintf(buf, len, "/dev/input/%s", de->d_name);
+		ret = 0;
+		break;
+	}
+
+	closedir(dir);
+
+	return ret;
+}
+
+/* value is just 1 or 0 here. uinput stamps events with the time they are
+ * injected, so the read time travels along as MSC_TIMESTAMP. */
+static void ugci_bridge_event(int player, enum ugci_event_type type, int value,
+			      unsigned long long ns)
+{
+	struct input_event ev[3];
+	unsigned short code;
+
+	if (!bridge_active || bridge_fd[player] < 0)
+		return;
+
+	code = type == UGCI_EVENT_COIN ? coin_code[player] : play_code[player];
+	if (!code)
+		return;
+
+	memset(ev, 0, sizeof(ev));
+
+	ev[0].type = EV_MSC;
+	ev[0].code = MSC_TIMESTAMP;
+	ev[0].value = (int)(ns / 1000);
+
+	ev[1].type = EV_KEY;
+	ev[1].code = code;
+	ev[1].value = !!value;
+
+	ev[2].type = EV_SYN;
+	ev[2].code = SYN_REPORT;
+
+	if (write(bridge_fd[player], ev, sizeof(ev)) < 0)
+		UGCI_STAT_INC(ugci_dev_stats(player / 2), bridge_errors);
+}
+
+/* Bridge stage, a sink for coin and play events. It comes after the coin
+ * release simulation, so coin events are a press or release with it on,
+ * and counters otherwise. */
+void ugci_bridge_stage(const struct ugci_pipe_event *in, int n, unsigned long long now)
+{
+	const struct ugci_event *ev;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		ev = &in[i].ev;
+
+		if (ev->type == UGCI_EVENT_COIN && !ugci_coin_sim_active())
+		{
+			ugci_bridge_event(ev->id, ev->type, 1, ev->time_ns);
+			ugci_bridge_event(ev->id, ev->type, 0, ev->time_ns);
+		}
+		else if (ev->type == UGCI_EVENT_COIN || ev->type == UGCI_EVENT_PLAY)
+			ugci_bridge_event(ev->id, ev->type, ev->value, ev->time_ns);
+	}
+}
@@ -166,6 +166,61 @@ static const struct ugci_reports reports[UGCI_UREFS_MAX] = {
 		.usage_code	= 0x140030,
 		}
 	},
+	{
+	.type		= UGCI_UREF_J1_AXES,
+	.num_values	= 2,
+	.uref = {
+		.report_type	= HID_REPORT_TYPE_INPUT,
+		.report_id	= UGCI_JOYSTICK_1_REPORT,
+		.field_index	= UGCI_JOYSTICK_FIELD_AXIS,
+		.usage_index	= UGCI_JOYSTICK_USAGE_X,
+		.usage_code	= UGCI_JOYSTICK_UCODE_X,
+		}
+	},
+	{
+	.type		= UGCI_UREF_J1_BUTTONS,
+	.num_values	= 7,
+	.uref = {
+		.report_type	= HID_REPORT_TYPE_INPUT,
+		.report_id	= UGCI_JOYSTICK_1_REPORT,
+		.field_index	= UGCI_JOYSTICK_FIELD_BUT,
+		.usage_index	= UGCI_JOYSTICK_USAGE_BUT_1,
+		.usage_code	= UGCI_JOYSTICK_UCODE_BUT_1,
+		}
+	},
+	{
+	.type		= UGCI_UREF_J2_AXES,
+	.num_values	= 2,
+	.uref = {
+		.report_type	= HID_REPORT_TYPE_INPUT,
+		.report_id	= UGCI_JOYSTICK_2_REPORT,
+		.field_index	= UGCI_JOYSTICK_FIELD_AXIS,
+		.usage_index	= UGCI_JOYSTICK_USAGE_X,
+		.usage_code	= UGCI_JOYSTICK_UCODE_X,
+		}
+	},
+	{
+	.type		= UGCI_UREF_J2_BUTTONS,
+	.num_values	= 7,
+	.uref = {
+		.report_type	= HID_REPORT_TYPE_INPUT,
+		.report_id	= UGCI_JOYSTICK_2_REPORT,
+		.field_index	= UGCI_JOYSTICK_FIELD_BUT,
+		.usage_index	= UGCI_JOYSTICK_USAGE_BUT_1,
+		.usage_code	= UGCI_JOYSTICK_UCODE_BUT_1,
+		}
+	},
+	{
+	.type		= UGCI_UREF_EEPROM_WRITE,
+	.num_values	= 504,
+	.uref = {
+		.report_type	= HID_REPORT_TYPE_FEATURE,
+		.report_id	= 82,
+		.field_index	= 0,
+		.usage_index	= 0,
+		.usage_code	= 0x140030,
+		}
+	},
 };
 
 void ugci_fill_uref(enum ugci_report_type type, struct hiddev_usage_ref_multi *uref_multi)
@@ -198,7 +253,7 @@ int ugci_commit_uref(struct ugci_dev_info *dev, enum ugci_report_type type)
 	rinfo.report_id = report->uref.report_id;
 	rinfo.num_fields = 0;
 
-	if (ioctl(dev->fd, HIDIOCSREPORT, &rinfo) < 0)
+	if (ugci_dev_ioctl(dev, HIDIOCSREPORT, &rinfo) < 0)
 		return -1;
 
 	return 0;
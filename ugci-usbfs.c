@@ -0,0 +1,791 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* Direct access to a board through usbfs, with usbhid detached. The
+ * board's report descriptor is parsed here, and the hiddev requests the
+ * rest of libugci makes are answered from it, so the two transports only
+ * differ below ugci_dev_ioctl() and ugci_read_dev(). Interrupt reports
+ * come in through several transfers kept queued at once, and are turned
+ * into the usage events hiddev would have read. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+#include <linux/usbdevice_fs.h>
+#include <linux/usb/ch9.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+#define UGCI_USBFS_REPORTS	32	/* Reports in one descriptor */
+#define UGCI_USBFS_FIELDS	16	/* Fields in one report */
+#define UGCI_USBFS_USAGES	8	/* Usages kept per field, the rest repeat the last */
+#define UGCI_USBFS_IFACES	4	/* HID interfaces looked at per board */
+#define UGCI_USBFS_PACKET	64	/* Largest interrupt report */
+#define UGCI_USBFS_TIMEOUT	1000	/* Control transfers, in ms */
+
+/* HID class requests and descriptors */
+#define HID_REQ_GET_REPORT	0x01
+#define HID_REQ_SET_IDLE	0x0a
+#define HID_REQ_SET_REPORT	0x09
+#define HID_DT_HID		0x21
+#define HID_DT_REPORT		0x22
+
+struct ugci_usbfs_field {
+	unsigned int offset;		/* In bits, after the report ID */
+	unsigned int size;
+	unsigned int count;
+	int logical_min;
+	int usages;
+	unsigned int usage[UGCI_USBFS_USAGES];
+	int *value;
+};
+
+struct ugci_usbfs_report {
+	int type;			/* HID_REPORT_TYPE_* */
+	int id;
+	unsigned int bits;
+	int nfields;
+	struct ugci_usbfs_field field[UGCI_USBFS_FIELDS];
+};
+
+struct ugci_usbfs {
+	int fd;
+	int ifno;
+	int ep;
+	int packet;
+	char name[128];
+
+	int numbered;			/* Reports start with their ID */
+	int nreports;
+	struct ugci_usbfs_report report[UGCI_USBFS_REPORTS];
+	int max_events;			/* Most usage events one input report makes */
+
+	/* The reader thread reaps while ugci_poll() may fetch usages */
+	pthread_mutex_t lock;
+
+	struct usbdevfs_urb urb[UGCI_USBFS_URBS];
+	unsigned char buf[UGCI_USBFS_URBS][UGCI_USBFS_PACKET];
+};
+
+/* A HID interface of the board, from its configuration descriptor */
+struct ugci_usbfs_iface {
+	int ifno;
+	int rdesc_len;
+	int ep;
+	int packet;
+};
+
+/* Global items, which push and pop save and restore */
+struct ugci_hid_globals {
+	unsigned int page;
+	int logical_min;
+	unsigned int size;
+	unsigned int count;
+	int id;
+};
+
+static int ugci_usbfs_control(struct ugci_usbfs *usb, int type, int request,
+			      int value, int index, void *data, int len)
+{
+	struct usbdevfs_ctrltransfer ctrl = {
+		.bRequestType	= type,
+		.bRequest	= request,
+		.wValue		= value,
+		.wIndex		= index,
+		.wLength	= len,
+		.timeout	= UGCI_USBFS_TIMEOUT,
+		.data		= data,
+	};
+
+	return ioctl(usb->fd, USBDEVFS_CONTROL, &ctrl);
+}
+
+static struct ugci_usbfs_report *ugci_usbfs_report(struct ugci_usbfs *usb, int type,
+						   int id, int create)
+{
+	struct ugci_usbfs_report *rep;
+	int r;
+
+	for (r = 0; r < usb->nreports; r++)
+		if (usb->report[r].type == type && usb->report[r].id == id)
+			return &usb->report[r];
+
+	if (!create || usb->nreports == UGCI_USBFS_REPORTS)
+		return NULL;
+
+	rep = &usb->report[usb->nreports++];
+	rep->type = type;
+	rep->id = id;
+
+	return rep;
+}
+
+static inline int ugci_usbfs_bytes(struct ugci_usbfs *usb,
+				   const struct ugci_usbfs_report *rep)
+{
+	return usb->numbered + (rep->bits + 7) / 8;
+}
+
+/* Fields are laid out as the kernel does it, so field and usage indexes
+ * match what hiddev gives out. Constant fields without usages are only
+ * padding, and get no index. */
+static int ugci_usbfs_add_field(struct ugci_usbfs *usb, const struct ugci_hid_globals *g,
+				int type, const unsigned int *usage, int usages)
+{
+	struct ugci_usbfs_report *rep;
+	struct ugci_usbfs_field *f;
+
+	if (!(rep = ugci_usbfs_report(usb, type, g->id, 1)))
+		return -1;
+
+	rep->bits += g->size * g->count;
+
+	if (!usages || !g->count)
+		return 0;
+
+	if (rep->nfields == UGCI_USBFS_FIELDS || g->size > 32)
+		return -1;
+
+	f = &rep->field[rep->nfields];
+	f->offset = rep->bits - g->size * g->count;
+	f->size = g->size;
+	f->count = g->count;
+	f->logical_min = g->logical_min;
+	f->usages = usages;
+	memcpy(f->usage, usage, usages * sizeof(usage[0]));
+
+	if (!(f->value = calloc(f->count, sizeof(int))))
+		return -1;
+
+	rep->nfields++;
+
+	return 0;
+}
+
+/* Parse a report descriptor into the board's reports. Returns less than
+ * zero unless it has the player application. */
+static int ugci_usbfs_parse(struct ugci_usbfs *usb, const unsigned char *d, int len)
+{
+	struct ugci_hid_globals g, stack[4];
+	unsigned int usage[UGCI_USBFS_USAGES], usage_min = 0, u;
+	int i = 0, k, size, s, usages = 0, depth = 0, player = 0;
+
+	memset(&g, 0, sizeof(g));
+
+	while (i < len)
+	{
+		unsigned char b = d[i++];
+
+		/* Long items are reserved, skip them */
+		if (b == 0xfe)
+		{
+			if (i + 1 >= len)
+				return -1;
+			i += 2 + d[i];
+			continue;
+		}
+
+		size = (b & 3) == 3 ? 4 : b & 3;
+		if (i + size > len)
+			return -1;
+
+		for (k = u = 0; k < size; k++)
+			u |= (unsigned int)d[i + k] << (8 * k);
+		s = size == 1 ? (signed char)u : size == 2 ? (short)u : (int)u;
+		i += size;
+
+		switch (b & 0xfc)
+		{
+		case 0x04:	/* Usage Page */
+			g.page = u;
+			break;
+		case 0x14:	/* Logical Minimum */
+			g.logical_min = s;
+			break;
+		case 0x74:	/* Report Size */
+			g.size = u;
+			break;
+		case 0x84:	/* Report ID */
+			g.id = u;
+			usb->numbered = 1;
+			break;
+		case 0x94:	/* Report Count */
+			g.count = u;
+			break;
+		case 0xa4:	/* Push */
+			if (depth == 4)
+				return -1;
+			stack[depth++] = g;
+			break;
+		case 0xb4:	/* Pop */
+			if (!depth)
+				return -1;
+			g = stack[--depth];
+			break;
+
+		case 0x08:	/* Usage */
+			if (usages < UGCI_USBFS_USAGES)
+				usage[usages++] = size == 4 ? u : (g.page << 16) | u;
+			break;
+		case 0x18:	/* Usage Minimum */
+			usage_min = size == 4 ? u : (g.page << 16) | u;
+			break;
+		case 0x28:	/* Usage Maximum */
+			for (u = size == 4 ? u : (g.page << 16) | u;
+			     usage_min <= u && usages < UGCI_USBFS_USAGES; usage_min++)
+				usage[usages++] = usage_min;
+			break;
+
+		case 0xa0:	/* Collection */
+			if (u == 1 && usages && usage[0] == UGCI_PLAYER_APP)
+				player = 1;
+			usages = 0;
+			break;
+		case 0x80:	/* Input */
+		case 0x90:	/* Output */
+		case 0xb0:	/* Feature */
+			if (ugci_usbfs_add_field(usb, &g, (b & 0xfc) == 0x80 ? HID_REPORT_TYPE_INPUT :
+						 (b & 0xfc) == 0x90 ? HID_REPORT_TYPE_OUTPUT :
+						 HID_REPORT_TYPE_FEATURE, usage, usages))
+				return -1;
+			usages = 0;
+			break;
+		case 0xc0:	/* End Collection */
+			usages = 0;
+			break;
+		}
+	}
+
+	return player ? 0 : -1;
+}
+
+static unsigned int ugci_usbfs_extract(const unsigned char *data, unsigned int offset,
+				       unsigned int size)
+{
+	unsigned int b, v = 0;
+
+	for (b = 0; b < size; b++)
+		if (data[(offset + b) / 8] & (1 << ((offset + b) % 8)))
+			v |= 1U << b;
+
+	return v;
+}
+
+static void ugci_usbfs_implant(unsigned char *data, unsigned int offset,
+			       unsigned int size, unsigned int v)
+{
+	unsigned int b;
+
+	for (b = 0; b < size; b++)
+		if (v & (1U << b))
+			data[(offset + b) / 8] |= 1 << ((offset + b) % 8);
+}
+
+/* Take in a report as it came from the board. With ev, a usage event is
+ * made for each value that changed, and the report ends with the event
+ * hiddev marks the end of a report with. Returns the number of events
+ * made, or less than zero if the report is not one we know. */
+static int ugci_usbfs_input(struct ugci_usbfs *usb, int type, const unsigned char *data,
+			    int len, struct hiddev_usage_ref *ev)
+{
+	struct ugci_usbfs_report *rep;
+	unsigned int j, v;
+	int f, n = 0;
+
+	if (len < 1 || !(rep = ugci_usbfs_report(usb, type, usb->numbered ? data[0] : 0, 0)) ||
+	    len < ugci_usbfs_bytes(usb, rep))
+		return -1;
+
+	data += usb->numbered;
+
+	for (f = 0; f < rep->nfields; f++)
+	{
+		struct ugci_usbfs_field *fld = &rep->field[f];
+
+		for (j = 0; j < fld->count; j++)
+		{
+			v = ugci_usbfs_extract(data, fld->offset + j * fld->size, fld->size);
+
+			/* Sign extend */
+			if (fld->logical_min < 0 && fld->size && fld->size < 32 &&
+			    (v & (1U << (fld->size - 1))))
+				v |= ~0U << fld->size;
+
+			if ((int)v == fld->value[j])
+				continue;
+
+			fld->value[j] = v;
+
+			if (!ev)
+				continue;
+
+			memset(&ev[n], 0, sizeof(ev[n]));
+			ev[n].report_type = type;
+			ev[n].report_id = rep->id;
+			ev[n].field_index = f;
+			ev[n].usage_index = j;
+			ev[n].usage_code = fld->usage[j < fld->usages ? j : fld->usages - 1];
+			ev[n].value = (int)v;
+			n++;
+		}
+	}
+
+	if (ev)
+	{
+		memset(&ev[n], 0, sizeof(ev[n]));
+		ev[n].report_type = type;
+		ev[n].report_id = rep->id;
+		ev[n].field_index = HID_FIELD_INDEX_NONE;
+		n++;
+	}
+
+	return n;
+}
+
+static int ugci_usbfs_usages(struct ugci_usbfs *usb, struct hiddev_usage_ref_multi *m,
+			     int set)
+{
+	struct ugci_usbfs_report *rep;
+	struct ugci_usbfs_field *fld;
+	unsigned int i;
+
+	rep = ugci_usbfs_report(usb, m->uref.report_type, m->uref.report_id, 0);
+
+	if (!rep || m->uref.field_index >= (unsigned int)rep->nfields ||
+	    m->num_values > HID_MAX_MULTI_USAGES)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	fld = &rep->field[m->uref.field_index];
+
+	if (m->uref.usage_index + m->num_values > fld->count)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&usb->lock);
+	for (i = 0; i < m->num_values; i++)
+	{
+		if (set)
+			fld->value[m->uref.usage_index + i] = m->values[i];
+		else
+			m->values[i] = fld->value[m->uref.usage_index + i];
+	}
+	pthread_mutex_unlock(&usb->lock);
+
+	return 0;
+}
+
+static int ugci_usbfs_get_report(struct ugci_usbfs *usb, struct hiddev_report_info *rinfo)
+{
+	struct ugci_usbfs_report *rep;
+	unsigned char *data;
+	int len, ret = -1;
+
+	if (!(rep = ugci_usbfs_report(usb, rinfo->report_type, rinfo->report_id, 0)))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!(data = calloc(1, ugci_usbfs_bytes(usb, rep))))
+		return -1;
+
+	len = ugci_usbfs_control(usb, USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+				 HID_REQ_GET_REPORT, (rep->type << 8) | rep->id,
+				 usb->ifno, data, ugci_usbfs_bytes(usb, rep));
+
+	/* Boards leave the ID out of unnumbered reports only */
+	if (len > 0)
+	{
+		pthread_mutex_lock(&usb->lock);
+		if (ugci_usbfs_input(usb, rep->type, data, len, NULL) < 0)
+			errno = EIO;
+		else
+			ret = 0;
+		pthread_mutex_unlock(&usb->lock);
+	}
+
+	free(data);
+
+	return ret;
+}
+
+static int ugci_usbfs_set_report(struct ugci_usbfs *usb, struct hiddev_report_info *rinfo)
+{
+	struct ugci_usbfs_report *rep;
+	unsigned char *data;
+	unsigned int j;
+	int f, len, ret;
+
+	if (!(rep = ugci_usbfs_report(usb, rinfo->report_type, rinfo->report_id, 0)))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = ugci_usbfs_bytes(usb, rep);
+	if (!(data = calloc(1, len)))
+		return -1;
+
+	data[0] = rep->id;
+
+	pthread_mutex_lock(&usb->lock);
+	for (f = 0; f < rep->nfields; f++)
+	{
+		struct ugci_usbfs_field *fld = &rep->field[f];
+
+		for (j = 0; j < fld->count; j++)
+			ugci_usbfs_implant(data + usb->numbered, fld->offset + j * fld->size,
+					   fld->size, fld->value[j]);
+	}
+	pthread_mutex_unlock(&usb->lock);
+
+	ret = ugci_usbfs_control(usb, USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+				 HID_REQ_SET_REPORT, (rep->type << 8) | rep->id,
+				 usb->ifno, data, len);
+	free(data);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/* Answer a hiddev request from what we know of the board */
+int ugci_usbfs_ioctl(struct ugci_usbfs *usb, unsigned long req, void *arg)
+{
+	switch (req)
+	{
+	case HIDIOCGUSAGES:
+		return ugci_usbfs_usages(usb, arg, 0);
+	case HIDIOCSUSAGES:
+		return ugci_usbfs_usages(usb, arg, 1);
+	case HIDIOCGREPORT:
+		return ugci_usbfs_get_report(usb, arg);
+	case HIDIOCSREPORT:
+		return ugci_usbfs_set_report(usb, arg);
+	}
+
+	/* HIDIOCGNAME(len) */
+	if (_IOC_TYPE(req) == 'H' && _IOC_NR(req) == 0x06 && _IOC_DIR(req) == _IOC_READ)
+	{
+		int len = strlen(usb->name) + 1;
+
+		if (len > (int)_IOC_SIZE(req))
+			len = _IOC_SIZE(req);
+		memcpy(arg, usb->name, len);
+		return len;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+/* Reap the interrupt transfers that completed, and put them right back in
+ * the queue; the others cover for it meanwhile. Stops early rather than
+ * overflow ev. Returns the number of usage events made, or less than zero
+ * once the board is gone. */
+int ugci_usbfs_read(struct ugci_usbfs *usb, struct hiddev_usage_ref *ev, int max)
+{
+	struct usbdevfs_urb *urb;
+	int n, count = 0;
+
+	pthread_mutex_lock(&usb->lock);
+
+	while (count + usb->max_events <= max)
+	{
+		if (ioctl(usb->fd, USBDEVFS_REAPURBNDELAY, &urb) < 0)
+		{
+			if (errno != EAGAIN)
+				count = -1;
+			break;
+		}
+
+		if (urb->status == 0 &&
+		    (n = ugci_usbfs_input(usb, HID_REPORT_TYPE_INPUT, urb->buffer,
+					  urb->actual_length, ev + count)) > 0)
+			count += n;
+		else if (urb->status == -ENODEV || urb->status == -ESHUTDOWN)
+		{
+			count = -1;
+			break;
+		}
+
+		urb->status = 0;
+		urb->actual_length = 0;
+
+		if (ioctl(usb->fd, USBDEVFS_SUBMITURB, urb) < 0)
+		{
+			count = -1;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&usb->lock);
+
+	return count;
+}
+
+int ugci_usbfs_fd(struct ugci_usbfs *usb)
+{
+	return usb->fd;
+}
+
+static void ugci_usbfs_free(struct ugci_usbfs *usb)
+{
+	int r, f;
+
+	for (r = 0; r < usb->nreports; r++)
+		for (f = 0; f < usb->report[r].nfields; f++)
+			free(usb->report[r].field[f].value);
+
+	pthread_mutex_destroy(&usb->lock);
+	free(usb);
+}
+
+/* Give the interface back, and let usbhid have it again */
+static void ugci_usbfs_release(int fd, int ifno)
+{
+	struct usbdevfs_ioctl cmd = {
+		.ifno		= ifno,
+		.ioctl_code	= USBDEVFS_CONNECT,
+	};
+
+	ioctl(fd, USBDEVFS_RELEASEINTERFACE, &ifno);
+	ioctl(fd, USBDEVFS_IOCTL, &cmd);
+}
+
+void ugci_usbfs_close(struct ugci_usbfs *usb)
+{
+	/* Releasing the interface kills the transfers still queued */
+	ugci_usbfs_release(usb->fd, usb->ifno);
+	close(usb->fd);
+	ugci_usbfs_free(usb);
+}
+
+/* The product string, in plain ASCII */
+static void ugci_usbfs_name(struct ugci_usbfs *usb, int index)
+{
+	unsigned char s[255];
+	int i, k, len;
+
+	strcpy(usb->name, "Happ Controls UGCI");
+
+	if (!index || (len = ugci_usbfs_control(usb, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR,
+						(USB_DT_STRING << 8) | index, 0x0409,
+						s, sizeof(s))) < 4)
+		return;
+
+	for (i = 2, k = 0; i + 1 < len && k + 1 < (int)sizeof(usb->name); i += 2)
+		usb->name[k++] = s[i + 1] ? '?' : s[i];
+	usb->name[k] = '\0';
+}
+
+/* Take a HID interface over from usbhid, and keep it if it is the one
+ * with the player application */
+static struct ugci_usbfs *ugci_usbfs_attach(int fd, const struct ugci_usbfs_iface *ifc,
+					    int product)
+{
+	struct usbdevfs_disconnect_claim dc;
+	struct ugci_usbfs *usb;
+	unsigned char *rdesc;
+	int r, u, len;
+
+	if (!(usb = calloc(1, sizeof(*usb))))
+		return NULL;
+
+	usb->fd = fd;
+	usb->ifno = ifc->ifno;
+	usb->ep = ifc->ep;
+	usb->packet = ifc->packet < UGCI_USBFS_PACKET ? ifc->packet : UGCI_USBFS_PACKET;
+	pthread_mutex_init(&usb->lock, NULL);
+
+	memset(&dc, 0, sizeof(dc));
+	dc.interface = ifc->ifno;
+
+	if (ioctl(fd, USBDEVFS_DISCONNECT_CLAIM, &dc) < 0)
+	{
+		ugci_usbfs_free(usb);
+		return NULL;
+	}
+
+	if (!(rdesc = malloc(ifc->rdesc_len)) ||
+	    (len = ugci_usbfs_control(usb, USB_DIR_IN | USB_RECIP_INTERFACE,
+				      USB_REQ_GET_DESCRIPTOR, HID_DT_REPORT << 8,
+				      ifc->ifno, rdesc, ifc->rdesc_len)) <= 0 ||
+	    ugci_usbfs_parse(usb, rdesc, len))
+		goto fail;
+
+	free(rdesc);
+	rdesc = NULL;
+
+	for (r = 0; r < usb->nreports; r++)
+	{
+		struct ugci_usbfs_report *rep = &usb->report[r];
+		int events = 1;
+
+		if (rep->type != HID_REPORT_TYPE_INPUT)
+			continue;
+
+		if (ugci_usbfs_bytes(usb, rep) > usb->packet)
+			goto fail;
+
+		for (u = 0; u < rep->nfields; u++)
+			events += rep->field[u].count;
+
+		if (events > usb->max_events)
+			usb->max_events = events;
+	}
+
+	if (!usb->max_events || usb->max_events > UGCI_BATCH_EVENTS)
+		goto fail;
+
+	/* Only report changes, as usbhid asks for too */
+	ugci_usbfs_control(usb, USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+			   HID_REQ_SET_IDLE, 0, ifc->ifno, NULL, 0);
+
+	ugci_usbfs_name(usb, product);
+
+	for (u = 0; u < UGCI_USBFS_URBS; u++)
+	{
+		struct usbdevfs_urb *urb = &usb->urb[u];
+
+		urb->type = USBDEVFS_URB_TYPE_INTERRUPT;
+		urb->endpoint = usb->ep;
+		urb->buffer = usb->buf[u];
+		urb->buffer_length = usb->packet;
+
+		if (ioctl(fd, USBDEVFS_SUBMITURB, urb) < 0)
+			goto fail;
+	}
+
+	return usb;
+
+fail:
+	free(rdesc);
+	ugci_usbfs_release(fd, ifc->ifno);
+	ugci_usbfs_free(usb);
+	return NULL;
+}
+
+/* Find the HID interfaces in the first configuration, with their report
+ * descriptor size and interrupt IN endpoint */
+static int ugci_usbfs_ifaces(const unsigned char *d, int len,
+			     struct ugci_usbfs_iface *ifc, int max)
+{
+	int i, n = 0, hid = 0, configs = 0;
+
+	for (i = USB_DT_DEVICE_SIZE; i + 2 <= len && d[i] >= 2; i += d[i])
+	{
+		if (i + d[i] > len)
+			break;
+
+		switch (d[i + 1])
+		{
+		case USB_DT_CONFIG:
+			if (configs++)
+				return n;
+			break;
+
+		case USB_DT_INTERFACE:
+			hid = d[i] >= 9 && d[i + 5] == USB_CLASS_HID && n < max;
+			if (hid)
+			{
+				memset(&ifc[n], 0, sizeof(ifc[n]));
+				ifc[n++].ifno = d[i + 2];
+			}
+			break;
+
+		case HID_DT_HID:
+			if (hid && d[i] >= 9 && d[i + 6] == HID_DT_REPORT)
+				ifc[n - 1].rdesc_len = d[i + 7] | (d[i + 8] << 8);
+			break;
+
+		case USB_DT_ENDPOINT:
+			if (hid && d[i] >= 7 && !ifc[n - 1].ep && (d[i + 2] & USB_DIR_IN) &&
+			    (d[i + 3] & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_INT)
+			{
+				ifc[n - 1].ep = d[i + 2];
+				ifc[n - 1].packet = (d[i + 4] | (d[i + 5] << 8)) & 0x7ff;
+			}
+			break;
+		}
+	}
+
+	return n;
+}
+
+/* Open the index'th Happ device under /dev/bus/usb, and take its player
+ * interface over. Returns NULL if there is no such device, or if it is
+ * not a UGCI board or can not be taken over. */
+struct ugci_usbfs *ugci_usbfs_open(int index, char *path, int len)
+{
+	struct ugci_usbfs_iface ifc[UGCI_USBFS_IFACES];
+	struct ugci_usbfs *usb = NULL;
+	unsigned char desc[4096];
+	glob_t g;
+	size_t p;
+	int fd, rd, n, i;
+
+	if (glob("/dev/bus/usb/*/*", 0, NULL, &g))
+		return NULL;
+
+	for (p = 0; p < g.gl_pathc; p++)
+	{
+		if ((fd = open(g.gl_pathv[p], O_RDWR)) < 0)
+			continue;
+
+		/* The device descriptor, then the configurations */
+		rd = read(fd, desc, sizeof(desc));
+
+		if (rd < USB_DT_DEVICE_SIZE || (desc[8] | (desc[9] << 8)) != USB_VENDOR_ID_HAPP ||
+		    index--)
+		{
+			close(fd);
+			continue;
+		}
+
+		n = ugci_usbfs_ifaces(desc, rd, ifc, UGCI_USBFS_IFACES);
+
+		for (i = 0; i < n && !usb; i++)
+			if (ifc[i].rdesc_len && ifc[i].ep)
+				usb = ugci_usbfs_attach(fd, &ifc[i], desc[15]);
+
+		if (usb)
+			snprintf(path, len, "%s", g.gl_pathv[p]);
+		else
+			close(fd);
+		break;
+	}
+
+	globfree(&g);
+
+	return usb;
+}
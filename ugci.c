@@ -17,6 +17,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -35,7 +36,7 @@
 #include "ugci.h"
 #include "ugci-private.h"
 
-const char *ugci_event_to_name[] = {"unknown", "coin", "play"};
+const char *ugci_event_to_name[] = {"unknown", "coin", "play", "wd", "stick", "evdev", "combo"};
 
 static struct ugci_dev_info devs[UGCI_MAX_DEVS];
 
@@ -54,8 +55,31 @@ static int initialized;
 static int info_out;
 static int ugci_event_mask;
 static int sim_coin_wait;
+static unsigned long long jit_margin_ns;
+static int report_mode;
+static int changes_only;
+static int secblk_cache = 1;
+static int use_usbfs;
+static unsigned long long last_input_ns;
+static int ndevs;
+
+/* Stall detection, see ugci_set_stall_detect() */
+static ugci_stall_callback_t stall_cb;
+static unsigned long long stall_poll_gap_ns;
+static unsigned long long stall_callback_ns;
+static unsigned long long stall_event_age_ns;
+static unsigned long long last_poll_ns;
 
 static ugci_callback_t ugci_cb;
+static ugci_event_callback_t ugci_event_cb;
+
+/* Read time of the batch being dispatched, 0 outside of dispatch */
+static unsigned long long event_ns;
+
+/* Batches read in one ugci_poll(), per device, in read order */
+static struct ugci_batch batches[UGCI_MAX_DEVS][UGCI_BATCHES];
+static int nbatches[UGCI_MAX_DEVS];
+static struct ugci_evdev_batch evbatches[UGCI_MAX_DEVS][UGCI_MAX_EVDEV];
 
 static struct ugci_dev_info *get_dev_info(int id)
 {
@@ -68,6 +92,155 @@ static struct ugci_dev_info *get_dev_info(int id)
 	return &devs[id];
 }
 
+/* The HID report type an ioctl works on, from 0 for input reports to 2
+ * for feature reports, or -1 if it is not a report ioctl */
+static int ugci_ioctl_report(unsigned long req, void *arg)
+{
+	int type;
+
+	switch (req)
+	{
+	case HIDIOCGUSAGES:
+	case HIDIOCSUSAGES:
+		type = ((struct hiddev_usage_ref_multi *)arg)->uref.report_type;
+		break;
+	case HIDIOCGREPORT:
+	case HIDIOCSREPORT:
+		type = ((struct hiddev_report_info *)arg)->report_type;
+		break;
+	default:
+		return -1;
+	}
+
+	if (type < HID_REPORT_TYPE_INPUT || type > HID_REPORT_TYPE_FEATURE)
+		return -1;
+
+	return type - HID_REPORT_TYPE_INPUT;
+}
+
+int ugci_dev_ioctl(struct ugci_dev_info *dev, unsigned long req, void *arg)
+{
+	int report = ugci_ioctl_report(req, arg);
+	unsigned long long start = 0;
+	int ret;
+
+	if (report >= 0 && ugci_exporter_running())
+		start = ugci_now_ns();
+
+	if (dev->usb)
+		ret = ugci_usbfs_ioctl(dev->usb, req, arg);
+	else
+		ret = ioctl(dev->fd, req, arg);
+
+	if (report >= 0)
+	{
+		UGCI_STAT_INC(&dev->stats, ioctls[report]);
+		if (start)
+			UGCI_STAT_ADD(&dev->stats, ioctl_ns[report], ugci_now_ns() - start);
+	}
+
+	return ret;
+}
+
+/* Fetch the current coin/play values and stick positions so snapshots
+ * are valid before the first event arrives. */
+static void ugci_seed_state(struct ugci_dev_info *dev)
+{
+	static const enum ugci_report_type types[4] = {
+		UGCI_UREF_P1_COIN, UGCI_UREF_P1_PLAY,
+		UGCI_UREF_P2_COIN, UGCI_UREF_P2_PLAY,
+	};
+	struct hiddev_usage_ref_multi uref_multi;
+	int t;
+
+	for (t = 0; t < 4; t++)
+	{
+		ugci_fill_uref(types[t], &uref_multi);
+
+		if (ugci_dev_ioctl(dev, HIDIOCGUSAGES, &uref_multi) < 0)
+			continue;
+
+		if (t & 1)
+			dev->play[t / 2] = dev->raw_play[t / 2] = uref_multi.values[0];
+		else
+			dev->coin_count[t / 2] = uref_multi.values[0];
+	}
+
+	for (t = 0; t < 2; t++)
+	{
+		ugci_fill_uref(t ? UGCI_UREF_J2_AXES : UGCI_UREF_J1_AXES, &uref_multi);
+
+		if (ugci_dev_ioctl(dev, HIDIOCGUSAGES, &uref_multi) < 0)
+			continue;
+
+		dev->stick_x[t] = uref_multi.values[0];
+		dev->stick_y[t] = uref_multi.values[1];
+	}
+}
+
+/* Only the reports polling needs are fetched up front; HIDIOCINITREPORT
+ * would also fetch every feature report, the large eeprom one included.
+ * Boards without joysticks simply fail the joystick reports. */
+static void ugci_init_reports(struct ugci_dev_info *dev)
+{
+	static const int report_ids[4] = {
+		UGCI_PLAYER_1_REPORT, UGCI_PLAYER_2_REPORT,
+		UGCI_JOYSTICK_1_REPORT, UGCI_JOYSTICK_2_REPORT,
+	};
+	struct hiddev_report_info rinfo;
+	int t;
+
+	rinfo.report_type = HID_REPORT_TYPE_INPUT;
+	rinfo.num_fields = 0;
+
+	for (t = 0; t < 4; t++)
+	{
+		rinfo.report_id = report_ids[t];
+		ugci_dev_ioctl(dev, HIDIOCGREPORT, &rinfo);
+	}
+}
+
+/* (Re)read the eeprom from the device into the cached image */
+static int ugci_read_eeprom(struct ugci_dev_info *dev)
+{
+	struct hiddev_usage_ref_multi uref_multi;
+	struct hiddev_report_info rinfo;
+	int t;
+
+	rinfo.report_type = HID_REPORT_TYPE_FEATURE;
+	rinfo.report_id = 82;
+	rinfo.num_fields = 0;
+
+	ugci_fill_uref(UGCI_UREF_EEPROM_READ, &uref_multi);
+
+	if (ugci_dev_ioctl(dev, HIDIOCGREPORT, &rinfo) < 0 ||
+	    ugci_dev_ioctl(dev, HIDIOCGUSAGES, &uref_multi) < 0)
+	{
+		/* We no longer know what the device holds */
+		dev->eeprom_valid = 0;
+		ugci_keymap_compile(dev->id, NULL);
+		return -1;
+	}
+
+	for (t = 0; t < uref_multi.num_values; t++)
+		dev->eeprom[t] = (unsigned char)uref_multi.values[t];
+
+	dev->eeprom_valid = 1;
+	dev->eeprom_len = (dev->eeprom[0] & 0x02) ? 504 : 120;
+	ugci_keymap_compile(dev->id, dev->eeprom);
+
+	return 0;
+}
+
+/* The eeprom is only fetched the first time something needs it */
+static int ugci_load_eeprom(struct ugci_dev_info *dev)
+{
+	if (dev->eeprom_valid)
+		return 0;
+
+	return ugci_read_eeprom(dev);
+}
+
 /* Checks a device for UGCI signatures */
 static int is_happ_ugci(int fd)
 {
@@ -111,6 +284,11 @@ static int is_happ_ugci(int fd)
 	return 1;
 }
 
+void ugci_set_usbfs(int enable)
+{
+	use_usbfs = enable;
+}
+
 int ugci_init(ugci_callback_t cb, unsigned int mask, int info)
 {
 	int i, id;
@@ -132,59 +310,81 @@ int ugci_init(ugci_callback_t cb, unsigned int mask, int info)
 	}
 
 	for (id = 0; id < UGCI_MAX_DEVS; id++)
+	{
 		devs[id].fd = -1;
+		ugci_keymap_compile(id, NULL);
+	}
 
 	for (i = id = 0; i < 8 && id < UGCI_MAX_DEVS && hiddev_ok; i++)
 	{
-		struct hiddev_usage_ref_multi uref_multi;
+		struct ugci_usbfs *usb = NULL;
+		unsigned long long start_ns;
 		int t, fd = -1;
 		char devname[32];
 		char name[256];
 
-		for (t = 0; dev_path_fmts[t]; t++)
+		/* The board is found and checked as it is taken over */
+		if (use_usbfs)
 		{
-			sprintf(devname, dev_path_fmts[t], i);
-			printf("%s\n", devname);
-			if ((fd = open(devname, O_RDONLY)) >= 0)
-				break;
+			if (!(usb = ugci_usbfs_open(i, devname, sizeof(devname))))
+				continue;
+			fd = ugci_usbfs_fd(usb);
 		}
+		else
+		{
+			for (t = 0; dev_path_fmts[t]; t++)
+			{
+				sprintf(devname, dev_path_fmts[t], i);
+				printf("%s\n", devname);
+				if ((fd = open(devname, O_RDONLY)) >= 0)
+					break;
+			}
 
-		if (fd < 0)
-			continue;
+			if (fd < 0)
+				continue;
 
-		if (!is_happ_ugci(fd))
-		{
-			close(fd);
-			continue;
+			if (!is_happ_ugci(fd))
+			{
+				close(fd);
+				continue;
+			}
 		}
 
 		/* Ok, so we know we have a legit coin/start device. Let's
 		 * save it for later use. */
 		memset(&devs[id], 0, sizeof(devs[id]));
 		devs[id].fd = fd;
+		devs[id].usb = usb;
 		devs[id].id = id;
 
-		ioctl(fd, HIDIOCGNAME(sizeof(name)), name);
+		ugci_dev_ioctl(&devs[id], HIDIOCGNAME(sizeof(name)), name);
 
 		/* Enable events */
 		t = HIDDEV_FLAG_UREF | HIDDEV_FLAG_REPORT;
-		ioctl(fd, HIDIOCSFLAG, &t);
+		if (!usb)
+			ioctl(fd, HIDIOCSFLAG, &t);
 
-		/* Make sure the reports for the hiddev are initialized */
-		ioctl(fd, HIDIOCINITREPORT, 0);
+		/* Make sure the reports we poll are initialized */
+		start_ns = ugci_now_ns();
+		ugci_init_reports(&devs[id]);
 
-		if (info_out)
-			printf("    Players %s: %s: %s\n", dev_names[id], devname, name);
+		/* Without usbhid, there is no input layer either */
+		if ((mask & UGCI_EVENT_MASK_EVDEV) && !usb)
+			devs[id].nevfd = ugci_evdev_open(i, devs[id].evfd, UGCI_MAX_EVDEV);
 
-		/* Now, let's get the eeprom. */
-		ugci_fill_uref(UGCI_UREF_EEPROM_READ, &uref_multi);
-		if (ioctl(fd, HIDIOCGUSAGES, &uref_multi) < 0)
-			fprintf(stderr, "UGCI(%d): Error reading eeprom\n", id);
-		else
+		if (info_out)
 		{
-			for (t = 0; t < uref_multi.num_values; t++)
-				devs[id].eeprom[t] = (unsigned char)uref_multi.values[t];
-			if (info_out)
+			printf("    Players %s: %s: %s\n", dev_names[id], devname, name);
+			if (mask & UGCI_EVENT_MASK_EVDEV)
+				printf("               : %d evdev node%s\n", devs[id].nevfd,
+					   devs[id].nevfd == 1 ? "" : "s");
+			printf("               : Reports initialized in %lluus\n",
+				   (ugci_now_ns() - start_ns) / 1000);
+
+			/* Only fetch the eeprom now if we have to show it */
+			if (ugci_load_eeprom(&devs[id]))
+				fprintf(stderr, "UGCI(%d): Error reading eeprom\n", id);
+			else
 			{
 				char *leader = "               :";
 
@@ -199,19 +399,21 @@ int ugci_init(ugci_callback_t cb, unsigned int mask, int info)
 				else
 					printf("%s Thru hole board (rev C)\n", leader);
 			}
-
-			devs[id].eeprom_valid = 1;
-			devs[id].eeprom_len = (devs[id].eeprom[0] & 0x02) ? 504 : 120;
 		}
 
+		ugci_seed_state(&devs[id]);
+
 		id++;
 	}
 
 	if (!hiddev_ok)
 		return -1;
 
+	ndevs = id;
 	ugci_cb = cb;
 	ugci_event_mask = mask;
+	ugci_reset_stage_stats();
+	ugci_pipe_changed();
 	initialized = 1;
 
 	return id;
@@ -221,12 +423,30 @@ static void disable_dev(int id)
 {
 	int i, valid;
 	struct ugci_dev_info *dev = get_dev_info(id);
+	struct ugci_request *req;
 
 	if (!dev)
 		return;
 
-	close(dev->fd);
+	UGCI_STAT_INC(&dev->stats, disables);
+
+	if (dev->usb)
+		ugci_usbfs_close(dev->usb);
+	else
+		close(dev->fd);
 	dev->fd = -1;
+	dev->usb = NULL;
+
+	for (i = 0; i < dev->nevfd; i++)
+		close(dev->evfd[i]);
+	dev->nevfd = 0;
+	ugci_keymap_compile(id, NULL);
+
+	/* Only the application thread pets the watchdog, and this runs
+	 * on it too, so nothing can be inside ugci_exec() with it */
+	req = dev->wd_req;
+	dev->wd_req = NULL;
+	ugci_free_request(req);
 
 	for (i = valid = 0; i < UGCI_MAX_DEVS; i++)
 		if (devs[i].fd >= 0)
@@ -241,6 +461,14 @@ void ugci_close(void)
 {
 	int i;
 
+	/* These outlive the boards; once the last one is unplugged, the
+	 * library counts as shut down but they still run */
+	ugci_stop_reader();
+	ugci_stop_exporter();
+	ugci_bridge_stop();
+	ugci_combo_clear();
+	ugci_debounce_clear();
+
 	if (!initialized)
 		return;
 
@@ -267,7 +495,7 @@ int ugci_get_coin_count(int id, unsigned short *count)
 
 	ugci_fill_uref(type, &uref_multi);
 
-	if (ioctl(dev->fd, HIDIOCGUSAGES, &uref_multi))
+	if (ugci_dev_ioctl(dev, HIDIOCGUSAGES, &uref_multi))
 		return -1;
 
 	/* XXX Not endian safe */
@@ -276,6 +504,40 @@ int ugci_get_coin_count(int id, unsigned short *count)
 	return 0;
 }
 
+int ugci_get_coin_counts(unsigned short counts[], int n)
+{
+	struct hiddev_usage_ref_multi uref_multi[2];
+	int i, t, players = 0;
+
+	if (!initialized || n <= 0)
+		return -1;
+
+	ugci_fill_uref(UGCI_UREF_P1_COIN, &uref_multi[0]);
+	ugci_fill_uref(UGCI_UREF_P2_COIN, &uref_multi[1]);
+
+	for (i = 0; i < UGCI_MAX_DEVS && i * 2 < n; i++)
+	{
+		struct ugci_dev_info *dev = get_dev_info(i);
+
+		for (t = 0; t < 2 && i * 2 + t < n; t++)
+		{
+			counts[i * 2 + t] = 0;
+
+			if (!dev)
+				continue;
+
+			if (ugci_dev_ioctl(dev, HIDIOCGUSAGES, &uref_multi[t]))
+				return -1;
+
+			/* XXX Not endian safe */
+			counts[i * 2 + t] = uref_multi[t].values[0];
+			players = i * 2 + t + 1;
+		}
+	}
+
+	return players;
+}
+
 /* The security buffer (AKA serial buffer) is a 14 byte non-volatile area.
  * It must be read in 2 7-byte reads. */
 int ugci_get_secblk(int id, unsigned char values[UGCI_SEC_VALUES])
@@ -287,9 +549,33 @@ int ugci_get_secblk(int id, unsigned char values[UGCI_SEC_VALUES])
 	if (!dev)
 		return -1;
 
+	if (secblk_cache && dev->secblk_valid)
+	{
+		memcpy(values, dev->secblk, UGCI_SEC_VALUES);
+		return 0;
+	}
+
+	/* The serial reports are not fetched in ugci_init() */
+	if (!dev->serial_fetched)
+	{
+		struct hiddev_report_info rinfo;
+
+		rinfo.report_type = HID_REPORT_TYPE_INPUT;
+		rinfo.num_fields = 0;
+
+		for (i = 0; i < 2; i++)
+		{
+			rinfo.report_id = i ? 10 : 9;
+			if (ugci_dev_ioctl(dev, HIDIOCGREPORT, &rinfo) < 0)
+				return -1;
+		}
+
+		dev->serial_fetched = 1;
+	}
+
 	ugci_fill_uref(UGCI_UREF_SERIAL_READ_1, &uref_multi);
 
-	if (ioctl(dev->fd, HIDIOCGUSAGES, &uref_multi) < 0)
+	if (ugci_dev_ioctl(dev, HIDIOCGUSAGES, &uref_multi) < 0)
 		return -1;
 
 	for (i = 0; i < uref_multi.num_values; i++)
@@ -297,15 +583,23 @@ int ugci_get_secblk(int id, unsigned char values[UGCI_SEC_VALUES])
 
 	ugci_fill_uref(UGCI_UREF_SERIAL_READ_2, &uref_multi);
 
-	if (ioctl(dev->fd, HIDIOCGUSAGES, &uref_multi) < 0)
+	if (ugci_dev_ioctl(dev, HIDIOCGUSAGES, &uref_multi) < 0)
 		return -1;
 
 	for (i = 0; i < 7; i++)
 		values[i + 7] = ((unsigned int)uref_multi.values[i]) & 0xff;
 
+	memcpy(dev->secblk, values, UGCI_SEC_VALUES);
+	dev->secblk_valid = 1;
+
 	return 0;
 }
 
+void ugci_set_secblk_cache(int enable)
+{
+	secblk_cache = enable;
+}
+
 int ugci_set_secblk(int id, unsigned char values[UGCI_SEC_VALUES])
 {
 	struct hiddev_usage_ref_multi uref_multi;
@@ -315,13 +609,16 @@ int ugci_set_secblk(int id, unsigned char values[UGCI_SEC_VALUES])
 	if (!dev)
 		return -1;
 
+	/* Whatever happens below, the cached copy can no longer be trusted */
+	dev->secblk_valid = 0;
+
 	/* Handle first 7 bytes */
 	ugci_fill_uref(UGCI_UREF_SERIAL_WRITE_1, &uref_multi);
 
 	for (i = 0; i < uref_multi.num_values; i++)
 		uref_multi.values[i] = (unsigned int)values[i];
 
-	if (ioctl(dev->fd, HIDIOCSUSAGES, &uref_multi) < 0)
+	if (ugci_dev_ioctl(dev, HIDIOCSUSAGES, &uref_multi) < 0)
 		return -1;
 
 	if (ugci_commit_uref(dev, UGCI_UREF_SERIAL_WRITE_1))
@@ -333,12 +630,20 @@ int ugci_set_secblk(int id, unsigned char values[UGCI_SEC_VALUES])
 	for (i = 0; i < uref_multi.num_values; i++)
 		uref_multi.values[i] = (unsigned int)values[i + 7];
 
-	if (ioctl(dev->fd, HIDIOCSUSAGES, &uref_multi) < 0)
+	if (ugci_dev_ioctl(dev, HIDIOCSUSAGES, &uref_multi) < 0)
 		return -1;
 
 	if (ugci_commit_uref(dev, UGCI_UREF_SERIAL_WRITE_2))
 		return -1;
 
+	/* The write went through, so it is what the device now holds */
+	if (secblk_cache)
+	{
+		memcpy(dev->secblk, values, UGCI_SEC_VALUES);
+		dev->secblk_valid = 1;
+		return 0;
+	}
+
 	/* Reread so caller can easily verify */
 	return ugci_get_secblk(id, values);
 }
@@ -366,12 +671,12 @@ int ugci_set_watchdog(int id, int type, unsigned short seconds)
 
 	ugci_fill_uref(UGCI_UREF_WD_ACTION, &uref_multi);
 	uref_multi.values[0] = type;
-	if (ioctl(dev->fd, HIDIOCSUSAGES, &uref_multi) < 0)
+	if (ugci_dev_ioctl(dev, HIDIOCSUSAGES, &uref_multi) < 0)
 		return -1;
 
 	ugci_fill_uref(UGCI_UREF_WD_TIMEOUT, &uref_multi);
 	uref_multi.values[0] = (unsigned int)seconds;
-	if (ioctl(dev->fd, HIDIOCSUSAGES, &uref_multi) < 0)
+	if (ugci_dev_ioctl(dev, HIDIOCSUSAGES, &uref_multi) < 0)
 		return -1;
 
 	/* Write the changes to the device. Both of these are on the same
@@ -384,6 +689,10 @@ int ugci_set_watchdog(int id, int type, unsigned short seconds)
 	{
 		dev->wd_interval = seconds;
 		dev->last_wd = time(NULL);
+
+		/* Refreshes from ugci_poll() reuse this */
+		if (seconds && !dev->wd_req)
+			dev->wd_req = ugci_prepare(id, UGCI_OP_WATCHDOG);
 	}
 
 	return 0;
@@ -393,7 +702,7 @@ int ugci_get_eeprom(int id, unsigned char *data, int *len)
 {
 	struct ugci_dev_info *dev = get_dev_info(id);
 
-	if (!dev || data == NULL || !dev->eeprom_valid)
+	if (!dev || data == NULL || ugci_load_eeprom(dev))
 		return -1;
 
 	memcpy(data, dev->eeprom, dev->eeprom_len);
@@ -402,6 +711,170 @@ int ugci_get_eeprom(int id, unsigned char *data, int *len)
 	return 0;
 }
 
+int ugci_set_eeprom(int id, const unsigned char *data, int len,
+		    struct ugci_eeprom_result *result)
+{
+	struct hiddev_usage_ref_multi uref_multi;
+	struct ugci_dev_info *dev = get_dev_info(id);
+	unsigned long long start = ugci_now_ns();
+	int t, changed = 0, sent = 0, ret = 0;
+
+	if (result)
+		memset(result, 0, sizeof(*result));
+
+	if (!dev || data == NULL || ugci_load_eeprom(dev))
+		return -1;
+
+	/* The size and board type bits describe the hardware */
+	if (len <= 0 || len > dev->eeprom_len ||
+	    ((data[0] ^ dev->eeprom[0]) & 0x06))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (t = 0; t < len; t++)
+		if (data[t] != dev->eeprom[t])
+			changed++;
+
+	/* hiddev can only send the feature report whole, so any change
+	 * rewrites the full image; the rest of it is what we last read */
+	if (changed)
+	{
+		ugci_fill_uref(UGCI_UREF_EEPROM_WRITE, &uref_multi);
+		for (t = 0; t < (int)uref_multi.num_values; t++)
+			uref_multi.values[t] = t < len ? data[t] : dev->eeprom[t];
+
+		if (ugci_dev_ioctl(dev, HIDIOCSUSAGES, &uref_multi) < 0 ||
+		    ugci_commit_uref(dev, UGCI_UREF_EEPROM_WRITE))
+			ret = -1;
+		else
+			sent = uref_multi.num_values;
+
+		/* Verify, and keep our copy honest even if the write failed */
+		if (ugci_read_eeprom(dev))
+			ret = -1;
+		else if (!ret && memcmp(dev->eeprom, data, len))
+		{
+			errno = EIO;
+			ret = -1;
+		}
+	}
+
+	if (result)
+	{
+		result->bytes_changed = changed;
+		result->bytes_sent = sent;
+		result->time_ns = ugci_now_ns() - start;
+	}
+
+	return ret;
+}
+
+struct ugci_request *ugci_prepare(int id, enum ugci_op op)
+{
+	struct ugci_request *req;
+	struct ugci_dev_info *dev;
+
+	switch (op)
+	{
+	case UGCI_OP_COIN_COUNT:
+	case UGCI_OP_PLAY:
+		dev = get_dev_info(id / 2);
+		break;
+	case UGCI_OP_SECBLK:
+	case UGCI_OP_WATCHDOG:
+		dev = get_dev_info(id);
+		break;
+	default:
+		return NULL;
+	}
+
+	if (!dev || !(req = calloc(1, sizeof(*req))))
+		return NULL;
+
+	req->dev = dev;
+	req->op = op;
+
+	switch (op)
+	{
+	case UGCI_OP_COIN_COUNT:
+		ugci_fill_uref((id & 1) ? UGCI_UREF_P2_COIN : UGCI_UREF_P1_COIN,
+			       &req->uref_multi[0]);
+		break;
+	case UGCI_OP_PLAY:
+		ugci_fill_uref((id & 1) ? UGCI_UREF_P2_PLAY : UGCI_UREF_P1_PLAY,
+			       &req->uref_multi[0]);
+		break;
+	case UGCI_OP_SECBLK:
+		ugci_fill_uref(UGCI_UREF_SERIAL_READ_1, &req->uref_multi[0]);
+		ugci_fill_uref(UGCI_UREF_SERIAL_READ_2, &req->uref_multi[1]);
+		break;
+	case UGCI_OP_WATCHDOG:
+		ugci_fill_uref(UGCI_UREF_WD_ACTION, &req->uref_multi[0]);
+		req->uref_multi[0].values[0] = UGCI_WD_RUNTIME;
+		ugci_fill_uref(UGCI_UREF_WD_TIMEOUT, &req->uref_multi[1]);
+
+		/* Both are in the same report, see ugci_set_watchdog() */
+		req->rinfo.report_type = req->uref_multi[0].uref.report_type;
+		req->rinfo.report_id = req->uref_multi[0].uref.report_id;
+		req->rinfo.num_fields = 0;
+		break;
+	}
+
+	return req;
+}
+
+int ugci_exec(struct ugci_request *req, int *values)
+{
+	struct ugci_dev_info *dev = req->dev;
+	int i, t;
+
+	if (dev->fd < 0)
+		return -1;
+
+	switch (req->op)
+	{
+	case UGCI_OP_COIN_COUNT:
+	case UGCI_OP_PLAY:
+		if (ugci_dev_ioctl(dev, HIDIOCGUSAGES, &req->uref_multi[0]) < 0)
+			return -1;
+
+		values[0] = req->uref_multi[0].values[0];
+		return 1;
+
+	case UGCI_OP_SECBLK:
+		for (t = 0; t < 2; t++)
+		{
+			if (ugci_dev_ioctl(dev, HIDIOCGUSAGES, &req->uref_multi[t]) < 0)
+				return -1;
+
+			for (i = 0; i < 7; i++)
+				values[i + t * 7] = ((unsigned int)req->uref_multi[t].values[i]) & 0xff;
+		}
+		return UGCI_SEC_VALUES;
+
+	case UGCI_OP_WATCHDOG:
+		req->uref_multi[1].values[0] = (unsigned short)values[0];
+
+		if (ugci_dev_ioctl(dev, HIDIOCSUSAGES, &req->uref_multi[0]) < 0 ||
+		    ugci_dev_ioctl(dev, HIDIOCSUSAGES, &req->uref_multi[1]) < 0 ||
+		    ugci_dev_ioctl(dev, HIDIOCSREPORT, &req->rinfo) < 0)
+			return -1;
+
+		dev->wd_interval = (unsigned short)values[0];
+		dev->last_wd = time(NULL);
+		return 0;
+	}
+
+	return -1;
+}
+
+void ugci_free_request(struct ugci_request *req)
+{
+	free(req);
+}
+
 int ugci_kbd_mode(int id, int mode, unsigned char delay)
 {
 	struct hiddev_usage_ref_multi uref_multi;
@@ -423,7 +896,7 @@ int ugci_kbd_mode(int id, int mode, unsigned char delay)
 	ugci_fill_uref(UGCI_UREF_KBD_MODE, &uref_multi);
 	uref_multi.values[0] = mode;
 	uref_multi.values[0] = delay;
-	if (ioctl(dev->fd, HIDIOCSUSAGES, &uref_multi) < 0)
+	if (ugci_dev_ioctl(dev, HIDIOCSUSAGES, &uref_multi) < 0)
 		return -1;
 
 	if (ugci_commit_uref(dev, UGCI_UREF_KBD_MODE))
@@ -440,166 +913,1113 @@ unsigned int ugci_get_version(void)
 void ugci_set_coin_simulate(int wait_time)
 {
 	sim_coin_wait = wait_time;
+	ugci_pipe_changed();
 }
 
-static void ugci_send_event(int id, enum ugci_event_type type, int value)
-{
-	DPRINT("UGCI(%d): Sending Player %d %s button: %d\n",
-		   id / 2, id + 1, ugci_event_to_name[type], value);
-
-	if (ugci_cb)
-		ugci_cb(id, type, value);
-}
-
-static inline unsigned long long ugci_tv_to_msec(struct timeval *tv)
+void ugci_set_stall_detect(ugci_stall_callback_t cb, unsigned int poll_gap_us,
+			   unsigned int callback_us, unsigned int event_age_us)
 {
-	return ((unsigned long long)tv->tv_sec * 1000) + ((unsigned long long)tv->tv_usec / 1000);
+	stall_cb = cb;
+	stall_poll_gap_ns = (unsigned long long)poll_gap_us * 1000;
+	stall_callback_ns = (unsigned long long)callback_us * 1000;
+	stall_event_age_ns = (unsigned long long)event_age_us * 1000;
+	last_poll_ns = 0;
 }
 
-int ugci_poll(int timeout)
+/* Count a stall against a device, or all of them if id is -1, and tell
+ * the application about it. */
+static void ugci_report_stall(int id, enum ugci_stall_type type, unsigned long long ns)
 {
-	int i, fds, events, rd;
-	struct pollfd pfd[UGCI_MAX_DEVS];
-	struct ugci_dev_info *dev;
-
-	if (!initialized)
-		return -1;
+	int i;
 
-	for (i = fds = 0; i < UGCI_MAX_DEVS; i++)
+	for (i = 0; i < UGCI_MAX_DEVS; i++)
 	{
-		if (!(dev = get_dev_info(i)))
+		struct ugci_stats *stats;
+
+		if ((id >= 0 && i != id) || !get_dev_info(i))
 			continue;
 
-		pfd[fds].events = POLLIN;
-		pfd[fds].fd = dev->fd;
-		pfd[fds].revents = 0;
+		stats = &devs[i].stats;
 
-		fds++;
+		switch (type)
+		{
+		case UGCI_STALL_POLL_GAP:
+			UGCI_STAT_INC(stats, poll_gaps);
+			if (ns > stats->max_poll_gap_ns)
+				stats->max_poll_gap_ns = ns;
+			break;
+		case UGCI_STALL_CALLBACK:
+			UGCI_STAT_INC(stats, slow_callbacks);
+			if (ns > stats->max_callback_ns)
+				stats->max_callback_ns = ns;
+			break;
+		case UGCI_STALL_EVENT_AGE:
+			UGCI_STAT_INC(stats, late_events);
+			if (ns > stats->max_event_age_ns)
+				stats->max_event_age_ns = ns;
+			break;
+		}
 	}
 
-	if (!fds)
-		return 0;
+	if (stall_cb)
+		stall_cb(id, type, ns);
+}
 
-	rd = poll(pfd, fds, timeout);
+static void ugci_deliver(const struct ugci_event *ev)
+{
+	struct ugci_stats *stats = &devs[ev->id / 2].stats;
+	unsigned long long start = 0;
 
-	for (i = events = 0; i < UGCI_MAX_DEVS; i++)
-	{
-		struct hiddev_usage_ref ev[64];
-		int t, p;
+	if (stall_callback_ns || ugci_exporter_running())
+		start = ugci_now_ns();
 
-		if (!(dev = get_dev_info(i)))
-			continue;
+	if (ugci_event_cb)
+		ugci_event_cb(ev);
+	else if (ev->type != UGCI_EVENT_EVDEV)
+		ugci_cb(ev->id, ev->type, ev->value);
 
-		for (p = 0; p < fds; p++)
-			if (pfd[p].fd == dev->fd)
-				break;
+	UGCI_STAT_INC(stats, callbacks);
 
-		if (pfd[p].revents & (POLLNVAL | POLLERR))
-		{
-			fprintf(stderr, "UGCI(%d): Error polling, disabling\n", i);
-			disable_dev(i);
-			continue;
-		}
+	if (!start)
+		return;
 
-		if (pfd[p].revents & POLLIN)
-		{
-			rd = read(dev->fd, ev, sizeof(ev));
+	start = ugci_now_ns() - start;
+	UGCI_STAT_ADD(stats, callback_ns, start);
 
-			if (rd < (int)sizeof(ev[0]))
-			{
-				fprintf(stderr, "UGCI(%d): Error reading, disabling\n", i);
-				perror("read");
-				disable_dev(i);
-				continue;
-			}
+	if (stall_callback_ns && start > stall_callback_ns)
+		ugci_report_stall(ev->id / 2, UGCI_STALL_CALLBACK, start);
+}
 
-			for (t = 0; t < (rd / sizeof(ev[0])); t++)
-			{
-				enum ugci_event_type type = 0;
-				int value;
-				int id = ev[t].report_id == UGCI_PLAYER_1_REPORT ? 0 : 1;
-				int player = id + (i * 2);
-
-				switch (ev[t].usage_code)
-				{
-				case UGCI_PLAYER_UCODE_PLAY:
-					if (!(ugci_event_mask & UGCI_EVENT_MASK_PLAY))
-						continue;
-
-					type = UGCI_EVENT_PLAY;
-					value = ev[t].value;
-					break;
-				case UGCI_PLAYER_UCODE_COIN:
-					if (!(ugci_event_mask & UGCI_EVENT_MASK_COIN))
-						continue;
-
-					type = UGCI_EVENT_COIN;
-					if (sim_coin_wait)
-					{
-						/* See if we need to force a premature release */
-						if (dev->coin_pressed[id])
-						{
-							events++;
-							ugci_send_event(player, type, 0);
-						}
-						else
-							dev->coin_pressed[id] = 1;
-
-						gettimeofday(&dev->last_tv[id], NULL);
-						value = 1;
-					}
-					else
-					{
-						value = ev[t].value;
-					}
-					break;
+void ugci_set_event_callback(ugci_event_callback_t cb)
+{
+	ugci_event_cb = cb;
+	ugci_pipe_changed();
+}
 
-				default:
-					continue;
-				}
+static inline unsigned long long ugci_ts_to_nsec(const struct timespec *ts)
+{
+	return ((unsigned long long)ts->tv_sec * 1000000000ULL) + (unsigned long long)ts->tv_nsec;
+}
 
-				events++;
-				ugci_send_event(player, type, value);
-			}
-		}
+static inline void ugci_nsec_to_ts(unsigned long long nsec, struct timespec *ts)
+{
+	ts->tv_sec = nsec / 1000000000ULL;
+	ts->tv_nsec = nsec % 1000000000ULL;
+}
 
-		/* Now check for psuedo coin-release events */
-		if (sim_coin_wait)
-		{
-			for (t = 0; t < 2; t++)
-			{
-				int player = t + (i * 2);
-				struct timeval tv;
+unsigned long long ugci_now_ns(void)
+{
+	struct timespec ts;
 
-				if (!dev->coin_pressed[t])
-					continue;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-				gettimeofday(&tv, NULL);
+	return ugci_ts_to_nsec(&ts);
+}
 
-				if (ugci_tv_to_msec(&dev->last_tv[t]) + sim_coin_wait <
-					ugci_tv_to_msec(&tv))
-				{
-					events++;
-					ugci_send_event(player, UGCI_EVENT_COIN, 0);
-					dev->coin_pressed[t] = 0;
-				}
-			}
-		}
+/* The time for events that are not timestamped themselves */
+static unsigned long long ugci_event_time(void)
+{
+	return event_ns ? event_ns : ugci_now_ns();
+}
 
-		/* Now check watchdog timer */
-		if (dev->wd_interval)
-		{
-			int checktime = (dev->wd_interval / 2) ?: 1;
+/* Decode. What the device reports is turned into events for the
+ * pipeline here, keeping the raw values needed to tell what changed.
+ * The state seen by subscribers is only updated by the state stage,
+ * once the filters are done with them. */
+static void ugci_send_play(struct ugci_dev_info *dev, int id, int value)
+{
+	dev->raw_play[id] = value;
+	ugci_pipe_send(id + (dev->id * 2), UGCI_EVENT_PLAY, value, ugci_event_time());
+}
 
-			if (dev->last_wd + checktime <= time(NULL))
-			{
-				int old_info = info_out;
-				info_out = 0;
-				ugci_set_watchdog(dev->id, UGCI_WD_RUNTIME, dev->wd_interval);
-				info_out = old_info;
+static void ugci_send_coin(struct ugci_dev_info *dev, int id, int value)
+{
+	dev->coin_count[id] = value;
+	ugci_pipe_send(id + (dev->id * 2), UGCI_EVENT_COIN, value, ugci_event_time());
+}
+
+static void ugci_send_stick(struct ugci_dev_info *dev, int id, int moved)
+{
+	struct ugci_pipe_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.ev.time_ns = ugci_event_time();
+	ev.ev.id = id + (dev->id * 2);
+	ev.ev.type = UGCI_EVENT_STICK;
+	ev.ev.value = dev->raw_buttons[id];
+	ev.moved = moved;
+
+	ugci_pipe_emit(&ev);
+}
+
+/* The coin value is an absolute counter, so we can tell when events were
+ * lost in between (it jumps), and when an event is older than what we
+ * already know (it goes back, e.g. after a resync). Lost coins are made
+ * up for, unless the jump is too large to be believable. */
+static void ugci_coin_update(struct ugci_dev_info *dev, int id, unsigned short value)
+{
+	short diff = value - dev->coin_count[id];
+
+	/* The player report repeats the counter with every play and stick
+	 * change; only a counter that went back is out of date */
+	if (diff <= 0)
+	{
+		if (diff < 0)
+			UGCI_STAT_INC(&dev->stats, stale_events);
+		return;
+	}
+
+	if (diff > 1)
+	{
+		UGCI_STAT_INC(&dev->stats, coin_gaps);
+		__atomic_store_n(&dev->resync, 1, __ATOMIC_RELAXED);
+
+		if (diff <= UGCI_MAX_COIN_GAP)
+			while (--diff)
+				ugci_send_coin(dev, id, value - diff);
+	}
+
+	ugci_send_coin(dev, id, value);
+}
+
+void ugci_set_report_mode(int enable)
+{
+	report_mode = enable;
+}
+
+/* Fetch a whole report's worth of values and apply them in one go, for
+ * report mode. */
+static void ugci_decode_report(struct ugci_dev_info *dev, unsigned int report_id,
+			       unsigned long long read_ns)
+{
+	struct hiddev_usage_ref_multi uref_multi;
+	int t, id;
+
+	switch (report_id)
+	{
+	case UGCI_PLAYER_1_REPORT:
+	case UGCI_PLAYER_2_REPORT:
+		id = report_id == UGCI_PLAYER_1_REPORT ? 0 : 1;
+
+		ugci_fill_uref(id ? UGCI_UREF_P2_COIN : UGCI_UREF_P1_COIN, &uref_multi);
+		if (ugci_dev_ioctl(dev, HIDIOCGUSAGES, &uref_multi) == 0 &&
+		    (unsigned short)uref_multi.values[0] != dev->coin_count[id])
+			ugci_coin_update(dev, id, uref_multi.values[0]);
+
+		ugci_fill_uref(id ? UGCI_UREF_P2_PLAY : UGCI_UREF_P1_PLAY, &uref_multi);
+		if (ugci_dev_ioctl(dev, HIDIOCGUSAGES, &uref_multi) == 0 &&
+		    uref_multi.values[0] != dev->raw_play[id])
+			ugci_send_play(dev, id, uref_multi.values[0]);
+		break;
+
+	case UGCI_JOYSTICK_1_REPORT:
+	case UGCI_JOYSTICK_2_REPORT:
+	{
+		unsigned char buttons = 0;
+		int moved;
+
+		id = report_id == UGCI_JOYSTICK_1_REPORT ? 0 : 1;
+
+		ugci_fill_uref(id ? UGCI_UREF_J2_BUTTONS : UGCI_UREF_J1_BUTTONS, &uref_multi);
+		if (ugci_dev_ioctl(dev, HIDIOCGUSAGES, &uref_multi) < 0)
+			break;
+
+		for (t = 0; t < uref_multi.num_values; t++)
+			if (uref_multi.values[t])
+				buttons |= 1 << t;
+
+		ugci_fill_uref(id ? UGCI_UREF_J2_AXES : UGCI_UREF_J1_AXES, &uref_multi);
+		if (ugci_dev_ioctl(dev, HIDIOCGUSAGES, &uref_multi) < 0)
+			break;
+
+		moved = uref_multi.values[0] != dev->stick_x[id] ||
+			uref_multi.values[1] != dev->stick_y[id];
+
+		if (buttons != dev->raw_buttons[id] || moved)
+		{
+			if (uref_multi.values[0] != dev->stick_x[id])
+				ugci_axis_record(id + (dev->id * 2), UGCI_AXIS_X,
+						 uref_multi.values[0], read_ns);
+			if (uref_multi.values[1] != dev->stick_y[id])
+				ugci_axis_record(id + (dev->id * 2), UGCI_AXIS_Y,
+						 uref_multi.values[1], read_ns);
+
+			dev->raw_buttons[id] = buttons;
+			dev->stick_x[id] = uref_multi.values[0];
+			dev->stick_y[id] = uref_multi.values[1];
+			ugci_send_stick(dev, id, moved);
+		}
+		break;
+	}
+	}
+}
+
+/* Decode one batch of usage events read from a device */
+static void ugci_process_dev(struct ugci_dev_info *dev, struct hiddev_usage_ref *ev, int count,
+			     unsigned long long read_ns)
+{
+	int t;
+
+	for (t = 0; t < count; t++)
+	{
+		int id = (ev[t].report_id == UGCI_PLAYER_1_REPORT ||
+			  ev[t].report_id == UGCI_JOYSTICK_1_REPORT) ? 0 : 1;
+
+		/* hiddev marks the end of each report with a usage-less event */
+		if (report_mode)
+		{
+			if (ev[t].field_index == HID_FIELD_INDEX_NONE &&
+			    ev[t].report_type == HID_REPORT_TYPE_INPUT)
+				ugci_decode_report(dev, ev[t].report_id, read_ns);
+			continue;
+		}
+
+		switch (ev[t].usage_code)
+		{
+		case UGCI_PLAYER_UCODE_PLAY:
+			ugci_send_play(dev, id, ev[t].value);
+			break;
+		case UGCI_PLAYER_UCODE_COIN:
+			ugci_coin_update(dev, id, ev[t].value);
+			break;
+		case UGCI_JOYSTICK_UCODE_X:
+			dev->stick_x[id] = ev[t].value;
+			ugci_axis_record(id + (dev->id * 2), UGCI_AXIS_X, ev[t].value, read_ns);
+			ugci_send_stick(dev, id, 1);
+			break;
+		case UGCI_JOYSTICK_UCODE_Y:
+			dev->stick_y[id] = ev[t].value;
+			ugci_axis_record(id + (dev->id * 2), UGCI_AXIS_Y, ev[t].value, read_ns);
+			ugci_send_stick(dev, id, 1);
+			break;
+		case UGCI_JOYSTICK_UCODE_BUT_1 ... UGCI_JOYSTICK_UCODE_BUT_7:
+			if (ev[t].value)
+				dev->raw_buttons[id] |= 1 << (ev[t].usage_code - UGCI_JOYSTICK_UCODE_BUT_1);
+			else
+				dev->raw_buttons[id] &= ~(1 << (ev[t].usage_code - UGCI_JOYSTICK_UCODE_BUT_1));
+			ugci_send_stick(dev, id, 0);
+			break;
+		}
+	}
+}
+
+/* Fetch the player and joystick reports straight from the device and
+ * send whatever events it takes to bring subscribers back in line with
+ * it. Used when the kernel's event queue has likely overflowed, or the
+ * reader thread had no room left for a change. */
+static void ugci_resync_dev(struct ugci_dev_info *dev)
+{
+	static const int report_ids[4] = {
+		UGCI_PLAYER_1_REPORT, UGCI_PLAYER_2_REPORT,
+		UGCI_JOYSTICK_1_REPORT, UGCI_JOYSTICK_2_REPORT,
+	};
+	struct hiddev_report_info rinfo;
+	int t;
+
+	UGCI_STAT_INC(&dev->stats, resyncs);
+
+	rinfo.report_type = HID_REPORT_TYPE_INPUT;
+	rinfo.num_fields = 0;
+
+	/* Boards without joysticks simply fail those reports */
+	for (t = 0; t < 4; t++)
+	{
+		rinfo.report_id = report_ids[t];
+		if (ugci_dev_ioctl(dev, HIDIOCGREPORT, &rinfo) == 0)
+			ugci_decode_report(dev, report_ids[t], ugci_now_ns());
+	}
+
+	/* Whatever the resync itself flagged is already taken care of */
+	__atomic_store_n(&dev->resync, 0, __ATOMIC_RELAXED);
+}
+
+/* State stage: commits the filtered play and stick buttons to the state
+ * ugci_sample_frame() returns. Events are marked with what they change,
+ * but all of them are passed on, as hiddev delivered them. */
+void ugci_state_stage(const struct ugci_pipe_event *in, int n, unsigned long long now)
+{
+	struct ugci_pipe_event ev;
+	struct ugci_dev_info *dev;
+	int i, id;
+
+	for (i = 0; i < n; i++)
+	{
+		ev = in[i];
+		dev = &devs[ev.ev.id / 2];
+		id = ev.ev.id & 1;
+
+		if (ev.ev.type == UGCI_EVENT_PLAY)
+		{
+			ev.changed = ev.ev.value != dev->play[id];
+			dev->play[id] = ev.ev.value;
+		}
+		else if (ev.ev.type == UGCI_EVENT_STICK)
+		{
+			ev.changed = dev->buttons[id] ^ ev.ev.value;
+			dev->buttons[id] = ev.ev.value;
+		}
+
+		ugci_pipe_emit(&ev);
+	}
+}
+
+void ugci_set_changes_only(int enable)
+{
+	changes_only = enable;
+	ugci_pipe_changed();
+}
+
+int ugci_changes_active(void)
+{
+	return changes_only;
+}
+
+/* Changes stage: drops the play and stick events that change nothing */
+void ugci_changes_stage(const struct ugci_pipe_event *in, int n, unsigned long long now)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if ((in[i].ev.type == UGCI_EVENT_PLAY || in[i].ev.type == UGCI_EVENT_STICK) &&
+		    !in[i].changed && !in[i].moved)
+			continue;
+
+		ugci_pipe_emit(&in[i]);
+	}
+}
+
+int ugci_coin_sim_active(void)
+{
+	return sim_coin_wait != 0;
+}
+
+unsigned long long ugci_coin_sim_deadline(void)
+{
+	struct ugci_dev_info *dev;
+	unsigned long long d, next = 0;
+	int i, t;
+
+	for (i = 0; i < UGCI_MAX_DEVS; i++)
+	{
+		if (!(dev = get_dev_info(i)))
+			continue;
+
+		for (t = 0; t < 2; t++)
+		{
+			if (!dev->coin_pressed[t])
+				continue;
+
+			d = dev->coin_ns[t] + (unsigned long long)sim_coin_wait * 1000000ULL;
+			if (!next || d < next)
+				next = d;
+		}
+	}
+
+	return next;
+}
+
+/* Coin release simulation: each coin becomes a press, and a release once
+ * the wait is over or the next coin comes in */
+void ugci_coin_sim_stage(const struct ugci_pipe_event *in, int n, unsigned long long now)
+{
+	struct ugci_pipe_event ev;
+	struct ugci_dev_info *dev;
+	int i, t;
+
+	for (i = 0; i < n; i++)
+	{
+		ev = in[i];
+
+		if (ev.ev.type == UGCI_EVENT_COIN)
+		{
+			dev = &devs[ev.ev.id / 2];
+			t = ev.ev.id & 1;
+
+			/* See if we need to force a premature release */
+			if (dev->coin_pressed[t])
+				ugci_pipe_send(ev.ev.id, UGCI_EVENT_COIN, 0, ev.ev.time_ns);
+			else
+				dev->coin_pressed[t] = 1;
+
+			dev->coin_ns[t] = ev.ev.time_ns;
+			ev.ev.value = 1;
+		}
+
+		ugci_pipe_emit(&ev);
+	}
+
+	/* Now check for psuedo coin-release events */
+	for (i = 0; i < UGCI_MAX_DEVS; i++)
+	{
+		if (!(dev = get_dev_info(i)))
+			continue;
+
+		for (t = 0; t < 2; t++)
+		{
+			if (dev->coin_pressed[t] &&
+			    now >= dev->coin_ns[t] + (unsigned long long)sim_coin_wait * 1000000ULL)
+			{
+				ugci_pipe_send(t + (i * 2), UGCI_EVENT_COIN, 0, now);
+				dev->coin_pressed[t] = 0;
 			}
 		}
 	}
+}
+
+/* The event mask bit of each event type */
+static const unsigned int ugci_type_masks[] = {
+	[UGCI_EVENT_COIN]	= UGCI_EVENT_MASK_COIN,
+	[UGCI_EVENT_PLAY]	= UGCI_EVENT_MASK_PLAY,
+	[UGCI_EVENT_STICK]	= UGCI_EVENT_MASK_STICK,
+	[UGCI_EVENT_EVDEV]	= UGCI_EVENT_MASK_EVDEV,
+	[UGCI_EVENT_COMBO]	= UGCI_EVENT_MASK_COMBO,
+};
+
+/* Mask stage: only what the application subscribed to goes further.
+ * Evdev events only fit the event callback. */
+void ugci_mask_stage(const struct ugci_pipe_event *in, int n, unsigned long long now)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		UGCI_STAT_INC(&devs[in[i].ev.id / 2].stats, events[in[i].ev.type]);
+
+		if (!(ugci_event_mask & ugci_type_masks[in[i].ev.type]))
+			continue;
+		if (in[i].ev.type == UGCI_EVENT_EVDEV && !ugci_event_cb)
+			continue;
+
+		ugci_pipe_emit(&in[i]);
+	}
+}
+
+int ugci_callback_active(void)
+{
+	return ugci_cb || ugci_event_cb;
+}
+
+void ugci_callback_stage(const struct ugci_pipe_event *in, int n, unsigned long long now)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		DPRINT("UGCI(%d): Sending Player %d %s button: %d\n", in[i].ev.id / 2,
+		       in[i].ev.id + 1, ugci_event_to_name[in[i].ev.type], in[i].ev.value);
+
+		ugci_deliver(&in[i].ev);
+	}
+}
+
+int ugci_stick_value(int player, enum ugci_axis axis)
+{
+	struct ugci_dev_info *dev = get_dev_info(player / 2);
+
+	if (!dev)
+		return 0;
+
+	return axis == UGCI_AXIS_X ? dev->stick_x[player & 1] : dev->stick_y[player & 1];
+}
+
+/* What the state stage last committed, which it does whether or not the
+ * device is open */
+unsigned short ugci_held_inputs(int player)
+{
+	struct ugci_dev_info *dev;
+
+	if (player < 0 || player >= UGCI_MAX_PLAYERS)
+		return 0;
+
+	dev = &devs[player / 2];
+
+	return (dev->play[player & 1] ? UGCI_INPUT_BIT(UGCI_INPUT_PLAY) : 0) |
+		(dev->buttons[player & 1] << UGCI_INPUT_BUTTON_1);
+}
+
+int ugci_input_value(int player, enum ugci_input input)
+{
+	struct ugci_dev_info *dev = get_dev_info(player / 2);
+
+	if (!dev)
+		return 0;
+
+	if (input == UGCI_INPUT_PLAY)
+		return dev->raw_play[player & 1];
+
+	return !!(dev->raw_buttons[player & 1] & (1 << (input - UGCI_INPUT_BUTTON_1)));
+}
+
+int ugci_dev_fd(int id)
+{
+	struct ugci_dev_info *dev = get_dev_info(id);
+
+	return dev ? dev->fd : -1;
+}
+
+unsigned long long ugci_last_input_ns(void)
+{
+	return __atomic_load_n(&last_input_ns, __ATOMIC_RELAXED);
+}
+
+/* Read one batch of usage events from a device and timestamp it. Returns
+ * the number of events read, or less than zero on error. */
+int ugci_read_dev(int id, struct ugci_batch *batch, unsigned long long ready_ns)
+{
+	struct ugci_dev_info *dev = &devs[id];
+	int rd;
+
+	UGCI_STAT_INC(&dev->stats, reads);
+
+	if (dev->usb)
+		rd = ugci_usbfs_read(dev->usb, batch->ev, UGCI_BATCH_EVENTS);
+	else if ((rd = read(dev->fd, batch->ev, sizeof(batch->ev))) >= 0)
+	{
+		/* hiddev only ever hands out whole events */
+		if (rd < (int)sizeof(batch->ev[0]) || rd % sizeof(batch->ev[0]))
+			UGCI_STAT_INC(&dev->stats, short_reads);
+
+		rd = rd >= (int)sizeof(batch->ev[0]) ? rd / (int)sizeof(batch->ev[0]) : -1;
+	}
+
+	if (rd < 0)
+		return -1;
+
+	/* With the reader thread running, this is called on it, while the
+	 * application thread looks at these */
+	__atomic_store_n(&dev->last_read_ns, ready_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&last_input_ns, ready_ns, __ATOMIC_RELAXED);
+	batch->read_ns = ready_ns;
+	batch->count = rd;
+
+	/* A run of full reads means we are well behind the kernel, and its
+	 * queue may well have overflowed. The run is only ever seen by
+	 * whichever thread does the reading. */
+	if (batch->count < UGCI_BATCH_EVENTS)
+		dev->full_reads = 0;
+	else if (++dev->full_reads == UGCI_BATCHES)
+	{
+		UGCI_STAT_INC(&dev->stats, full_reads);
+		__atomic_store_n(&dev->resync, 1, __ATOMIC_RELAXED);
+		dev->full_reads = 0;
+	}
+
+	return batch->count;
+}
+
+int ugci_queue_full(int id)
+{
+	return nbatches[id] >= UGCI_BATCHES;
+}
+
+/* Have the next ugci_poll() resync the device with its reports */
+void ugci_request_resync(int id)
+{
+	__atomic_store_n(&devs[id].resync, 1, __ATOMIC_RELAXED);
+}
+
+int ugci_get_stats(int id, struct ugci_stats *stats)
+{
+	struct ugci_dev_info *dev = get_dev_info(id);
+
+	if (!dev || stats == NULL)
+		return -1;
+
+	memcpy(stats, &dev->stats, sizeof(*stats));
+
+	return 0;
+}
+
+struct ugci_stats *ugci_dev_stats(int id)
+{
+	return &devs[id].stats;
+}
+
+int ugci_dev_count(void)
+{
+	return ndevs;
+}
+
+/* Hand a batch read by the reader thread over to the next dispatch. A
+ * negative count means the reader hit an error on that device. Returns
+ * less than zero if the device already has as many batches as it can
+ * take this time around. */
+int ugci_queue_batch(int id, const struct ugci_batch *batch)
+{
+	if (batch->count < 0)
+	{
+		if (get_dev_info(id))
+		{
+			fprintf(stderr, "UGCI(%d): Error reading, disabling\n", id);
+			disable_dev(id);
+		}
+		return 0;
+	}
+
+	if (nbatches[id] >= UGCI_BATCHES)
+		return -1;
+
+	batches[id][nbatches[id]++] = *batch;
+
+	return 0;
+}
+
+/* Refresh the runtime watchdog of every device that is due. This stays
+ * on the application's thread even with the reader thread running, so
+ * that a hung main loop lets the watchdog fire, and so requests to the
+ * boards never interleave. */
+static void ugci_pet_watchdogs(void)
+{
+	struct ugci_dev_info *dev;
+	int i;
+
+	for (i = 0; i < UGCI_MAX_DEVS; i++)
+	{
+		int checktime;
+
+		if (!(dev = get_dev_info(i)) || !dev->wd_interval)
+			continue;
+
+		checktime = (dev->wd_interval / 2) ?: 1;
+
+		if (dev->last_wd + checktime <= time(NULL))
+		{
+			int old_info = info_out;
+			int seconds = dev->wd_interval;
+
+			UGCI_STAT_INC(&dev->stats, wd_pets);
+
+			if (dev->wd_req)
+			{
+				ugci_exec(dev->wd_req, &seconds);
+				continue;
+			}
+
+			info_out = 0;
+			ugci_set_watchdog(dev->id, UGCI_WD_RUNTIME, dev->wd_interval);
+			info_out = old_info;
+		}
+	}
+}
+
+/* Read every readable device into its batch list. Each read is stamped
+ * with the time poll found the device readable, rather than the time the
+ * read returned, so devices that became readable together do not appear
+ * ordered by the time it took to read the ones before them. After the
+ * first pass, devices are polled again without waiting, so that events
+ * arriving while we read are picked up in this same call. Returns the
+ * number of usage events read. */
+static int ugci_read_batches(struct pollfd *pfd, int fds)
+{
+	int i, p, round, total = 0;
+	struct ugci_batch *batch;
+
+	for (round = 0; round < UGCI_BATCHES; round++)
+	{
+		unsigned long long ready_ns = ugci_now_ns();
+		int ready = 0;
+
+		for (p = 0; p < fds; p++)
+		{
+			for (i = 0; i < UGCI_MAX_DEVS; i++)
+				if (devs[i].fd >= 0 && devs[i].fd == pfd[p].fd)
+					break;
+
+			if (i == UGCI_MAX_DEVS)
+				continue;
+
+			if (pfd[p].revents & (POLLNVAL | POLLERR))
+			{
+				fprintf(stderr, "UGCI(%d): Error polling, disabling\n", i);
+				disable_dev(i);
+				continue;
+			}
+
+			if (!(pfd[p].revents & UGCI_POLL_READY))
+				continue;
+
+			batch = &batches[i][nbatches[i]];
+
+			if (ugci_read_dev(i, batch, ready_ns) < 0)
+			{
+				fprintf(stderr, "UGCI(%d): Error reading, disabling\n", i);
+				perror("read");
+				disable_dev(i);
+				continue;
+			}
+
+			nbatches[i]++;
+
+			total += batch->count;
+			ready++;
+		}
+
+		if (!ready || round + 1 == UGCI_BATCHES)
+			break;
+
+		/* Only devices that had data can have more queued already */
+		for (p = 0; p < fds; p++)
+		{
+			if (!(pfd[p].revents & UGCI_POLL_READY))
+				pfd[p].fd = -1;
+			pfd[p].revents = 0;
+		}
+
+		if (poll(pfd, fds, 0) <= 0)
+			break;
+	}
+
+	return total;
+}
+
+int ugci_merge_next(struct ugci_merge_src *src, int n)
+{
+	unsigned long long ns, best_ns = 0;
+	int s, best = -1;
+
+	for (s = 0; s < n; s++)
+	{
+		if (src[s].head >= src[s].count)
+			continue;
+
+		ns = *(const unsigned long long *)((const char *)src[s].ns +
+						   src[s].head * src[s].stride);
+
+		if (best < 0 || ns < best_ns)
+		{
+			best = s;
+			best_ns = ns;
+		}
+	}
+
+	return best;
+}
+
+static void ugci_merge_src(struct ugci_merge_src *src, const unsigned long long *ns,
+			   size_t stride, int count)
+{
+	src->ns = ns;
+	src->stride = stride;
+	src->count = count;
+	src->head = 0;
+}
+
+/* Decode the batches read by ugci_read_batches() as a k-way merge on
+ * their read timestamps, with the evdev events merged in one by one on
+ * their own. Each device's hiddev batches come first, then its evdev
+ * nodes, which sets the order of ties. See ugci_merge_next(). */
+static void ugci_dispatch_batches(void)
+{
+	struct ugci_merge_src src[UGCI_MAX_DEVS * (1 + UGCI_MAX_EVDEV)];
+	int i, k, s, n = 0;
+
+	for (i = 0; i < UGCI_MAX_DEVS; i++)
+	{
+		ugci_merge_src(&src[n++], &batches[i][0].read_ns,
+			       sizeof(batches[i][0]), nbatches[i]);
+
+		for (k = 0; k < UGCI_MAX_EVDEV; k++)
+			ugci_merge_src(&src[n++], &evbatches[i][k].ev[0].time_ns,
+				       sizeof(evbatches[i][k].ev[0]), evbatches[i][k].count);
+	}
+
+	while ((s = ugci_merge_next(src, n)) >= 0)
+	{
+		int best = s / (1 + UGCI_MAX_EVDEV);
+		int j = src[s].head++;
+
+		if ((k = s % (1 + UGCI_MAX_EVDEV) - 1) >= 0)
+		{
+			const struct ugci_evdev_event *e = &evbatches[best][k].ev[j];
+			struct ugci_pipe_event ev;
+
+			if (devs[best].fd < 0)
+				continue;
+
+			memset(&ev, 0, sizeof(ev));
+			ev.ev.time_ns = e->time_ns;
+			ev.ev.id = best * 2;
+			ev.ev.type = UGCI_EVENT_EVDEV;
+			ev.ev.ev_type = e->type;
+			ev.ev.code = e->code;
+			ev.ev.value = e->value;
+			ugci_pipe_emit(&ev);
+			continue;
+		}
+
+		/* How long the batch waited between read and dispatch */
+		if (stall_event_age_ns && devs[best].fd >= 0)
+		{
+			unsigned long long age = ugci_now_ns() - batches[best][j].read_ns;
+
+			if (age > stall_event_age_ns)
+				ugci_report_stall(best, UGCI_STALL_EVENT_AGE, age);
+		}
+
+		/* A device may be disabled between read and dispatch */
+		if (devs[best].fd >= 0)
+		{
+			event_ns = batches[best][j].read_ns;
+			ugci_process_dev(&devs[best], batches[best][j].ev,
+					 batches[best][j].count, event_ns);
+		}
+	}
+
+	event_ns = 0;
+	memset(nbatches, 0, sizeof(nbatches));
+
+	for (i = 0; i < UGCI_MAX_DEVS; i++)
+		for (k = 0; k < UGCI_MAX_EVDEV; k++)
+			evbatches[i][k].count = 0;
+}
+
+/* Drain the evdev nodes. They are non-blocking, so this is cheap for the
+ * ones with nothing queued. Returns the number of events read. */
+static int ugci_read_evdevs(void)
+{
+	struct ugci_dev_info *dev;
+	int i, k, rd, total = 0;
+
+	for (i = 0; i < UGCI_MAX_DEVS; i++)
+	{
+		if (!(dev = get_dev_info(i)))
+			continue;
+
+		for (k = 0; k < dev->nevfd; k++)
+		{
+			if ((rd = ugci_evdev_read(dev->evfd[k], &evbatches[i][k])) >= 0)
+			{
+				total += rd;
+				continue;
+			}
+
+			/* The node went away; hiddev will notice on its own */
+			close(dev->evfd[k]);
+			dev->evfd[k] = dev->evfd[--dev->nevfd];
+			evbatches[i][k] = evbatches[i][dev->nevfd];
+			evbatches[i][dev->nevfd].count = 0;
+			k--;
+		}
+	}
+
+	return total;
+}
+
+/* Common poll loop behind ugci_poll() and ugci_sample_frame(). A NULL
+ * timeout blocks forever. If reads is non-NULL, it is set to the number of
+ * raw usage events read, whether or not they were sent to the callback. */
+static int ugci_poll_ts(const struct timespec *timeout, int *reads)
+{
+	int i, k, fds, events, rd;
+	struct pollfd pfd[UGCI_MAX_DEVS * (1 + UGCI_MAX_EVDEV)];
+	struct ugci_dev_info *dev;
+	unsigned long long deadline, start;
+	struct timespec deadline_ts;
+
+	if (reads)
+		*reads = 0;
+
+	if (!initialized)
+		return -1;
+
+	for (i = fds = 0; i < UGCI_MAX_DEVS; i++)
+	{
+		if (!(dev = get_dev_info(i)))
+			continue;
+
+		pfd[fds].events = UGCI_POLL_READY;
+		pfd[fds].fd = dev->fd;
+		pfd[fds].revents = 0;
+
+		fds++;
+
+		for (k = 0; k < dev->nevfd; k++, fds++)
+		{
+			pfd[fds].events = POLLIN;
+			pfd[fds].fd = dev->evfd[k];
+			pfd[fds].revents = 0;
+		}
+	}
+
+	if (!fds)
+		return 0;
+
+	/* How long the application went without polling */
+	if (stall_poll_gap_ns)
+	{
+		unsigned long long gap = ugci_now_ns() - last_poll_ns;
+
+		if (last_poll_ns && gap > stall_poll_gap_ns)
+			ugci_report_stall(-1, UGCI_STALL_POLL_GAP, gap);
+	}
+
+	/* Wake up in time for the next deadline of a pipeline stage */
+	if ((deadline = ugci_pipe_deadline()))
+	{
+		unsigned long long now = ugci_now_ns();
+		unsigned long long left = deadline > now ? deadline - now : 0;
+
+		if (!timeout || left < ugci_ts_to_nsec(timeout))
+		{
+			ugci_nsec_to_ts(left, &deadline_ts);
+			timeout = &deadline_ts;
+		}
+	}
+
+	start = ugci_pipe_clock();
+
+	/* With the reader thread running, it does the hiddev reading for
+	 * us. The evdev nodes are still read here, so we wait on them along
+	 * with the reader. */
+	if (ugci_reader_running())
+	{
+		struct pollfd evpfd[UGCI_MAX_DEVS * UGCI_MAX_EVDEV];
+		int nev = 0;
+
+		for (i = 0; i < UGCI_MAX_DEVS; i++)
+		{
+			if (!(dev = get_dev_info(i)))
+				continue;
+
+			for (k = 0; k < dev->nevfd; k++, nev++)
+			{
+				evpfd[nev].fd = dev->evfd[k];
+				evpfd[nev].events = POLLIN;
+			}
+		}
+
+		if ((rd = ugci_reader_collect(evpfd, nev, timeout)) < 0)
+			return -1;
+		rd += ugci_read_evdevs();
+		if (reads)
+			*reads = rd;
+	}
+	else
+	{
+		unsigned long long left = timeout ? ugci_ts_to_nsec(timeout) : 0;
+		struct timespec ts;
+
+		/* Spin first if busy polling, then sleep for what is left */
+		if (!(rd = ugci_spin_poll(pfd, fds, timeout ? &left : NULL)))
+		{
+			ugci_nsec_to_ts(left, &ts);
+			rd = ppoll(pfd, fds, timeout ? &ts : NULL, NULL);
+		}
+
+		if (rd > 0)
+		{
+			rd = ugci_read_evdevs();
+			rd += ugci_read_batches(pfd, fds);
+			if (reads)
+				*reads = rd;
+		}
+	}
+
+	ugci_pipe_account(UGCI_STAGE_READ, start, rd > 0 ? rd : 0);
+
+	start = ugci_pipe_clock();
+	ugci_dispatch_batches();
+
+	for (i = 0; i < UGCI_MAX_DEVS; i++)
+		if ((dev = get_dev_info(i)) && __atomic_load_n(&dev->resync, __ATOMIC_RELAXED))
+			ugci_resync_dev(dev);
+
+	ugci_pipe_account(UGCI_STAGE_DECODE, start, 0);
+
+	events = ugci_pipe_flush(ugci_now_ns());
+
+	/* Now check watchdog timer */
+	ugci_pet_watchdogs();
+
+	if (stall_poll_gap_ns)
+		last_poll_ns = ugci_now_ns();
+
+	return events;
+}
+
+int ugci_poll(int timeout)
+{
+	struct timespec ts;
+
+	if (timeout < 0)
+		return ugci_poll_ts(NULL, NULL);
+
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000L;
+
+	return ugci_poll_ts(&ts, NULL);
+}
+
+void ugci_set_jit_margin(unsigned int margin_us)
+{
+	jit_margin_ns = (unsigned long long)margin_us * 1000;
+}
+
+int ugci_sample_frame(unsigned long long deadline_ns, struct ugci_state *state)
+{
+	struct ugci_state snap;
+	struct timespec ts;
+	unsigned long long now, ns;
+	int i, ret, reads, events = 0;
+
+	if (!initialized)
+		return -1;
+
+	/* In just-in-time mode, keep servicing events until shortly before
+	 * the deadline, so the snapshot is as fresh as possible. */
+	if (jit_margin_ns)
+	{
+		while ((now = ugci_now_ns()) + jit_margin_ns < deadline_ns)
+		{
+			ugci_nsec_to_ts(deadline_ns - jit_margin_ns - now, &ts);
+
+			if ((ret = ugci_poll_ts(&ts, NULL)) < 0)
+				return -1;
+
+			events += ret;
+		}
+	}
+
+	/* Drain whatever is already queued, but never past the deadline */
+	ts.tv_sec = ts.tv_nsec = 0;
+	do {
+		if ((ret = ugci_poll_ts(&ts, &reads)) < 0)
+			return -1;
+
+		events += ret;
+	} while (reads && ugci_now_ns() < deadline_ns);
+
+	memset(&snap, 0, sizeof(snap));
+
+	for (i = 0; i < UGCI_MAX_DEVS; i++)
+	{
+		struct ugci_dev_info *dev = get_dev_info(i);
+
+		if (!dev)
+			continue;
+
+		snap.coin_count[i * 2] = dev->coin_count[0];
+		snap.coin_count[i * 2 + 1] = dev->coin_count[1];
+		snap.play[i * 2] = dev->play[0];
+		snap.play[i * 2 + 1] = dev->play[1];
+		snap.stick_x[i * 2] = dev->stick_x[0];
+		snap.stick_x[i * 2 + 1] = dev->stick_x[1];
+		snap.stick_y[i * 2] = dev->stick_y[0];
+		snap.stick_y[i * 2 + 1] = dev->stick_y[1];
+		snap.buttons[i * 2] = dev->buttons[0];
+		snap.buttons[i * 2 + 1] = dev->buttons[1];
+		snap.players = i * 2 + 2;
+
+		if ((ns = __atomic_load_n(&dev->last_read_ns, __ATOMIC_RELAXED)) > snap.input_ns)
+			snap.input_ns = ns;
+	}
+
+	snap.sample_ns = ugci_now_ns();
+	ugci_history_record(&snap);
+
+	if (state)
+		*state = snap;
 
 	return events;
 }
@@ -23,7 +23,7 @@
 extern "C" {
 #endif
 
-#define LIBUGCI_VERSION		0x000300
+#define LIBUGCI_VERSION		0x000400
 
 extern const char *ugci_event_to_name[];
 
@@ -32,8 +32,13 @@ enum ugci_event_type {
 	UGCI_EVENT_COIN,		/* Coin button */
 	UGCI_EVENT_PLAY,		/* Play button */
 	UGCI_EVENT_WD,			/* Enable WD refresh in poll */
+	UGCI_EVENT_STICK,		/* Joystick moved or button changed */
+	UGCI_EVENT_EVDEV,		/* Event from the board's evdev node */
+	UGCI_EVENT_COMBO,		/* A declared input combo matched */
 };
 
+#define UGCI_EVENT_TYPES		(UGCI_EVENT_COMBO + 1)
+
 /* Maps the above enum to descriptive strings */
 extern const char *ugci_id_to_name[];
 
@@ -48,6 +53,35 @@ extern const char *ugci_id_to_name[];
 /* The play button event sends 1 for press and 0 for release.  */
 #define UGCI_EVENT_MASK_PLAY	0x0002
 
+/* The stick event is sent when a player's joystick position or any of its
+ * buttons change. It sends the button bitmask, bit 0 being button 1. The
+ * position is available from ugci_sample_frame(). Joysticks are normally
+ * handled by the input layer, so this is only of use for reading the
+ * whole panel through libugci.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+#define UGCI_EVENT_MASK_STICK	0x0004
+
+/* With this in the mask, ugci_init() also opens the evdev nodes the input
+ * layer created for each board, found through sysfs as the ones on the
+ * same USB interface, and ugci_poll() reads them along with hiddev. Their
+ * key, axis and relative events are only delivered through the callback
+ * set with ugci_set_event_callback(), as they do not fit the plain one.
+ * This gives a single input stream per cabinet, in one poll loop and on
+ * one clock. The game can still open the evdev nodes itself. With the
+ * reader thread running, ugci_poll() waits on the evdev nodes along with
+ * the reader thread, so either one wakes it.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+#define UGCI_EVENT_MASK_EVDEV	0x0008
+
+/* The combo event is sent when one of the combos declared with
+ * ugci_combo_add() matches. It sends the combo's ID, and the ID of the
+ * event is the lowest player in the combo's first step.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+#define UGCI_EVENT_MASK_COMBO	0x0010
+
 /* Prototype for the user supplied callback. This is called everytime an
  * event that matches the event mask is received. The ID is basically the
  * player number, base 0. The first UGCI device can send ID's 0 and 1,
@@ -55,6 +89,33 @@ extern const char *ugci_id_to_name[];
  * on the event. See the above mask defines for explanations of each.  */
 typedef void (*ugci_callback_t)(int id, enum ugci_event_type type, int value);
 
+/* Timestamped events, for ugci_set_event_callback(). The time is
+ * CLOCK_MONOTONIC nanoseconds, as returned by ugci_now_ns(). For evdev
+ * events it is the kernel's timestamp. hiddev does not timestamp events,
+ * so for the others it is the time libugci read them. ugci_poll() merges
+ * all of them on that time. For evdev events, id is the board's first
+ * player ID, and ev_type, code and value are those of the input event.
+ * For the others, ev_type and code are 0, and id and value are as for
+ * the plain callback.
+ *
+ * When an event callback is set, it receives every event instead of the
+ * plain callback. Pass NULL to go back to the plain one. The event mask
+ * given to ugci_init() applies to both.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+struct ugci_event {
+	unsigned long long time_ns;
+	int id;
+	enum ugci_event_type type;
+	unsigned short ev_type;
+	unsigned short code;
+	int value;
+};
+
+typedef void (*ugci_event_callback_t)(const struct ugci_event *ev);
+
+void ugci_set_event_callback(ugci_event_callback_t cb);
+
 /* Initializes the internal handlers. This will probe for UGCI devices and
  * open them. Returns the number of UGCI devices successfully probed and
  * opened. So the number of available players is twice this number. The
@@ -72,6 +133,22 @@ int ugci_init(ugci_callback_t cb, unsigned int mask, int info);
 /* Shutdown and close the UGCI system. */
 void ugci_close(void);
 
+/* Drive the boards through usbfs instead of hiddev, for cabinets where
+ * usbhid can be taken off them. ugci_init() then looks for boards under
+ * /dev/bus/usb, detaches usbhid from the player interface of each and
+ * talks to it directly: the board's report descriptor and reports are
+ * parsed by libugci, several interrupt transfers are kept queued so a
+ * report never waits on the one before it being handed over, and the
+ * reports libugci fetches or sends go through control transfers. This
+ * takes the usbhid and hiddev layers out of the input path. Everything
+ * works as it does with hiddev, except UGCI_EVENT_MASK_EVDEV, as the
+ * input layer loses the board along with usbhid. ugci_close() gives the
+ * boards back to usbhid. Must be set before ugci_init(), and needs write
+ * access to the usbfs nodes.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+void ugci_set_usbfs(int enable);
+
 /* Returns libugci's compiled version */
 unsigned int ugci_get_version(void);
 
@@ -79,13 +156,360 @@ unsigned int ugci_get_version(void);
  * to ugci_init(). The timeout is the same usage as poll(2). That is
  * timeout in milliseconds. Less than zero means infinite. This will
  * trigger callbacks if any events are read that match the mask. Returns
- * the number of events processed. */
+ * the number of events processed.
+ *
+ * Events from several devices are delivered in the order libugci saw
+ * them, not in device order. Each read is stamped with the time poll
+ * reported the device readable, and the reads of all devices are merged
+ * on that timestamp, with evdev events merged in on their own. Reads with
+ * equal timestamps go to the lower device first, a device's hiddev reads
+ * go before its evdev events of the same time, and events from a single
+ * read keep the order the kernel reported them in.
+ *
+ * Neither hiddev nor usbfs timestamp events, so the order is only as fine
+ * as libugci's wakeups: events that were already queued on several
+ * devices when the poll woke up share a timestamp, and go in device order
+ * however far apart they arrived. That can not be fixed from user space.
+ * The reader thread wakes as soon as any device has data, which narrows
+ * this to its wakeup latency; without it, the window is the time since
+ * the last ugci_poll(). */
 int ugci_poll(int timeout);
 
+/* Maximum number of players across all UGCI devices */
+#define UGCI_MAX_PLAYERS	8
+
+/* Snapshot of all player inputs, as returned by ugci_sample_frame(). All
+ * times are CLOCK_MONOTONIC nanoseconds, as returned by ugci_now_ns(). */
+struct ugci_state {
+	unsigned long long sample_ns;	/* When the snapshot was taken */
+	unsigned long long input_ns;	/* Newest read included, 0 if none */
+	unsigned int frame;		/* History frame number, see below */
+	int players;			/* Valid entries in the arrays below */
+	unsigned short coin_count[UGCI_MAX_PLAYERS];
+	unsigned char play[UGCI_MAX_PLAYERS];
+	short stick_x[UGCI_MAX_PLAYERS];
+	short stick_y[UGCI_MAX_PLAYERS];
+	unsigned char buttons[UGCI_MAX_PLAYERS];
+};
+
+/* Returns the current CLOCK_MONOTONIC time in nanoseconds. Use this to
+ * compute deadlines for ugci_sample_frame(). */
+unsigned long long ugci_now_ns(void);
+
+/* Frame synchronous sampling, meant to be called once per emulated frame.
+ * Drains all pending events (triggering callbacks as ugci_poll() does),
+ * but stops draining once deadline_ns has passed. Then fills in state,
+ * which may be NULL, with a consistent snapshot of every player. Returns
+ * the number of events processed, or less than zero on error.
+ *
+ * If a just-in-time margin is set with ugci_set_jit_margin(), this will
+ * instead keep servicing events until margin_us before the deadline, and
+ * then sample. Set the margin to cover the time your frame needs after
+ * sampling its input. A margin of 0 disables it, which is the default.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+int ugci_sample_frame(unsigned long long deadline_ns, struct ugci_state *state);
+void ugci_set_jit_margin(unsigned int margin_us);
+
+/* Resampled axis streams, meant for the wheel and yoke of the DRIVING
+ * and FLYING boards, whose axes report at irregular USB rates. Subscribe
+ * to one of a player's joystick axes with the game's tick rate, then
+ * call ugci_axis_read() once per tick with the tick's time (from
+ * ugci_now_ns()) to get a single value. Values are interpolated between
+ * the raw reports at one tick in the past, so the stream lags the raw
+ * axis by a tick but moves smoothly. With latest set, the newest raw
+ * value is used as is instead.
+ *
+ * smoothing adds an exponential filter on top, applied once per read:
+ * 0 disables it, and values up to 65535 smooth more heavily (each read
+ * moves (65536 - smoothing) / 65536 of the way to the new value).
+ * ugci_axis_read() returns less than zero if the axis is not subscribed.
+ * Pass a NULL config to unsubscribe. The raw values are collected by
+ * ugci_poll() and ugci_sample_frame(), so read from the same thread.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+enum ugci_axis {
+	UGCI_AXIS_X = 0,
+	UGCI_AXIS_Y,
+	UGCI_AXES
+};
+
+struct ugci_axis_config {
+	unsigned int tick_hz;
+	unsigned int smoothing;
+	int latest;
+};
+
+int ugci_axis_subscribe(int player, enum ugci_axis axis,
+			const struct ugci_axis_config *cfg);
+int ugci_axis_read(int player, enum ugci_axis axis, unsigned long long tick_ns,
+		   int *value);
+
+/* Optional per-frame input history, for rollback and netplay. Once
+ * enabled, every ugci_sample_frame() call records one frame and stores its
+ * number in state->frame, starting from 0. The last "frames" frames (the
+ * ring is rounded up to a power of two) can then be fetched by number with
+ * ugci_history_get(), which returns less than zero if the frame was never
+ * recorded or has been overwritten. Each frame is a pair of bitsets with
+ * bit N standing for player ID N. The coin bit is set if the player's
+ * coin counter changed during that frame, and the play bit if the play
+ * button was held at the sample point. The joystick buttons held at the
+ * sample point are kept per player as well.
+ *
+ * Enabling allocates the ring once; nothing is allocated per frame. Pass
+ * 0 to disable and free it. Re-enabling restarts the frame numbers.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+struct ugci_frame_input {
+	unsigned int frame;
+	unsigned char coin;
+	unsigned char play;
+	unsigned char buttons[UGCI_MAX_PLAYERS];	/* As for the stick event */
+};
+
+int ugci_history_enable(unsigned int frames);
+int ugci_history_get(unsigned int frame, struct ugci_frame_input *input);
+
+/* Reader thread. By default ugci_poll() reads the devices itself, so
+ * input is only picked up when the application gets around to polling.
+ * ugci_start_reader() instead moves reading to a dedicated thread that
+ * queues what it reads for the next ugci_poll(), which then only has to
+ * dispatch. The thread only ever reads; callbacks, watchdog refreshes and
+ * every other request to the boards are still only made from
+ * ugci_poll() and the calls the application makes, so a hung main loop
+ * still lets the watchdog fire. Call this after ugci_init();
+ * ugci_close() stops it.
+ *
+ * The config may be NULL for a plain thread. Otherwise, policy and
+ * priority are as for sched_setscheduler(2) (SCHED_FIFO needs privileges
+ * or an RLIMIT_RTPRIO), cpu pins the thread to one CPU unless it is -1,
+ * and mlock faults in and locks the thread's stack and queue so it never
+ * takes a page fault. The thread does no allocation once started.
+ *
+ * ugci_rt_setup() applies the same settings to the calling thread, which
+ * is handy for the game's own frame loop. Both return less than zero if
+ * any of the settings could not be applied.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+struct ugci_rt_config {
+	int policy;		/* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	int priority;		/* Realtime priority, for FIFO and RR */
+	int cpu;		/* CPU to run on, or -1 for any */
+	int mlock;		/* Pre-fault and lock stack and buffers */
+};
+
+int ugci_start_reader(const struct ugci_rt_config *cfg);
+void ugci_stop_reader(void);
+int ugci_rt_setup(const struct ugci_rt_config *cfg);
+
+/* Busy polling. When the budget is non-zero, ugci_poll() (or the reader
+ * thread, if running) spins checking the devices for up to budget_us
+ * before it goes to sleep in poll(2), trading a CPU for the scheduler's
+ * wakeup latency. If active_ms is non-zero, it only spins while there has
+ * been input within the last active_ms, so a cabinet sitting in attract
+ * mode sleeps as usual and starts spinning again once someone plays. A
+ * budget of 0 disables it, which is the default.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+void ugci_set_busy_poll(unsigned int budget_us, unsigned int active_ms);
+
+/* Per device counters, for diagnostics. The ID is the device number, as
+ * for ugci_get_secblk(). Counters start at zero in ugci_init().
+ *
+ * When ugci_poll() falls behind the reader thread, for instance because a
+ * callback blocked, the reader keeps draining the device so the kernel's
+ * queue cannot overflow. What it reads while its queue is full is kept
+ * aside: coin events in order, and never dropped, while play and other
+ * events only keep their latest value. ugci_poll() delivers these once
+ * it has caught up, coins first.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+struct ugci_stats {
+	unsigned long queue_full;	/* Reads done with the queue full */
+	unsigned long spilled;		/* Coin events set aside */
+	unsigned long coalesced;	/* Events replaced by a newer value */
+
+	/* hiddev's event queue is finite, and silently loses events when the
+	 * application falls far behind. libugci resyncs with the device
+	 * when it sees a run of full reads, or a coin counter that skipped
+	 * values. Skipped coins are made up for (with their counter values)
+	 * and a changed play button, stick or joystick button is reported,
+	 * so subscribers end up in line with the device. Queued events older
+	 * than the resync are dropped where they can be recognized, which is
+	 * the case for coins. The reader thread also asks for a resync when
+	 * its overflow area has no room left for a change. */
+	unsigned long full_reads;	/* Runs of full reads seen */
+	unsigned long coin_gaps;	/* Coin counter jumps seen */
+	unsigned long stale_events;	/* Out of date coin events dropped */
+	unsigned long resyncs;
+
+	/* See ugci_set_stall_detect() */
+	unsigned long poll_gaps;
+	unsigned long slow_callbacks;
+	unsigned long late_events;
+	unsigned long long max_poll_gap_ns;
+	unsigned long long max_callback_ns;
+	unsigned long long max_event_age_ns;
+
+	/* See ugci_bridge_start() */
+	unsigned long bridge_errors;	/* Events uinput did not take */
+
+	/* See ugci_set_debounce() */
+	unsigned long bounces[2];	/* Bounces filtered out, per player */
+
+	/* See ugci_start_exporter() */
+	unsigned long events[UGCI_EVENT_TYPES];	/* Per type, before the event mask */
+	unsigned long reads;		/* Reads from the device */
+	unsigned long short_reads;	/* Reads that held no whole event */
+	unsigned long disables;		/* The device was disabled */
+	unsigned long wd_pets;		/* Runtime watchdog refreshes */
+	unsigned long ioctls[3];	/* Per HID report type: input, output, feature */
+	unsigned long long ioctl_ns[3];
+	unsigned long callbacks;
+	unsigned long long callback_ns;
+};
+
+int ugci_get_stats(int id, struct ugci_stats *stats);
+
+/* Serves the counters above, for every device found by ugci_init(), in
+ * the Prometheus text format. A thread listens for HTTP requests for
+ * /metrics on either a Unix socket, when the address starts with a '/',
+ * or a TCP port on the loopback address, when it is a port number such
+ * as "9231". A socket left over at that path is replaced. The thread only
+ * reads the counters, which are updated atomically, so a scrape never
+ * holds up ugci_poll() or the reader thread. The time spent in report
+ * ioctls and callbacks is only measured while the exporter runs.
+ *
+ * Returns less than zero if the address is invalid or could not be
+ * bound. ugci_close() stops the exporter.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+int ugci_start_exporter(const char *addr);
+void ugci_stop_exporter(void);
+
+/* Events go through a pipeline of stages. Each poll, the read stage
+ * fetches what the devices have, and the decode stage turns it into an
+ * array of events, in time order. The array then runs through filters
+ * (debounce, the state update, ugci_set_changes_only(), the event mask),
+ * synthesizers that add events (combos, coin release simulation) and
+ * sinks (the uinput bridge, the callback), each taking the whole array
+ * from the one before. The chain is put together from what is
+ * configured, so a stage that is not in use costs nothing.
+ *
+ * ugci_get_stage_stats() fills in up to max entries, one per stage in
+ * pipeline order, and returns the number of stages. Runs and events (what
+ * each stage passed on) are always counted. The time spent in each stage
+ * is only measured after ugci_set_stage_timing() has enabled it, as it
+ * takes two clock reads per stage and poll. Counters start at zero in
+ * ugci_init().
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+struct ugci_stage_stats {
+	const char *name;
+	int enabled;			/* Part of the chain right now */
+	unsigned long runs;
+	unsigned long events;		/* Events passed on */
+	unsigned long dropped;		/* Events the pipeline had no room for */
+	unsigned long long ns;		/* Time spent */
+};
+
+int ugci_get_stage_stats(struct ugci_stage_stats *stats, int max);
+void ugci_set_stage_timing(int enable);
+
+/* Stall detection. Each threshold, when non-zero, enables one check:
+ *
+ *   poll_gap_us:  time between the end of one ugci_poll() (or
+ *                 ugci_sample_frame()) and the start of the next
+ *   callback_us:  time spent in a single call of the event callback
+ *   event_age_us: time from reading an event off the device until it is
+ *                 dispatched, which grows when the reader thread gets
+ *                 ahead of ugci_poll()
+ *
+ * Every time a threshold is exceeded, the matching ugci_stats counter is
+ * bumped, its maximum updated, and cb (if not NULL) is called with the
+ * device ID (-1 for poll gaps, which affect all devices) and the
+ * offending duration. cb is called from within ugci_poll(). A stalled
+ * game thread shows up here as poll gaps long before anyone notices
+ * "sticky" buttons.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+enum ugci_stall_type {
+	UGCI_STALL_POLL_GAP = 1,
+	UGCI_STALL_CALLBACK,
+	UGCI_STALL_EVENT_AGE,
+};
+
+typedef void (*ugci_stall_callback_t)(int id, enum ugci_stall_type type,
+				      unsigned long long duration_ns);
+
+void ugci_set_stall_detect(ugci_stall_callback_t cb, unsigned int poll_gap_us,
+			   unsigned int callback_us, unsigned int event_age_us);
+
+/* uinput bridge, for emulators that only read evdev or SDL devices. This
+ * creates a virtual keyboard, or gamepad, for each player, named "UGCI
+ * Player N", and injects its coin and play events straight from the
+ * event pipeline, before the callback runs. Coin events become a key
+ * press and release in the same instant, or follow the simulated release
+ * if ugci_set_coin_simulate() is used. Emulators that sample keys once a
+ * frame, MAME among them, miss the former, so set a coin release time of
+ * at least a couple of frames with the bridge. The bridge comes before
+ * the event mask, so it works whatever mask was given to ugci_init().
+ *
+ * Each key event is preceded by an MSC_TIMESTAMP event holding the time
+ * libugci read it, in microseconds of CLOCK_MONOTONIC truncated to 32
+ * bits, as uinput stamps events with the time they were injected.
+ *
+ * The keys are Linux key codes (see linux/input-event-codes.h), and 0
+ * picks the default: as keyboards, KEY_5 to KEY_8 for coin and KEY_1 to
+ * KEY_4 for play, for players 1 to 4, as in MAME, and nothing for the
+ * others; as gamepads, BTN_SELECT for coin and BTN_START for play. A
+ * player with neither key mapped gets no device. cfg may be NULL for all
+ * defaults. ugci_bridge_devnode() gives the /dev/input path of a
+ * player's device. Returns less than zero if /dev/uinput can not be used.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+struct ugci_bridge_config {
+	int gamepad;
+	unsigned short coin[UGCI_MAX_PLAYERS];
+	unsigned short play[UGCI_MAX_PLAYERS];
+};
+
+int ugci_bridge_start(const struct ugci_bridge_config *cfg);
+void ugci_bridge_stop(void);
+int ugci_bridge_devnode(int player, char *buf, int len);
+
+/* Report mode. By default, events are decoded one usage at a time, as
+ * hiddev reports each changed field. In report mode, libugci instead
+ * waits for hiddev's end of report notification, then fetches and decodes
+ * the entire report at once. A joystick report then produces a single
+ * stick event however many of its fields changed, and snapshots never
+ * see a half updated report. This costs a couple of ioctls per report, so
+ * it pays off for stick heavy traffic. Can be switched at any time.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+void ugci_set_report_mode(int enable);
+
+/* Play and stick events are delivered as hiddev hands them over, which
+ * for play and the stick buttons in the default mode means on every
+ * report, changed or not. With this enabled, a filter stage drops the
+ * play and stick events that change neither the button state nor the
+ * stick position. Off by default. Can be switched at any time.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+void ugci_set_changes_only(int enable);
+
 /* Get the coin count for a particular Player ID. ID is the same as would
  * be passed to the callback routine. */
 int ugci_get_coin_count(int id, unsigned short *count);
 
+/* Get the coin counts of all players on all devices in one call. counts
+ * is indexed by player ID, and holds n entries. Entries for players on
+ * devices that have gone away are set to 0. Returns the number of players
+ * filled in, or less than zero on error.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+int ugci_get_coin_counts(unsigned short counts[], int n);
+
 /* This will simulate a release event for the coin button. Internally, the
  * coin button only returns press events, since it is really just an
  * absolute counter. Setting the wait time, will produce a release event
@@ -109,6 +533,16 @@ void ugci_set_coin_simulate(int wait_time);
 int ugci_set_secblk(int id, unsigned char values[UGCI_SEC_VALUES]);
 int ugci_get_secblk(int id, unsigned char values[UGCI_SEC_VALUES]);
 
+/* The security block is cached once read, and updated by a successful
+ * ugci_set_secblk(), so repeated reads cost nothing. The cache starts out
+ * empty in ugci_init(). Verification tools that need to see what the
+ * device itself holds should disable the cache; ugci_set_secblk() then
+ * re-reads the block from the device after writing it, as it did before
+ * 0.4. Enabled by default.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+void ugci_set_secblk_cache(int enable);
+
 
 /* Start a watchdog thread. The seconds is what is reported to UGCI. The
  * watchdog timer will trigger if we do not send a watchdog event for this
@@ -123,6 +557,32 @@ int ugci_set_watchdog(int id, int type, unsigned short seconds);
 #define UGCI_WD_RUNTIME		2
 
 
+/* Prepared requests, for monitoring code that issues the same request
+ * over and over. ugci_prepare() builds everything the request needs once,
+ * and ugci_exec() then only has to issue the ioctls. The ID is a player
+ * ID for the coin and play ops, and a device ID for the others. Returns
+ * NULL if the ID or op is invalid. Results are stored in values, one per
+ * entry: the counter for coin, 1 or 0 for play, and UGCI_SEC_VALUES bytes
+ * for the security block. The watchdog op instead takes the runtime timer
+ * interval from values[0], like ugci_set_watchdog(). ugci_exec() returns
+ * the number of values stored, or less than zero on error. Requests must
+ * be freed with ugci_free_request() before ugci_close().
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+enum ugci_op {
+	UGCI_OP_COIN_COUNT,
+	UGCI_OP_PLAY,
+	UGCI_OP_SECBLK,
+	UGCI_OP_WATCHDOG,
+};
+
+struct ugci_request;
+
+struct ugci_request *ugci_prepare(int id, enum ugci_op op);
+int ugci_exec(struct ugci_request *req, int *values);
+void ugci_free_request(struct ugci_request *req);
+
+
 /* Keyboard boot mode. "mode" is one of the below settings. See section
  * 4.6 of the HAPP UGCI Spec. */
 int ugci_kbd_mode(int id, int mode, unsigned char delay);
@@ -133,9 +593,177 @@ int ugci_kbd_mode(int id, int mode, unsigned char delay);
 
 
 /* Get the contents of the eeprom. data must be able to hold atleast 504
- * bytes. The actual length of data is returned in *len. */
+ * bytes. The actual length of data is returned in *len. The eeprom is
+ * read from the device on the first call, and cached after that. */
 int ugci_get_eeprom(int id, unsigned char *data, int *len);
 
+/* What ugci_set_eeprom() changed, what it actually sent to the device,
+ * and how long it took including the read-back. */
+struct ugci_eeprom_result {
+	int bytes_changed;
+	int bytes_sent;
+	unsigned long long time_ns;
+};
+
+/* Program the first len bytes of the eeprom with data. The new image is
+ * compared against the cached copy, and if nothing differs the device is
+ * not touched at all. Otherwise the whole image is sent, as hiddev has no
+ * way to send part of a report, so a single changed byte still rewrites
+ * every byte the board keeps; bytes_sent says so. Afterwards the eeprom
+ * is read back, and the copy returned by ugci_get_eeprom() is updated
+ * from it. Returns -1 with errno set to EIO if the read-back does not
+ * match data, and to EINVAL if len is larger than the eeprom or data
+ * would change the size or board type bits in the first byte. result may
+ * be NULL.
+ *
+ * The image is written with the same feature report it is read from
+ * (82). The UGCI spec does not document it as writable, and this has not
+ * been checked against a board, so keep a copy from ugci_get_eeprom()
+ * first; the read-back at least tells whether the write took.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+int ugci_set_eeprom(int id, const unsigned char *data, int len,
+		    struct ugci_eeprom_result *result);
+
+/* The keyboard mapping held in the eeprom. Each player input can be
+ * mapped to a HID keyboard usage (0x04 is 'a', see the HID usage tables)
+ * plus a mask of HID modifiers (0x01 left ctrl, 0x02 left shift, ...).
+ * A zero usage leaves the input unmapped. Players are numbered per
+ * device here, 0 and 1.
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+enum ugci_input {
+	UGCI_INPUT_COIN = 0,
+	UGCI_INPUT_PLAY,
+	UGCI_INPUT_UP,
+	UGCI_INPUT_DOWN,
+	UGCI_INPUT_LEFT,
+	UGCI_INPUT_RIGHT,
+	UGCI_INPUT_BUTTON_1,
+	UGCI_INPUT_BUTTON_2,
+	UGCI_INPUT_BUTTON_3,
+	UGCI_INPUT_BUTTON_4,
+	UGCI_INPUT_BUTTON_5,
+	UGCI_INPUT_BUTTON_6,
+	UGCI_INPUT_BUTTON_7,
+	UGCI_INPUTS
+};
+
+struct ugci_key {
+	unsigned char modifiers;
+	unsigned char usage;
+};
+
+struct ugci_keymap {
+	int enabled;
+	struct ugci_key key[2][UGCI_INPUTS];
+};
+
+/* Decode the key map from the cached eeprom. Only the enable bit is
+ * documented; where the entries sit is a guess that has not been checked
+ * against a real board, so treat them as unverified. For the same reason
+ * there is no call to program a key map. */
+int ugci_get_keymap(int id, struct ugci_keymap *map);
+
+/* The key map of every device is compiled into a table indexed by
+ * player (0 to UGCI_MAX_PLAYERS - 1, as in events) and input, kept up to
+ * date as the eeprom is programmed. A device's table is built whenever
+ * its eeprom is read; if nothing has read it yet, the first
+ * ugci_lookup_key() for the device does, with a control transfer on the
+ * calling thread, which like every other call must be the one calling
+ * ugci_poll(). If that read fails, the device is not tried again until
+ * ugci_init(). To keep the transfer out of the event callback, call
+ * ugci_get_keymap() once after ugci_init(). After that it is a single
+ * lookup in the table, returning the key as built by UGCI_KEY(), or 0 if
+ * the input is not mapped, the device has key mapping disabled, or its
+ * eeprom can not be read. */
+#define UGCI_KEY(mods, usage)	(((mods) << 8) | (usage))
+#define UGCI_KEY_MODS(key)	((key) >> 8)
+#define UGCI_KEY_USAGE(key)	((key) & 0xff)
+
+unsigned short ugci_lookup_key(int player, enum ugci_input input);
+
+/* Input combos, such as holding player 1's play button for 3 seconds
+ * after a coin to open a service menu. A combo is a sequence of steps,
+ * and each step is a chord: the inputs of every player that must all be
+ * held, given as a mask of UGCI_INPUT_BIT()s per player (as in events),
+ * for at least hold_ms. A step without a hold time is only taken by a
+ * press of one of its inputs made after the previous step was, so a held
+ * chord does not run through the steps that follow it, and a combo needs
+ * a fresh press to match again. A step with a hold time also counts a
+ * chord that is still held when it is reached, with the hold time
+ * starting then: "hold start, insert a coin, keep start held for 3
+ * seconds" is a step of coin and play with no hold time, then play held
+ * for 3000 ms. With timeout_ms set, each step must be taken within that
+ * long of the previous one, or the combo starts over, so a later step
+ * can not have a hold_ms of timeout_ms or more.
+ *
+ * Combos are tracked as the events come in, and ugci_poll() wakes up by
+ * itself when a hold time or timeout runs out, so there is nothing to do
+ * per frame. Whatever the event mask, the UGCI_EVENT_COMBO event is only
+ * sent when UGCI_EVENT_MASK_COMBO is in it. Only the coin, play and stick
+ * buttons can be used. Coin events are counters, so the coin counts as
+ * held only at the moment it is inserted: use it with no hold time, as a
+ * step of its own or in a chord with held buttons.
+ *
+ * ugci_combo_add() returns the combo's ID, or less than zero with errno
+ * set to EINVAL for a bad or impossible combo or ENOSPC if there are already
+ * UGCI_MAX_COMBOS. All combos are dropped by ugci_close().
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+#define UGCI_MAX_COMBOS		32
+#define UGCI_COMBO_STEPS	8
+#define UGCI_INPUT_BIT(input)	(1 << (input))
+
+struct ugci_combo_step {
+	unsigned short chord[UGCI_MAX_PLAYERS];
+	unsigned int hold_ms;
+};
+
+struct ugci_combo {
+	int steps;
+	struct ugci_combo_step step[UGCI_COMBO_STEPS];
+	unsigned int timeout_ms;	/* Between steps, 0 for none */
+};
+
+int ugci_combo_add(const struct ugci_combo *combo);
+int ugci_combo_remove(int id);
+void ugci_combo_clear(void);
+
+/* Debounce for worn switches. Each play or stick button can be given
+ * its own windows, for one player (as in events) or, with a player less
+ * than zero, for all of them; a NULL config turns it off again. Inputs
+ * are filtered as they are decoded, before anything else sees them, so
+ * subscribers, ugci_sample_frame(), combos and the uinput bridge all get
+ * the same debounced state. There are no timers: each change is checked
+ * against the time of the last one, and ugci_poll() wakes up by itself
+ * when a change held back by a window is due.
+ *
+ * In UGCI_DEBOUNCE_LOCKOUT mode, a change goes through at once, and the
+ * input then ignores bounces for press_us after a press or release_us
+ * after a release. If the input ended up changed at the end of the
+ * window, that is reported then. In UGCI_DEBOUNCE_ASYMMETRIC mode, a
+ * press goes through at once (and holds for at least press_us), while a
+ * release is only reported once the switch has stayed open for
+ * release_us, which suits contacts that chatter while held down.
+ *
+ * Each time an input goes back to what was reported before its window
+ * ran out, that bounce is counted in the ugci_stats of its device.
+ * Settings are dropped by ugci_close().
+ *
+ * NOTE: Introduced in the 0.4 version of libugci.  */
+#define UGCI_DEBOUNCE_LOCKOUT		0
+#define UGCI_DEBOUNCE_ASYMMETRIC	1
+
+struct ugci_debounce_config {
+	unsigned int press_us;
+	unsigned int release_us;
+	int mode;
+};
+
+int ugci_set_debounce(int player, enum ugci_input input,
+		      const struct ugci_debounce_config *cfg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Loader for ugci-hid.bpf.c. For every UGCI board (or the one given), it
+ * reads the report descriptor from sysfs, rewrites the coin and play
+ * usages of each player report into keyboard usages, and attaches the
+ * HID-BPF program with the result. The board is then reprobed, and coin
+ * and play come out of its evdev node as keys: 5 to 8 for coin and 1 to
+ * 4 for play for players 1 to 4, as in MAME, and F5 to F8 and F1 to F4
+ * for players 5 to 8. Boards are numbered in the order the kernel found
+ * them, also when only one is named. The links are pinned under
+ * /sys/fs/bpf/ugci, so nothing needs to keep running; --remove unpins
+ * them again. Build with "make bpf".
+ *
+ * The player reports stop being the Happ player application, so libugci
+ * no longer recognises a board while the program is attached: there is
+ * no watchdog, security block or eeprom access to it through libugci,
+ * and the coin field hiddev sees is the key, not the counter. Use
+ * --remove to get the board back. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <glob.h>
+#include <limits.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include <linux/types.h>
+#include <bpf/libbpf.h>
+
+#include "ugci-hid.h"
+#include "ugci-hid.skel.h"
+
+#define PIN_DIR		"/sys/fs/bpf/ugci"
+
+#define UGCI_PLAYER_APP		0x910002
+#define UGCI_PLAYER_1_REPORT	3
+#define UGCI_PLAYER_2_REPORT	4
+#define UGCI_PLAYER_UCODE_COIN	0x910035
+#define UGCI_PLAYER_UCODE_PLAY	0x910036
+
+#define HID_KEYBOARD_APP	0x010006
+#define HID_KEY_1		0x1e
+#define HID_KEY_5		0x22
+#define HID_KEY_F1		0x3a
+#define HID_KEY_F5		0x3e
+
+static int verbose;
+
+/* HID keyboard usage for a player's coin or play key */
+static unsigned int player_key(int player, int coin)
+{
+	if (player < 4)
+		return 0x070000 | ((coin ? HID_KEY_5 : HID_KEY_1) + player);
+
+	return 0x070000 | ((coin ? HID_KEY_F5 : HID_KEY_F1) + player - 4);
+}
+
+/* Copies the descriptor, replacing the coin and play usages (and the
+ * player application's) with extended usages for the keys, and notes
+ * where the coin counters sit. Returns the new size, or -1. */
+static int rewrite_rdesc(const unsigned char *in, int len, unsigned char *out,
+			 int board, struct ugci_hid_layout *layout)
+{
+	unsigned int page = 0, rsize = 0, rcount = 0, rid = 0;
+	unsigned int usages[64], offsets[256];
+	int nusages = 0, i = 0, o = 0, found = 0;
+
+	memset(offsets, 0, sizeof(offsets));
+
+	while (i < len) {
+		unsigned char b = in[i];
+		int size = (b & 3) == 3 ? 4 : (b & 3);
+		int type = (b >> 2) & 3, tag = b >> 4, t;
+		unsigned int value = 0, usage = 0;
+
+		/* Long items are copied as they are */
+		if (b == 0xfe) {
+			size = i + 1 < len ? in[i + 1] + 3 : len;
+			if (i + size > len || o + size > UGCI_HID_RDESC_MAX)
+				return -1;
+			memcpy(out + o, in + i, size);
+			i += size;
+			o += size;
+			continue;
+		}
+
+		if (i + 1 + size > len)
+			return -1;
+
+		for (t = 0; t < size; t++)
+			value |= in[i + 1 + t] << (8 * t);
+
+		if (type == 2 && tag == 0) {
+			/* Local usage */
+			usage = size == 4 ? value : (page << 16) | value;
+			if (nusages < 64)
+				usages[nusages++] = usage;
+
+			if (usage == UGCI_PLAYER_APP)
+				usage = HID_KEYBOARD_APP;
+			else if ((usage == UGCI_PLAYER_UCODE_COIN || usage == UGCI_PLAYER_UCODE_PLAY) &&
+				 (rid == UGCI_PLAYER_1_REPORT || rid == UGCI_PLAYER_2_REPORT))
+				usage = player_key(board * 2 + rid - UGCI_PLAYER_1_REPORT,
+						   usage == UGCI_PLAYER_UCODE_COIN);
+			else
+				usage = 0;
+
+			if (usage) {
+				if (o + 5 > UGCI_HID_RDESC_MAX)
+					return -1;
+				out[o++] = 0x0b;
+				for (t = 0; t < 4; t++)
+					out[o++] = usage >> (8 * t);
+				i += 1 + size;
+				continue;
+			}
+		} else if (type == 1) {
+			/* Globals we need to follow the report layout */
+			if (tag == 0)
+				page = value;
+			else if (tag == 7)
+				rsize = value;
+			else if (tag == 8)
+				rid = value & 0xff;
+			else if (tag == 9)
+				rcount = value;
+		} else if (type == 0) {
+			if (tag == 8) {
+				/* Input: work out where each usage landed */
+				for (t = 0; t < (int)rcount && nusages; t++) {
+					unsigned int u = usages[t < nusages ? t : nusages - 1];
+					int p = rid - UGCI_PLAYER_1_REPORT;
+
+					if (u != UGCI_PLAYER_UCODE_COIN || p < 0 || p > 1 || !(value & 2))
+						continue;
+
+					layout->report_id[p] = rid;
+					layout->coin_offset[p] = offsets[rid] + t * rsize;
+					layout->coin_size[p] = rsize;
+					found |= 1 << p;
+				}
+				offsets[rid] += rsize * rcount;
+			}
+			nusages = 0;
+		}
+
+		if (o + 1 + size > UGCI_HID_RDESC_MAX)
+			return -1;
+		memcpy(out + o, in + i, 1 + size);
+		i += 1 + size;
+		o += 1 + size;
+	}
+
+	if (verbose)
+		printf("  coin fields found for player%s %s%s\n", found == 3 ? "s" : "",
+		       found & 1 ? "1 " : "", found & 2 ? "2" : "");
+
+	return found ? o : -1;
+}
+
+static int attach(const char *sysdir, int board)
+{
+	unsigned char in[UGCI_HID_RDESC_MAX], out[UGCI_HID_RDESC_MAX];
+	char path[PATH_MAX];
+	const char *name = strrchr(sysdir, '/') + 1;
+	struct ugci_hid_layout layout;
+	struct ugci_hid *skel;
+	struct bpf_link *link;
+	unsigned int hid_id;
+	int len, size;
+	FILE *fp;
+
+	/* The HID id is the part after the last dot, in hex */
+	if (sscanf(strrchr(name, '.') + 1, "%x", &hid_id) != 1)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/report_descriptor", sysdir);
+	if (!(fp = fopen(path, "rb"))) {
+		perror(path);
+		return -1;
+	}
+	len = fread(in, 1, sizeof(in), fp);
+	fclose(fp);
+
+	memset(&layout, 0, sizeof(layout));
+	if ((size = rewrite_rdesc(in, len, out, board, &layout)) < 0) {
+		fprintf(stderr, "%s: no UGCI player reports found\n", name);
+		return -1;
+	}
+
+	if (!(skel = ugci_hid__open())) {
+		fprintf(stderr, "%s: could not open the BPF program\n", name);
+		return -1;
+	}
+
+	skel->rodata->layout = layout;
+	skel->rodata->rdesc_size = size;
+	memcpy((void *)skel->rodata->rdesc, out, size);
+	skel->struct_ops.ugci_hid->hid_id = hid_id;
+
+	if (ugci_hid__load(skel) ||
+	    !(link = bpf_map__attach_struct_ops(skel->maps.ugci_hid))) {
+		fprintf(stderr, "%s: could not load the BPF program\n", name);
+		ugci_hid__destroy(skel);
+		return -1;
+	}
+
+	mkdir(PIN_DIR, 0755);
+	snprintf(path, sizeof(path), PIN_DIR "/%s", name);
+	if (bpf_link__pin(link, path)) {
+		fprintf(stderr, "%s: could not pin to %s\n", name, path);
+		bpf_link__destroy(link);
+		ugci_hid__destroy(skel);
+		return -1;
+	}
+
+	printf("%s: attached, players %d and %d\n", name, board * 2 + 1, board * 2 + 2);
+
+	/* The pinned link keeps the program alive after we exit */
+	bpf_link__disconnect(link);
+	bpf_link__destroy(link);
+	ugci_hid__destroy(skel);
+
+	return 0;
+}
+
+/* HID devices are numbered as the kernel finds them, in hex after the
+ * last dot */
+static int cmp_hid_id(const void *a, const void *b)
+{
+	unsigned long x = strtoul(strrchr(*(char * const *)a, '.') + 1, NULL, 16);
+	unsigned long y = strtoul(strrchr(*(char * const *)b, '.') + 1, NULL, 16);
+
+	return x < y ? -1 : x > y;
+}
+
+static void usage(int exitval) __attribute__((__noreturn__));
+static void usage(int exitval)
+{
+	fprintf(exitval ? stderr : stdout, "Usage: ugcibpf [--help] [--verbose] "
+		"[--remove] [hid device, e.g. 0003:078B:0030.0001]\n"
+		"Attached boards are hidden from libugci until removed again.\n");
+	exit(exitval);
+}
+
+int main(int argc, char *argv[])
+{
+	int remove = 0, failed = 0, found = 0;
+	char pattern[PATH_MAX];
+	size_t i;
+	glob_t g;
+
+	while (1) {
+		int c;
+		static struct option long_options[] = {
+			{"help",	0, NULL, 'h'},
+			{"verbose",	0, NULL, 'v'},
+			{"remove",	0, NULL, 'r'},
+			{ 0 },
+		};
+
+		c = getopt_long(argc, argv, "hvr", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'h':
+				usage(0);
+				break;
+
+			case 'v':
+				verbose = 1;
+				break;
+
+			case 'r':
+				remove = 1;
+				break;
+
+			default:
+				usage(1);
+		}
+	}
+
+	if (argc - optind > 1)
+		usage(1);
+
+	if (remove) {
+		snprintf(pattern, sizeof(pattern), PIN_DIR "/%s",
+			 optind < argc ? argv[optind] : "*");
+		if (!glob(pattern, 0, NULL, &g)) {
+			for (i = 0; i < g.gl_pathc; i++)
+				if (unlink(g.gl_pathv[i]))
+					perror(g.gl_pathv[i]);
+			globfree(&g);
+		}
+		exit(0);
+	}
+
+	/* Every Happ board, in the order the kernel found them. A board
+	 * given by name still gets the players its place there gives it. */
+	if (glob("/sys/bus/hid/devices/*:078B:00[123]0.*", 0, NULL, &g)) {
+		fprintf(stderr, "No UGCI boards found\n");
+		exit(1);
+	}
+
+	qsort(g.gl_pathv, g.gl_pathc, sizeof(*g.gl_pathv), cmp_hid_id);
+
+	for (i = 0; i < g.gl_pathc; i++) {
+		if (optind < argc && strcmp(strrchr(g.gl_pathv[i], '/') + 1, argv[optind]))
+			continue;
+
+		if (attach(g.gl_pathv[i], i))
+			failed = 1;
+		found = 1;
+	}
+
+	globfree(&g);
+
+	if (!found) {
+		fprintf(stderr, "%s: not a UGCI board\n", argv[optind]);
+		exit(1);
+	}
+
+	exit(failed);
+}
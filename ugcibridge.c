@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Bridge daemon: exposes every player's coin and play buttons as a uinput
+ * keyboard or gamepad, for emulators that can not link libugci. With
+ * --latency, it instead reads the virtual devices back and reports the
+ * time from the hiddev read to evdev delivery for that many events;
+ * press coin or play while it runs. With --metrics, the board counters
+ * are served for Prometheus on a Unix socket path or a loopback port.
+ *
+ * A coin is a counter, so its key is held for --simul milliseconds, 100
+ * unless given, for emulators that only look at the key once a frame to
+ * see it. --simul 0 presses and releases it at once. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sched.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+#include "ugci.h"
+
+#ifndef input_event_sec
+#define input_event_sec		time.tv_sec
+#define input_event_usec	time.tv_usec
+#endif
+
+static volatile int stop;
+
+static void handle_signal(int sig)
+{
+	stop = 1;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Reads the bridge's devices back until n key events were seen */
+static void measure(int players, int n)
+{
+	int fds[UGCI_MAX_PLAYERS], msc[UGCI_MAX_PLAYERS];
+	int *lat, i, p, count = 0;
+	long long total = 0;
+	char node[64];
+
+	if (!(lat = malloc(n * sizeof(*lat))))
+		return;
+
+	for (p = 0; p < players; p++) {
+		int clk = CLOCK_MONOTONIC;
+
+		fds[p] = -1;
+		if (ugci_bridge_devnode(p, node, sizeof(node)) ||
+		    (fds[p] = open(node, O_RDONLY | O_NONBLOCK)) < 0)
+			continue;
+		ioctl(fds[p], EVIOCSCLOCKID, &clk);
+	}
+
+	printf("Measuring %d events, press coin or play...\n", n);
+
+	while (count < n && !stop && ugci_poll(100) >= 0) {
+		for (p = 0; p < players; p++) {
+			struct input_event ev[16];
+			int rd, t;
+
+			if (fds[p] < 0 || (rd = read(fds[p], ev, sizeof(ev))) <= 0)
+				continue;
+
+			for (t = 0; t < rd / (int)sizeof(ev[0]) && count < n; t++) {
+				if (ev[t].type == EV_MSC && ev[t].code == MSC_TIMESTAMP)
+					msc[p] = ev[t].value;
+				else if (ev[t].type == EV_KEY)
+					lat[count++] = (int)((unsigned int)(ev[t].input_event_sec * 1000000 +
+							ev[t].input_event_usec) - (unsigned int)msc[p]);
+			}
+		}
+	}
+
+	for (p = 0; p < players; p++)
+		if (fds[p] >= 0)
+			close(fds[p]);
+
+	if (count) {
+		qsort(lat, count, sizeof(*lat), cmp_int);
+		for (i = 0; i < count; i++)
+			total += lat[i];
+		printf("hiddev read to evdev over %d events: min %dus avg %lldus "
+		       "p99 %dus max %dus\n", count, lat[0], total / count,
+		       lat[count * 99 / 100], lat[count - 1]);
+	}
+
+	free(lat);
+}
+
+static int parse_key(char *arg, unsigned short *keys)
+{
+	char *sep = strchr(arg, ':');
+	int player = atoi(arg) - 1;
+
+	if (!sep || player < 0 || player >= UGCI_MAX_PLAYERS)
+		return -1;
+
+	keys[player] = strtoul(sep + 1, NULL, 0);
+
+	return 0;
+}
+
+static void usage(int exitval) __attribute__((__noreturn__));
+static void usage(int exitval)
+{
+	fprintf(exitval ? stderr : stdout, "Usage: ugcibridge [--help] [--gamepad] "
+		"[--coin player:key] [--play player:key] [--simul msecs] "
+		"[--rt prio] [--latency n] [--metrics path|port]\n");
+	exit(exitval);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ugci_bridge_config cfg;
+	struct ugci_rt_config rt = { .policy = SCHED_OTHER, .cpu = -1 };
+	int rd, simul = 100, latency = 0;
+	char *metrics = NULL;
+
+	memset(&cfg, 0, sizeof(cfg));
+
+	while (1) {
+		int c;
+		static struct option long_options[] = {
+			{"help",	0, NULL, 'h'},
+			{"gamepad",	0, NULL, 'g'},
+			{"coin",	1, NULL, 'c'},
+			{"play",	1, NULL, 'p'},
+			{"simul",	1, NULL, 's'},
+			{"rt",		1, NULL, 'r'},
+			{"latency",	1, NULL, 'l'},
+			{"metrics",	1, NULL, 'm'},
+			{ 0 },
+		};
+
+		c = getopt_long(argc, argv, "hgc:p:s:r:l:m:", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'h':
+				usage(0);
+				break;
+
+			case 'g':
+				cfg.gamepad = 1;
+				break;
+
+			case 'c':
+				if (parse_key(optarg, cfg.coin))
+					usage(1);
+				break;
+
+			case 'p':
+				if (parse_key(optarg, cfg.play))
+					usage(1);
+				break;
+
+			case 's':
+				simul = atoi(optarg);
+				break;
+
+			case 'r':
+				rt.policy = SCHED_FIFO;
+				rt.priority = atoi(optarg);
+				rt.mlock = 1;
+				break;
+
+			case 'l':
+				latency = atoi(optarg);
+				break;
+
+			case 'm':
+				metrics = optarg;
+				break;
+
+			default:
+				usage(1);
+		}
+	}
+
+	if (argc != optind)
+		usage(1);
+
+	rd = ugci_init(NULL, UGCI_EVENT_MASK_COIN | UGCI_EVENT_MASK_PLAY, 1);
+
+	printf("Detected %d UGCI device%s\n", rd, rd == 1 ? "" : "s");
+
+	if (rd <= 0)
+		exit(0);
+
+	if (simul)
+		ugci_set_coin_simulate(simul);
+
+	if (rt.policy != SCHED_OTHER && ugci_rt_setup(&rt))
+		fprintf(stderr, "Could not set up realtime scheduling\n");
+
+	if (ugci_bridge_start(&cfg)) {
+		perror("ugci_bridge_start");
+		exit(1);
+	}
+
+	if (metrics && ugci_start_exporter(metrics))
+		perror("ugci_start_exporter");
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	if (latency > 0)
+		measure(rd * 2, latency);
+	else
+		while (!stop && ugci_poll(-1) >= 0)
+			/* Do nothing */;
+
+	ugci_close();
+
+	exit(0);
+}
@@ -0,0 +1,652 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Emulates the player reports of a UGCI board through uhid, for trying
+ * out ugcibpf without the hardware. hiddev only binds to real USB
+ * devices, so libugci itself will not see it. Without the HID-BPF
+ * program the kernel finds nothing it can map, and no evdev node shows
+ * up. Type "c1" for a coin or "p1"/"r1" to press/release play for
+ * player 1 (or 2). With --check, the emulator instead waits for the
+ * program to be attached, then sends coins and plays for both players
+ * and checks the keys come out of evdev.
+ *
+ * With --gadget, the board is instead a whole USB device, made through
+ * raw-gadget on dummy_hcd's UDC (modprobe dummy_hcd raw_gadget). usbhid
+ * and hiddev then bind to it as to the real board, and libugci sees it
+ * both through hiddev and through its usbfs transport; "benchugci
+ * --latency" uses this to compare the two. The gadget also has the
+ * board's two joysticks: "s1 x y buttons" moves player 1's stick (x and
+ * y from -127 to 127, buttons a mask of 7 bits), which "benchugci
+ * --decode" uses for stick heavy traffic. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <glob.h>
+#include <limits.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/uhid.h>
+#include <linux/input.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+/* Player application, page 0x91 (Arcade), as on the board: a 16 bit coin
+ * counter and a play button per player, in reports 3 and 4. */
+static const unsigned char rdesc[] = {
+	0x05, 0x91,			/* Usage Page (Arcade) */
+	0x09, 0x02,			/* Usage (Coin Door) */
+	0xa1, 0x01,			/* Collection (Application) */
+	0x85, 0x03,			/*   Report ID (3) */
+	0x09, 0x35,			/*   Usage (Coin Drawer Drop Count) */
+	0x15, 0x00,			/*   Logical Minimum (0) */
+	0x27, 0xff, 0xff, 0x00, 0x00,	/*   Logical Maximum (65535) */
+	0x75, 0x10,			/*   Report Size (16) */
+	0x95, 0x01,			/*   Report Count (1) */
+	0x81, 0x02,			/*   Input (Data,Var,Abs) */
+	0x09, 0x36,			/*   Usage (Coin Drawer Start) */
+	0x25, 0x01,			/*   Logical Maximum (1) */
+	0x75, 0x01,			/*   Report Size (1) */
+	0x81, 0x02,			/*   Input (Data,Var,Abs) */
+	0x75, 0x07,			/*   Report Size (7) */
+	0x81, 0x03,			/*   Input (Const) */
+	0x85, 0x04,			/*   Report ID (4) */
+	0x09, 0x35,			/*   Usage (Coin Drawer Drop Count) */
+	0x27, 0xff, 0xff, 0x00, 0x00,	/*   Logical Maximum (65535) */
+	0x75, 0x10,			/*   Report Size (16) */
+	0x81, 0x02,			/*   Input (Data,Var,Abs) */
+	0x09, 0x36,			/*   Usage (Coin Drawer Start) */
+	0x25, 0x01,			/*   Logical Maximum (1) */
+	0x75, 0x01,			/*   Report Size (1) */
+	0x81, 0x02,			/*   Input (Data,Var,Abs) */
+	0x75, 0x07,			/*   Report Size (7) */
+	0x81, 0x03,			/*   Input (Const) */
+	0xc0,				/* End Collection */
+};
+
+/* The joysticks, for --gadget only: hid-input would map these for the
+ * uhid board, and ugcibpf is about the player reports. Two axes and 7
+ * buttons per player, in reports 1 and 2. */
+#define JOYSTICK(id) \
+	0x05, 0x01,			/* Usage Page (Generic Desktop) */ \
+	0x09, 0x04,			/* Usage (Joystick) */ \
+	0xa1, 0x01,			/* Collection (Application) */ \
+	0x85, id,			/*   Report ID */ \
+	0x09, 0x30,			/*   Usage (X) */ \
+	0x09, 0x31,			/*   Usage (Y) */ \
+	0x15, 0x81,			/*   Logical Minimum (-127) */ \
+	0x25, 0x7f,			/*   Logical Maximum (127) */ \
+	0x75, 0x08,			/*   Report Size (8) */ \
+	0x95, 0x02,			/*   Report Count (2) */ \
+	0x81, 0x02,			/*   Input (Data,Var,Abs) */ \
+	0x05, 0x09,			/*   Usage Page (Button) */ \
+	0x19, 0x01,			/*   Usage Minimum (1) */ \
+	0x29, 0x07,			/*   Usage Maximum (7) */ \
+	0x15, 0x00,			/*   Logical Minimum (0) */ \
+	0x25, 0x01,			/*   Logical Maximum (1) */ \
+	0x75, 0x01,			/*   Report Size (1) */ \
+	0x95, 0x07,			/*   Report Count (7) */ \
+	0x81, 0x02,			/*   Input (Data,Var,Abs) */ \
+	0x95, 0x01,			/*   Report Count (1) */ \
+	0x81, 0x03,			/*   Input (Const) */ \
+	0xc0				/* End Collection */
+
+static const unsigned char jdesc[] = { JOYSTICK(0x01), JOYSTICK(0x02) };
+
+/* The rest of the board, for --gadget. Full speed, one HID interface
+ * with an interrupt IN endpoint polled every 1ms. */
+static const unsigned char gadget_device[] = {
+	USB_DT_DEVICE_SIZE, USB_DT_DEVICE, 0x10, 0x01, 0, 0, 0, 64,
+	0x8b, 0x07, 0x30, 0x00, 0x00, 0x01, 1, 2, 0, 1,
+};
+
+#define GADGET_EP_ADDR	(9 + 9 + 9 + 2)
+
+static unsigned char gadget_config[] = {
+	USB_DT_CONFIG_SIZE, USB_DT_CONFIG, 34, 0, 1, 1, 0, 0x80, 50,
+	USB_DT_INTERFACE_SIZE, USB_DT_INTERFACE, 0, 0, 1, USB_CLASS_HID, 0, 0, 0,
+	9, 0x21, 0x11, 0x01, 0, 1, 0x22, sizeof(rdesc) + sizeof(jdesc), 0,
+	USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, USB_DIR_IN | 1, USB_ENDPOINT_XFER_INT, 8, 0, 1,
+};
+
+static const char *gadget_strings[] = { NULL, "Happ Controls", "UGCI (emulated)" };
+
+union gadget_event {
+	struct usb_raw_event ev;
+	unsigned char buf[sizeof(struct usb_raw_event) + sizeof(struct usb_ctrlrequest)];
+};
+
+union gadget_io {
+	struct usb_raw_ep_io io;
+	unsigned char buf[sizeof(struct usb_raw_ep_io) + 256];
+};
+
+static int gadget_ep = -1;
+static pthread_mutex_t gadget_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned short coins[2];
+static unsigned char play[2];
+static signed char stick[2][2];
+static unsigned char buttons[2];
+static char uniq[64];
+
+static int make_report(int player, unsigned char *data)
+{
+	data[0] = player ? 4 : 3;
+	data[1] = coins[player] & 0xff;
+	data[2] = coins[player] >> 8;
+	data[3] = play[player];
+
+	return 4;
+}
+
+static int make_stick_report(int player, unsigned char *data)
+{
+	data[0] = player ? 2 : 1;
+	data[1] = stick[player][0];
+	data[2] = stick[player][1];
+	data[3] = buttons[player];
+
+	return 4;
+}
+
+static int uhid_write(int fd, const struct uhid_event *ev)
+{
+	return write(fd, ev, sizeof(*ev)) == sizeof(*ev) ? 0 : -1;
+}
+
+static int send_report(int fd, int player)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = make_report(player, ev.u.input2.data);
+
+	return uhid_write(fd, &ev);
+}
+
+/* Pick the UDC's interrupt IN endpoint, once it has bound us */
+static void gadget_pick_ep(int fd)
+{
+	struct usb_raw_eps_info info;
+	int i, n;
+
+	memset(&info, 0, sizeof(info));
+	if ((n = ioctl(fd, USB_RAW_IOCTL_EPS_INFO, &info)) < 0)
+		return;
+
+	for (i = 0; i < n; i++) {
+		if (!info.eps[i].caps.type_int || !info.eps[i].caps.dir_in)
+			continue;
+		if (info.eps[i].addr != USB_RAW_EP_ADDR_ANY)
+			gadget_config[GADGET_EP_ADDR] = USB_DIR_IN | info.eps[i].addr;
+		return;
+	}
+}
+
+static int gadget_string(int index, unsigned char *buf)
+{
+	const char *s;
+	int i;
+
+	if (index == 0) {
+		buf[0] = 4;
+		buf[1] = USB_DT_STRING;
+		buf[2] = 0x09;
+		buf[3] = 0x04;
+		return 4;
+	}
+
+	if (index >= (int)(sizeof(gadget_strings) / sizeof(gadget_strings[0])))
+		return -1;
+
+	s = gadget_strings[index];
+	for (i = 0; s[i]; i++) {
+		buf[2 + i * 2] = s[i];
+		buf[3 + i * 2] = 0;
+	}
+	buf[0] = 2 + i * 2;
+	buf[1] = USB_DT_STRING;
+
+	return buf[0];
+}
+
+/* Answer a control request. Anything we do not know is stalled, which
+ * the host takes as not supported. */
+static void gadget_control(int fd, const struct usb_ctrlrequest *c)
+{
+	union gadget_io io;
+	int type = c->bRequestType & USB_TYPE_MASK;
+	int len = -1;
+
+	memset(&io, 0, sizeof(io));
+
+	if (type == USB_TYPE_STANDARD && c->bRequest == USB_REQ_GET_DESCRIPTOR) {
+		switch (c->wValue >> 8) {
+			case USB_DT_DEVICE:
+				memcpy(io.io.data, gadget_device, len = sizeof(gadget_device));
+				break;
+			case USB_DT_CONFIG:
+				memcpy(io.io.data, gadget_config, len = sizeof(gadget_config));
+				break;
+			case USB_DT_STRING:
+				len = gadget_string(c->wValue & 0xff, io.io.data);
+				break;
+			case 0x22:
+				memcpy(io.io.data, rdesc, sizeof(rdesc));
+				memcpy(io.io.data + sizeof(rdesc), jdesc, sizeof(jdesc));
+				len = sizeof(rdesc) + sizeof(jdesc);
+				break;
+		}
+	} else if (type == USB_TYPE_STANDARD && c->bRequest == USB_REQ_SET_CONFIGURATION) {
+		struct usb_endpoint_descriptor ep;
+		unsigned int power = 100;
+
+		/* The endpoint stays enabled if the host configures us again */
+		memcpy(&ep, gadget_config + GADGET_EP_ADDR - 2, USB_DT_ENDPOINT_SIZE);
+		if (gadget_ep < 0)
+			gadget_ep = ioctl(fd, USB_RAW_IOCTL_EP_ENABLE, &ep);
+		if (gadget_ep >= 0) {
+			ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, power);
+			ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0);
+			len = 0;
+		}
+	} else if (type == USB_TYPE_STANDARD && c->bRequest == USB_REQ_SET_INTERFACE) {
+		len = 0;
+	} else if (type == USB_TYPE_CLASS) {
+		switch (c->bRequest) {
+			case 0x0a:	/* SET_IDLE */
+			case 0x09:	/* SET_REPORT */
+				len = c->wLength;
+				break;
+			case 0x01:	/* GET_REPORT */
+				pthread_mutex_lock(&gadget_lock);
+				if (c->wValue == 0x0103 || c->wValue == 0x0104)
+					len = make_report((c->wValue & 0xff) == 4, io.io.data);
+				else if (c->wValue == 0x0101 || c->wValue == 0x0102)
+					len = make_stick_report((c->wValue & 0xff) == 2, io.io.data);
+				pthread_mutex_unlock(&gadget_lock);
+				break;
+		}
+	}
+
+	if (len < 0 || len > (int)(sizeof(io) - sizeof(io.io))) {
+		ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+		return;
+	}
+
+	io.io.length = len < c->wLength ? len : c->wLength;
+
+	if (c->bRequestType & USB_DIR_IN)
+		ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, &io);
+	else
+		ioctl(fd, USB_RAW_IOCTL_EP0_READ, &io);
+}
+
+static void *gadget_ep0(void *arg)
+{
+	union gadget_event e;
+	int fd = *(int *)arg;
+
+	while (1) {
+		memset(&e, 0, sizeof(e));
+		e.ev.length = sizeof(struct usb_ctrlrequest);
+
+		if (ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, &e) < 0)
+			break;
+
+		if (e.ev.type == USB_RAW_EVENT_CONNECT)
+			gadget_pick_ep(fd);
+		else if (e.ev.type == USB_RAW_EVENT_CONTROL)
+			gadget_control(fd, (const struct usb_ctrlrequest *)e.ev.data);
+	}
+
+	return NULL;
+}
+
+/* Blocks until the host takes the report, which it does right away as
+ * long as it keeps transfers queued */
+static int gadget_send(int fd, int player, int joystick)
+{
+	union gadget_io io;
+
+	if (gadget_ep < 0)
+		return -1;
+
+	memset(&io, 0, sizeof(io));
+	io.io.ep = gadget_ep;
+	pthread_mutex_lock(&gadget_lock);
+	if (joystick)
+		io.io.length = make_stick_report(player, io.io.data);
+	else
+		io.io.length = make_report(player, io.io.data);
+	pthread_mutex_unlock(&gadget_lock);
+
+	return ioctl(fd, USB_RAW_IOCTL_EP_WRITE, &io) < 0 ? -1 : 0;
+}
+
+static int gadget_create(void)
+{
+	static int fd;
+	struct usb_raw_init init;
+	pthread_t thread;
+
+	if ((fd = open("/dev/raw-gadget", O_RDWR)) < 0) {
+		perror("/dev/raw-gadget");
+		return -1;
+	}
+
+	memset(&init, 0, sizeof(init));
+	strcpy((char *)init.driver_name, "dummy_udc");
+	strcpy((char *)init.device_name, "dummy_udc.0");
+	init.speed = USB_SPEED_FULL;
+
+	if (ioctl(fd, USB_RAW_IOCTL_INIT, &init) < 0 || ioctl(fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+		perror("raw-gadget");
+		close(fd);
+		return -1;
+	}
+
+	if (pthread_create(&thread, NULL, gadget_ep0, &fd)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Answer what the kernel asks of us; nothing is expected back */
+static void uhid_service(int fd)
+{
+	struct uhid_event ev;
+
+	if (read(fd, &ev, sizeof(ev)) <= 0)
+		return;
+
+	if (ev.type == UHID_GET_REPORT) {
+		struct uhid_event reply;
+
+		memset(&reply, 0, sizeof(reply));
+		reply.type = UHID_GET_REPORT_REPLY;
+		reply.u.get_report_reply.id = ev.u.get_report.id;
+		reply.u.get_report_reply.err = 5; /* EIO */
+		uhid_write(fd, &reply);
+	}
+}
+
+/* The evdev node the kernel made for us, found through our uniq */
+static int open_evdev(void)
+{
+	glob_t g;
+	char line[128];
+	size_t i;
+	int fd = -1;
+
+	if (glob("/sys/bus/hid/devices/*:078B:0030.*/uevent", 0, NULL, &g))
+		return -1;
+
+	for (i = 0; i < g.gl_pathc && fd < 0; i++) {
+		FILE *fp = fopen(g.gl_pathv[i], "r");
+		int match = 0;
+
+		if (!fp)
+			continue;
+		while (fgets(line, sizeof(line), fp))
+			if (!strncmp(line, "HID_UNIQ=", 9) && !strncmp(line + 9, uniq, strlen(uniq)))
+				match = 1;
+		fclose(fp);
+
+		if (match) {
+			glob_t e;
+			char pat[PATH_MAX];
+
+			snprintf(pat, sizeof(pat), "%.*s/input/input*/event*",
+				 (int)(strlen(g.gl_pathv[i]) - 7), g.gl_pathv[i]);
+			if (!glob(pat, 0, NULL, &e)) {
+				snprintf(pat, sizeof(pat), "/dev/input/%s", strrchr(e.gl_pathv[0], '/') + 1);
+				fd = open(pat, O_RDONLY | O_NONBLOCK);
+				globfree(&e);
+			}
+		}
+	}
+
+	globfree(&g);
+
+	return fd;
+}
+
+/* Wait up to ms for a key event, servicing uhid meanwhile */
+static int expect_key(int ufd, int efd, int *code, int *value, int ms)
+{
+	struct pollfd pfd[2] = { { ufd, POLLIN, 0 }, { efd, POLLIN, 0 } };
+	struct input_event ev;
+
+	while (poll(pfd, 2, ms) > 0) {
+		if (pfd[0].revents & POLLIN)
+			uhid_service(ufd);
+		while (read(efd, &ev, sizeof(ev)) == sizeof(ev)) {
+			if (ev.type == EV_KEY) {
+				*code = ev.code;
+				*value = ev.value;
+				return 0;
+			}
+		}
+	}
+
+	return -1;
+}
+
+static int check(int ufd)
+{
+	static const int coin_keys[2] = { KEY_5, KEY_6 };
+	static const int play_keys[2] = { KEY_1, KEY_2 };
+	int efd = -1, p, tries, code, value, failed = 0;
+
+	printf("Waiting for the HID-BPF program to be attached...\n");
+
+	for (tries = 0; tries < 300 && (efd = open_evdev()) < 0; tries++) {
+		struct pollfd pfd = { ufd, POLLIN, 0 };
+
+		if (poll(&pfd, 1, 100) > 0)
+			uhid_service(ufd);
+	}
+
+	if (efd < 0) {
+		printf("FAIL: no evdev node appeared\n");
+		return 1;
+	}
+
+	/* The first report of each player only sets the baseline */
+	for (p = 0; p < 2; p++)
+		send_report(ufd, p);
+
+	for (p = 0; p < 2; p++) {
+		coins[p]++;
+		send_report(ufd, p);
+
+		if (expect_key(ufd, efd, &code, &value, 1000) || code != coin_keys[p] || value != 1 ||
+		    expect_key(ufd, efd, &code, &value, 1000) || code != coin_keys[p] || value != 0) {
+			printf("FAIL: player %d coin\n", p + 1);
+			failed = 1;
+		} else
+			printf("ok: player %d coin\n", p + 1);
+
+		play[p] = 1;
+		send_report(ufd, p);
+		play[p] = 0;
+		if (expect_key(ufd, efd, &code, &value, 1000) || code != play_keys[p] || value != 1 ||
+		    send_report(ufd, p) ||
+		    expect_key(ufd, efd, &code, &value, 1000) || code != play_keys[p] || value != 0) {
+			printf("FAIL: player %d play\n", p + 1);
+			failed = 1;
+		} else
+			printf("ok: player %d play\n", p + 1);
+	}
+
+	close(efd);
+
+	return failed;
+}
+
+static void usage(int exitval) __attribute__((__noreturn__));
+static void usage(int exitval)
+{
+	fprintf(exitval ? stderr : stdout, "Usage: ugciemu [--help] [--check] [--gadget]\n");
+	exit(exitval);
+}
+
+int main(int argc, char *argv[])
+{
+	struct uhid_event ev;
+	int fd, checking = 0, gadget = 0, ret = 0;
+
+	while (1) {
+		int c;
+		static struct option long_options[] = {
+			{"help",	0, NULL, 'h'},
+			{"check",	0, NULL, 'c'},
+			{"gadget",	0, NULL, 'g'},
+			{ 0 },
+		};
+
+		c = getopt_long(argc, argv, "hcg", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'h':
+				usage(0);
+				break;
+
+			case 'c':
+				checking = 1;
+				break;
+
+			case 'g':
+				gadget = 1;
+				break;
+
+			default:
+				usage(1);
+		}
+	}
+
+	if (argc != optind || (checking && gadget))
+		usage(1);
+
+	if (gadget) {
+		char line[32];
+
+		if ((fd = gadget_create()) < 0)
+			exit(1);
+
+		printf("Created emulated board on dummy_udc.0\n");
+		fflush(stdout);
+
+		while (fgets(line, sizeof(line), stdin)) {
+			int p = line[1] == '2', x, y, b;
+
+			if (!strchr("cprs", line[0]))
+				continue;
+			if (line[0] == 's' && sscanf(line + 2, "%d %d %d", &x, &y, &b) != 3)
+				continue;
+
+			pthread_mutex_lock(&gadget_lock);
+			if (line[0] == 'c')
+				coins[p]++;
+			else if (line[0] == 'p' || line[0] == 'r')
+				play[p] = line[0] == 'p';
+			else {
+				stick[p][0] = x;
+				stick[p][1] = y;
+				buttons[p] = b & 0x7f;
+			}
+			pthread_mutex_unlock(&gadget_lock);
+
+			if (gadget_send(fd, p, line[0] == 's'))
+				fprintf(stderr, "Board is not configured yet\n");
+		}
+
+		/* Closing it unplugs the board */
+		close(fd);
+		exit(0);
+	}
+
+	if ((fd = open("/dev/uhid", O_RDWR)) < 0) {
+		perror("/dev/uhid");
+		exit(1);
+	}
+
+	snprintf(uniq, sizeof(uniq), "ugciemu-%d", getpid());
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	strcpy((char *)ev.u.create2.name, "Happ Controls UGCI (emulated)");
+	strcpy((char *)ev.u.create2.uniq, uniq);
+	memcpy(ev.u.create2.rd_data, rdesc, sizeof(rdesc));
+	ev.u.create2.rd_size = sizeof(rdesc);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = 0x078b;
+	ev.u.create2.product = 0x0030;
+
+	if (uhid_write(fd, &ev)) {
+		perror("UHID_CREATE2");
+		exit(1);
+	}
+
+	printf("Created emulated board %s\n", uniq);
+
+	if (checking)
+		ret = check(fd);
+	else {
+		struct pollfd pfd[2] = { { 0, POLLIN, 0 }, { fd, POLLIN, 0 } };
+		char line[32];
+
+		while (poll(pfd, 2, -1) > 0) {
+			int p;
+
+			if (pfd[1].revents & POLLIN)
+				uhid_service(fd);
+			if (!(pfd[0].revents & POLLIN))
+				continue;
+			if (!fgets(line, sizeof(line), stdin))
+				break;
+
+			p = line[1] == '2';
+			if (line[0] == 'c')
+				coins[p]++;
+			else if (line[0] == 'p' || line[0] == 'r')
+				play[p] = line[0] == 'p';
+			else
+				continue;
+			send_report(fd, p);
+		}
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	uhid_write(fd, &ev);
+	close(fd);
+
+	exit(ret);
+}
@@ -81,6 +81,7 @@
 #include <linux/slab.h>
 #include <linux/stat.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/usb/input.h>
 #include <linux/usb/quirks.h>
 
@@ -577,6 +578,9 @@ struct usb_xpad
     dma_addr_t odata_dma;
     spinlock_t odata_lock;
 
+    struct xpad360w_pool *pool; /* shared receiver buffers, if any */
+    int pool_slot;
+
     struct xpad_output_packet out_packets[XPAD_NUM_OUT_PACKETS];
     int last_out_packet;
     int init_seq;
@@ -598,6 +602,205 @@ static int xpad_init_input(struct usb_xpad *xpad);
 static void xpad_deinit_input(struct usb_xpad *xpad);
 static void xpadone_ack_mode_report(struct usb_xpad *xpad, u8 seq_num);
 
+/*
+ * The wireless receiver exposes one interface per pad slot, and each of
+ * them needs an input and an output URB with a small coherent buffer.
+ * Rather than doing 8 tiny DMA allocations per receiver, all slots of a
+ * receiver share a single coherent block and a set of URBs. The pool
+ * outlives its interfaces, so an unbind and rebind (driver reload through
+ * sysfs, reset, resume with reset) finds it again instead of allocating
+ * anew. It is only freed once the receiver is gone from the bus, or on
+ * module unload. A receiver that is unplugged and plugged back in is a
+ * new usb_device, and gets a new pool.
+ */
+#define XPAD360W_POOL_SLOTS 4
+
+struct xpad360w_pool
+{
+    struct list_head node;
+    struct usb_device *udev;
+    int users;
+    unsigned long slots_used;
+
+    unsigned char *data; /* idata/odata pairs, one per slot */
+    dma_addr_t data_dma;
+    struct urb *irq_in[XPAD360W_POOL_SLOTS];
+    struct urb *irq_out[XPAD360W_POOL_SLOTS];
+};
+
+static LIST_HEAD(xpad360w_pools);
+static DEFINE_MUTEX(xpad360w_pools_mutex);
+
+static void xpad360w_pool_free(struct xpad360w_pool *pool)
+{
+    int i;
+
+    for (i = 0; i < XPAD360W_POOL_SLOTS; i++)
+    {
+        usb_free_urb(pool->irq_in[i]);
+        usb_free_urb(pool->irq_out[i]);
+    }
+
+    usb_free_coherent(pool->udev, 2 * XPAD360W_POOL_SLOTS * XPAD_PKT_LEN,
+                      pool->data, pool->data_dma);
+    usb_put_dev(pool->udev);
+    kfree(pool);
+}
+
+static struct xpad360w_pool *xpad360w_pool_alloc(struct usb_device *udev)
+{
+    struct xpad360w_pool *pool;
+    int i;
+
+    pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+    if (!pool)
+        return NULL;
+
+    pool->udev = usb_get_dev(udev);
+    pool->data = usb_alloc_coherent(udev, 2 * XPAD360W_POOL_SLOTS * XPAD_PKT_LEN,
+                                    GFP_KERNEL, &pool->data_dma);
+    if (!pool->data)
+        goto err_free;
+
+    for (i = 0; i < XPAD360W_POOL_SLOTS; i++)
+    {
+        pool->irq_in[i] = usb_alloc_urb(0, GFP_KERNEL);
+        pool->irq_out[i] = usb_alloc_urb(0, GFP_KERNEL);
+        if (!pool->irq_in[i] || !pool->irq_out[i])
+            goto err_free;
+    }
+
+    return pool;
+
+err_free:
+    xpad360w_pool_free(pool);
+    return NULL;
+}
+
+/* Free the idle pools of receivers that have left the bus */
+static void xpad360w_pool_reap(void)
+{
+    struct xpad360w_pool *pool, *next;
+
+    list_for_each_entry_safe(pool, next, &xpad360w_pools, node)
+    {
+        if (!pool->users && pool->udev->state == USB_STATE_NOTATTACHED)
+        {
+            list_del(&pool->node);
+            xpad360w_pool_free(pool);
+        }
+    }
+}
+
+/*
+ * Claim the pool slot for this interface, creating the receiver's pool
+ * on first use. Returns -EBUSY if the interface does not map onto a free
+ * slot, or -ENOMEM if the pool could not be allocated. In both cases the
+ * caller falls back to private buffers.
+ */
+static int xpad360w_pool_get(struct usb_xpad *xpad)
+{
+    struct xpad360w_pool *pool;
+    int slot = xpad->intf->cur_altsetting->desc.bInterfaceNumber / 2;
+    int error = 0;
+
+    if (slot >= XPAD360W_POOL_SLOTS)
+        return -EBUSY;
+
+    mutex_lock(&xpad360w_pools_mutex);
+
+    xpad360w_pool_reap();
+
+    list_for_each_entry(pool, &xpad360w_pools, node)
+    {
+        if (pool->udev == xpad->udev)
+            goto found;
+    }
+
+    pool = xpad360w_pool_alloc(xpad->udev);
+    if (!pool)
+    {
+        error = -ENOMEM;
+        goto out;
+    }
+    list_add(&pool->node, &xpad360w_pools);
+
+found:
+    if (test_bit(slot, &pool->slots_used))
+    {
+        error = -EBUSY;
+        goto out;
+    }
+
+    set_bit(slot, &pool->slots_used);
+    pool->users++;
+
+    xpad->pool = pool;
+    xpad->pool_slot = slot;
+    xpad->idata = pool->data + 2 * slot * XPAD_PKT_LEN;
+    xpad->idata_dma = pool->data_dma + 2 * slot * XPAD_PKT_LEN;
+    xpad->odata = xpad->idata + XPAD_PKT_LEN;
+    xpad->odata_dma = xpad->idata_dma + XPAD_PKT_LEN;
+    xpad->irq_in = pool->irq_in[slot];
+    xpad->irq_out = pool->irq_out[slot];
+
+out:
+    mutex_unlock(&xpad360w_pools_mutex);
+    return error;
+}
+
+static void xpad360w_pool_put(struct usb_xpad *xpad)
+{
+    struct xpad360w_pool *pool = xpad->pool;
+
+    mutex_lock(&xpad360w_pools_mutex);
+
+    clear_bit(xpad->pool_slot, &pool->slots_used);
+    pool->users--;
+
+    /* Keep it for a rebind, unless the receiver was unplugged */
+    xpad360w_pool_reap();
+
+    mutex_unlock(&xpad360w_pools_mutex);
+
+    xpad->pool = NULL;
+}
+
+static int xpad_alloc_in(struct usb_xpad *xpad)
+{
+    /* Without a pool slot, allocate privately as other pads do */
+    if (xpad->xtype == XTYPE_XBOX360W && !xpad360w_pool_get(xpad))
+        return 0;
+
+    xpad->idata = usb_alloc_coherent(xpad->udev, XPAD_PKT_LEN,
+                                     GFP_KERNEL, &xpad->idata_dma);
+    if (!xpad->idata)
+        return -ENOMEM;
+
+    xpad->irq_in = usb_alloc_urb(0, GFP_KERNEL);
+    if (!xpad->irq_in)
+    {
+        usb_free_coherent(xpad->udev, XPAD_PKT_LEN,
+                          xpad->idata, xpad->idata_dma);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static void xpad_free_in(struct usb_xpad *xpad)
+{
+    if (xpad->pool)
+    {
+        xpad360w_pool_put(xpad);
+        return;
+    }
+
+    usb_free_urb(xpad->irq_in);
+    usb_free_coherent(xpad->udev, XPAD_PKT_LEN,
+                      xpad->idata, xpad->idata_dma);
+}
+
 /*
  *	xpad_process_packet
  *
@@ -1144,19 +1347,22 @@ static int xpad_init_output(struct usb_interface *intf, struct usb_xpad *xpad,
         return 0;
 
     init_usb_anchor(&xpad->irq_out_anchor);
-
-    xpad->odata = usb_alloc_coherent(xpad->udev, XPAD_PKT_LEN,
-                                     GFP_KERNEL, &xpad->odata_dma);
-    if (!xpad->odata)
-        return -ENOMEM;
-
     spin_lock_init(&xpad->odata_lock);
 
-    xpad->irq_out = usb_alloc_urb(0, GFP_KERNEL);
-    if (!xpad->irq_out)
+    /* Pooled interfaces already have their output buffer and URB */
+    if (!xpad->pool)
     {
-        error = -ENOMEM;
-        goto err_free_coherent;
+        xpad->odata = usb_alloc_coherent(xpad->udev, XPAD_PKT_LEN,
+                                         GFP_KERNEL, &xpad->odata_dma);
+        if (!xpad->odata)
+            return -ENOMEM;
+
+        xpad->irq_out = usb_alloc_urb(0, GFP_KERNEL);
+        if (!xpad->irq_out)
+        {
+            error = -ENOMEM;
+            goto err_free_coherent;
+        }
     }
 
     usb_fill_int_urb(xpad->irq_out, xpad->udev,
@@ -1189,7 +1395,7 @@ static void xpad_stop_output(struct usb_xpad *xpad)
 
 static void xpad_deinit_output(struct usb_xpad *xpad)
 {
-    if (xpad->xtype != XTYPE_UNKNOWN)
+    if (xpad->xtype != XTYPE_UNKNOWN && !xpad->pool)
     {
         usb_free_urb(xpad->irq_out);
         usb_free_coherent(xpad->udev, XPAD_PKT_LEN,
@@ -1816,21 +2022,6 @@ static int xpad_probe(struct usb_interface *intf, const struct usb_device_id *id
     usb_make_path(udev, xpad->phys, sizeof(xpad->phys));
     strlcat(xpad->phys, "/input0", sizeof(xpad->phys));
 
-    xpad->idata = usb_alloc_coherent(udev, XPAD_PKT_LEN,
-                                     GFP_KERNEL, &xpad->idata_dma);
-    if (!xpad->idata)
-    {
-        error = -ENOMEM;
-        goto err_free_mem;
-    }
-
-    xpad->irq_in = usb_alloc_urb(0, GFP_KERNEL);
-    if (!xpad->irq_in)
-    {
-        error = -ENOMEM;
-        goto err_free_idata;
-    }
-
     xpad->udev = udev;
     xpad->intf = intf;
     xpad->mapping = xpad_device[i].mapping;
@@ -1871,9 +2062,13 @@ static int xpad_probe(struct usb_interface *intf, const struct usb_device_id *id
 		 * interface number.
 		 */
         error = -ENODEV;
-        goto err_free_in_urb;
+        goto err_free_mem;
     }
 
+    error = xpad_alloc_in(xpad);
+    if (error)
+        goto err_free_mem;
+
     ep_irq_in = ep_irq_out = NULL;
 
     for (i = 0; i < 2; i++)
@@ -1941,9 +2136,7 @@ static int xpad_probe(struct usb_interface *intf, const struct usb_device_id *id
 err_deinit_output:
     xpad_deinit_output(xpad);
 err_free_in_urb:
-    usb_free_urb(xpad->irq_in);
-err_free_idata:
-    usb_free_coherent(udev, XPAD_PKT_LEN, xpad->idata, xpad->idata_dma);
+    xpad_free_in(xpad);
 err_free_mem:
     kfree(xpad);
     return error;
@@ -1966,9 +2159,7 @@ static void xpad_disconnect(struct usb_interface *intf)
 
     xpad_deinit_output(xpad);
 
-    usb_free_urb(xpad->irq_in);
-    usb_free_coherent(xpad->udev, XPAD_PKT_LEN,
-                      xpad->idata, xpad->idata_dma);
+    xpad_free_in(xpad);
 
     kfree(xpad);
 
@@ -2052,7 +2243,27 @@ static struct usb_driver xpad_driver = {
     .id_table = xpad_table,
 };
 
-module_usb_driver(xpad_driver);
+static int __init xpad_init(void)
+{
+    return usb_register(&xpad_driver);
+}
+
+static void __exit xpad_exit(void)
+{
+    struct xpad360w_pool *pool, *next;
+
+    usb_deregister(&xpad_driver);
+
+    /* Every interface is unbound by now, only idle pools are left */
+    list_for_each_entry_safe(pool, next, &xpad360w_pools, node)
+    {
+        list_del(&pool->node);
+        xpad360w_pool_free(pool);
+    }
+}
+
+module_init(xpad_init);
+module_exit(xpad_exit);
 
 MODULE_AUTHOR("Marko Friedemann <mfr@bmx-chemnitz.de>");
 MODULE_DESCRIPTION("X-Box pad driver");